@@ -0,0 +1,58 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The part of ngx_config.h the zone core needs, for the standalone
+ * benchmarks; it is not used when the module is built with nginx.
+ */
+
+
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+
+
+typedef intptr_t        ngx_int_t;
+typedef uintptr_t       ngx_uint_t;
+typedef intptr_t        ngx_flag_t;
+
+
+#define NGX_PTR_SIZE             __SIZEOF_POINTER__
+#define NGX_HAVE_ATOMIC_OPS      1
+
+#if (__linux__)
+#define NGX_HAVE_CLOCK_MONOTONIC 1
+#endif
+
+#define NGX_ALIGNMENT            sizeof(unsigned long)
+
+#define NGX_INT_T_LEN            NGX_INT64_LEN
+#define NGX_INT64_LEN            (sizeof("-9223372036854775808") - 1)
+
+#define ngx_align(d, a)     (((d) + (a - 1)) & ~(a - 1))
+#define ngx_align_ptr(p, a)                                                   \
+    (u_char *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
+
+#define ngx_inline      inline
+
+
+#endif /* _NGX_CONFIG_H_INCLUDED_ */
@@ -0,0 +1,416 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The part of the nginx core the zone core needs, for the standalone
+ * benchmarks: the rbtree and the queue as in nginx, a spinlock shmtx,
+ * a slab pool with per-size free lists, and a clock that only moves
+ * when the benchmark moves it.
+ */
+
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+
+
+#define  NGX_OK          0
+#define  NGX_ERROR      -1
+#define  NGX_AGAIN      -2
+#define  NGX_BUSY       -3
+#define  NGX_DONE       -4
+#define  NGX_DECLINED   -5
+#define  NGX_ABORT      -6
+
+#define NGX_CONF_UNSET       -1
+
+
+#define ngx_abs(value)       (((value) >= 0) ? (value) : - (value))
+#define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
+#define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
+
+
+typedef ngx_uint_t  ngx_msec_t;
+typedef ngx_int_t   ngx_msec_int_t;
+
+
+/* atomics */
+
+typedef long                        ngx_atomic_int_t;
+typedef unsigned long               ngx_atomic_uint_t;
+typedef volatile ngx_atomic_uint_t  ngx_atomic_t;
+
+#define ngx_atomic_cmp_set(lock, old, set)                                    \
+    __sync_bool_compare_and_swap(lock, old, set)
+
+#define ngx_atomic_fetch_add(value, add)                                      \
+    __sync_fetch_and_add(value, add)
+
+#define ngx_memory_barrier()        __sync_synchronize()
+
+#if (__i386__ || __x86_64__)
+#define ngx_cpu_pause()             __asm__ ("pause")
+#else
+#define ngx_cpu_pause()
+#endif
+
+
+/* strings */
+
+typedef struct {
+    size_t      len;
+    u_char     *data;
+} ngx_str_t;
+
+#define ngx_string(str)     { sizeof(str) - 1, (u_char *) str }
+#define ngx_null_string     { 0, NULL }
+#define ngx_str_set(str, text)                                                \
+    (str)->len = sizeof(text) - 1; (str)->data = (u_char *) text
+
+#define ngx_strcmp(s1, s2)  strcmp((const char *) s1, (const char *) s2)
+
+#define ngx_memzero(buf, n)       (void) memset(buf, 0, n)
+#define ngx_memset(buf, c, n)     (void) memset(buf, c, n)
+#define ngx_memcpy(dst, src, n)   (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n)   (((u_char *) memcpy(dst, src, n)) + (n))
+#define ngx_memcmp(s1, s2, n)                                                 \
+    memcmp((const char *) s1, (const char *) s2, n)
+
+#define ngx_memmove(dst, src, n)  (void) memmove(dst, src, n)
+
+ngx_int_t ngx_memn2cmp(u_char *s1, u_char *s2, size_t n1, size_t n2);
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...);
+u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt,
+    va_list args);
+
+
+/* memory and errors */
+
+#define ngx_alloc(size, log)      malloc(size)
+#define ngx_free                  free
+
+typedef int                       ngx_err_t;
+
+#define ngx_errno                 errno
+#define NGX_ENOENT                ENOENT
+#define NGX_ESRCH                 ESRCH
+
+#define ngx_msleep(ms)            (void) usleep(ms * 1000)
+#define ngx_sched_yield()         (void) usleep(0)
+
+
+/* log, errors only */
+
+#define NGX_LOG_STDERR            0
+#define NGX_LOG_EMERG             1
+#define NGX_LOG_ALERT             2
+#define NGX_LOG_CRIT              3
+#define NGX_LOG_ERR               4
+#define NGX_LOG_WARN              5
+#define NGX_LOG_NOTICE            6
+#define NGX_LOG_INFO              7
+#define NGX_LOG_DEBUG             8
+
+#define NGX_LOG_DEBUG_HTTP        0x100
+
+typedef struct {
+    ngx_uint_t  log_level;
+} ngx_log_t;
+
+#define ngx_log_error(level, log, ...)                                        \
+    if ((log)->log_level >= level) ngx_log_error_core(level, log, __VA_ARGS__)
+
+void ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, int err,
+    const char *fmt, ...);
+
+#define ngx_log_debug0(level, log, err, fmt)
+#define ngx_log_debug1(level, log, err, fmt, arg1)
+#define ngx_log_debug2(level, log, err, fmt, arg1, arg2)
+#define ngx_log_debug3(level, log, err, fmt, arg1, arg2, arg3)
+#define ngx_log_debug4(level, log, err, fmt, arg1, arg2, arg3, arg4)
+#define ngx_log_debug5(level, log, err, fmt, arg1, arg2, arg3, arg4, arg5)
+#define ngx_log_debug6(level, log, err, fmt,                                  \
+                       arg1, arg2, arg3, arg4, arg5, arg6)
+#define ngx_log_debug7(level, log, err, fmt,                                  \
+                       arg1, arg2, arg3, arg4, arg5, arg6, arg7)
+
+
+typedef struct {
+    ngx_log_t  *log;
+} ngx_cycle_t;
+
+typedef pid_t  ngx_pid_t;
+
+extern volatile ngx_cycle_t  *ngx_cycle;
+extern ngx_uint_t             ngx_worker;
+extern ngx_uint_t             ngx_pagesize;
+extern ngx_pid_t              ngx_pid;
+extern ngx_int_t              ngx_ncpu;
+
+
+/* files */
+
+typedef int                   ngx_fd_t;
+
+#define NGX_INVALID_FILE      -1
+#define NGX_FILE_ERROR        -1
+
+#define NGX_FILE_RDONLY       O_RDONLY
+#define NGX_FILE_WRONLY       O_WRONLY
+#define NGX_FILE_OPEN         0
+#define NGX_FILE_TRUNCATE     (O_CREAT|O_TRUNC)
+#define NGX_FILE_DEFAULT_ACCESS  0644
+
+#define ngx_open_file(name, mode, create, access)                             \
+    open((const char *) name, mode|create, access)
+#define ngx_open_file_n       "open()"
+
+#define ngx_close_file        close
+#define ngx_close_file_n      "close()"
+
+#define ngx_delete_file(name)  unlink((const char *) name)
+#define ngx_delete_file_n     "unlink()"
+
+#define ngx_rename_file(o, n)  rename((const char *) o, (const char *) n)
+#define ngx_rename_file_n     "rename()"
+
+#define ngx_read_fd           read
+#define ngx_read_fd_n         "read()"
+
+#define ngx_write_fd          write
+#define ngx_write_fd_n        "write()"
+
+
+/* arrays, allocated by the caller */
+
+typedef struct {
+    void        *elts;
+    ngx_uint_t   nelts;
+    size_t       size;
+    ngx_uint_t   nalloc;
+    void        *pool;
+} ngx_array_t;
+
+
+/* time */
+
+typedef struct {
+    time_t      sec;
+    ngx_uint_t  msec;
+    ngx_int_t   gmtoff;
+} ngx_time_t;
+
+extern volatile ngx_time_t  *ngx_cached_time;
+extern volatile ngx_msec_t   ngx_current_msec;
+
+#define ngx_time()           ngx_cached_time->sec
+#define ngx_timeofday()      (ngx_time_t *) ngx_cached_time
+#define ngx_gettimeofday(tp)  (void) gettimeofday(tp, NULL);
+
+/* sets the cached time, the only clock the zone core sees */
+void ngx_time_set(ngx_msec_t msec);
+
+
+/* crc32 */
+
+void ngx_crc32_table_init(void);
+void ngx_crc32_update(uint32_t *crc, u_char *p, size_t len);
+
+
+/* queue */
+
+typedef struct ngx_queue_s  ngx_queue_t;
+
+struct ngx_queue_s {
+    ngx_queue_t  *prev;
+    ngx_queue_t  *next;
+};
+
+#define ngx_queue_init(q)                                                     \
+    (q)->prev = q;                                                            \
+    (q)->next = q
+
+#define ngx_queue_empty(h)                                                    \
+    (h == (h)->prev)
+
+#define ngx_queue_insert_head(h, x)                                           \
+    (x)->next = (h)->next;                                                    \
+    (x)->next->prev = x;                                                      \
+    (x)->prev = h;                                                            \
+    (h)->next = x
+
+#define ngx_queue_insert_tail(h, x)                                           \
+    (x)->prev = (h)->prev;                                                    \
+    (x)->prev->next = x;                                                      \
+    (x)->next = h;                                                            \
+    (h)->prev = x
+
+#define ngx_queue_head(h)           (h)->next
+#define ngx_queue_last(h)           (h)->prev
+#define ngx_queue_sentinel(h)       (h)
+#define ngx_queue_next(q)           (q)->next
+#define ngx_queue_prev(q)           (q)->prev
+
+#define ngx_queue_remove(x)                                                   \
+    (x)->next->prev = (x)->prev;                                              \
+    (x)->prev->next = (x)->next
+
+#define ngx_queue_data(q, type, link)                                         \
+    (type *) ((u_char *) q - offsetof(type, link))
+
+
+/* rbtree */
+
+typedef ngx_uint_t  ngx_rbtree_key_t;
+typedef ngx_int_t   ngx_rbtree_key_int_t;
+
+typedef struct ngx_rbtree_node_s  ngx_rbtree_node_t;
+
+struct ngx_rbtree_node_s {
+    ngx_rbtree_key_t       key;
+    ngx_rbtree_node_t     *left;
+    ngx_rbtree_node_t     *right;
+    ngx_rbtree_node_t     *parent;
+    u_char                 color;
+    u_char                 data;
+};
+
+typedef struct ngx_rbtree_s  ngx_rbtree_t;
+
+typedef void (*ngx_rbtree_insert_pt) (ngx_rbtree_node_t *root,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+struct ngx_rbtree_s {
+    ngx_rbtree_node_t     *root;
+    ngx_rbtree_node_t     *sentinel;
+    ngx_rbtree_insert_pt   insert;
+};
+
+#define ngx_rbtree_init(tree, s, i)                                           \
+    ngx_rbtree_sentinel_init(s);                                              \
+    (tree)->root = s;                                                         \
+    (tree)->sentinel = s;                                                     \
+    (tree)->insert = i
+
+void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+void ngx_rbtree_insert_value(ngx_rbtree_node_t *root, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+ngx_rbtree_node_t *ngx_rbtree_next(ngx_rbtree_t *tree,
+    ngx_rbtree_node_t *node);
+
+#define ngx_rbtree_data(node, type, link)                                     \
+    (type *) ((u_char *) (node) - offsetof(type, link))
+
+#define ngx_rbt_red(node)               ((node)->color = 1)
+#define ngx_rbt_black(node)             ((node)->color = 0)
+#define ngx_rbt_is_red(node)            ((node)->color)
+#define ngx_rbt_is_black(node)          (!ngx_rbt_is_red(node))
+#define ngx_rbt_copy_color(n1, n2)      (n1->color = n2->color)
+
+#define ngx_rbtree_sentinel_init(node)  ngx_rbt_black(node)
+
+static ngx_inline ngx_rbtree_node_t *
+ngx_rbtree_min(ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    while (node->left != sentinel) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+
+/* shmtx, a spinlock in the shared memory */
+
+typedef struct {
+    ngx_atomic_t   lock;
+    ngx_atomic_t   wait;
+} ngx_shmtx_sh_t;
+
+typedef struct {
+    ngx_atomic_t  *lock;
+    ngx_uint_t     spin;
+} ngx_shmtx_t;
+
+ngx_int_t ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr,
+    u_char *name);
+ngx_uint_t ngx_shmtx_trylock(ngx_shmtx_t *mtx);
+void ngx_shmtx_lock(ngx_shmtx_t *mtx);
+void ngx_shmtx_unlock(ngx_shmtx_t *mtx);
+ngx_uint_t ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid);
+
+
+/*
+ * slab pool; chunks up to half a page are rounded up to a power of two and
+ * carved from pages of their size, which are not given back to the pool,
+ * larger allocations take runs of pages, freed runs are reused first fit
+ */
+
+#define NGX_SLAB_CLASSES       16
+
+typedef struct {
+    ngx_shmtx_sh_t    lock;
+
+    size_t            min_size;
+    size_t            min_shift;
+
+    ngx_uint_t        pfree;
+
+    u_char           *start;
+    u_char           *end;
+
+    ngx_shmtx_t       mutex;
+
+    u_char           *log_ctx;
+    u_char            zero;
+
+    unsigned          log_nomem:1;
+
+    void             *data;
+    void             *addr;
+
+    /* the class of each page, or the number of pages of a run */
+    ngx_uint_t       *pages;
+    u_char           *next;
+    void             *chunks[NGX_SLAB_CLASSES];
+    void             *runs;
+} ngx_slab_pool_t;
+
+void ngx_slab_init(ngx_slab_pool_t *pool);
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+
+
+/* shared memory */
+
+typedef struct {
+    u_char      *addr;
+    size_t       size;
+    ngx_str_t    name;
+    ngx_log_t   *log;
+    ngx_uint_t   exists;   /* unsigned  exists:1;  */
+} ngx_shm_t;
+
+typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
+
+struct ngx_shm_zone_s {
+    void        *data;
+    ngx_shm_t    shm;
+};
+
+/* maps the zone shared, so that it survives fork(), and inits its pool */
+ngx_int_t ngx_shm_zone_alloc(ngx_shm_zone_t *shm_zone);
+void ngx_shm_zone_free(ngx_shm_zone_t *shm_zone);
+
+
+#endif /* _NGX_CORE_H_INCLUDED_ */
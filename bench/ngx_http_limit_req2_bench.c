@@ -0,0 +1,291 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Decisions per second of the zone core outside of nginx.  Every decision
+ * hashes the key and calls ngx_http_limit_req2_account(), as the handler
+ * does for a rule; the key indices are drawn before the timing starts.
+ *
+ * The workloads are uniform and Zipfian keys from a key space of a given
+ * fraction of the capacity of the zone, and churn, where every key is new
+ * and, in a full zone, evicts the oldest one.  The capacity is measured
+ * first, as the number of keys inserted before the first eviction.
+ */
+
+
+#include "ngx_http_limit_req2_bench.h"
+
+
+typedef struct {
+    bench_conf_t                  conf;
+    ngx_uint_t                    n;
+    double                        fills[8];
+    ngx_uint_t                    nfills;
+    ngx_uint_t                    workloads[3];
+    ngx_uint_t                    nworkloads;
+} bench_single_t;
+
+
+static ngx_uint_t
+bench_capacity(bench_conf_t *bc)
+{
+    uint32_t                      k;
+    ngx_uint_t                    n;
+    bench_zone_t                  bz;
+    ngx_http_limit_req2_stats_t  *st;
+
+    if (bench_zone_init(&bz, bc) != NGX_OK) {
+        return 0;
+    }
+
+    st = ngx_http_limit_req2_worker_stats(&bz.ctx);
+
+    for (k = 0; st->evicted == 0 && st->alloc_failed == 0; k++) {
+        (void) bench_decide(&bz, bc, k);
+    }
+
+    n = bench_nodes(&bz);
+
+    bench_zone_done(&bz);
+
+    return n;
+}
+
+
+static ngx_int_t
+bench_run(bench_single_t *bs, ngx_uint_t workload, double fill,
+    ngx_uint_t capacity, uint32_t *draws, double *cdf)
+{
+    uint64_t                      start, elapsed;
+    uint32_t                      k;
+    ngx_uint_t                    i, nkeys;
+    bench_zone_t                  bz;
+    ngx_http_limit_req2_stats_t   before, after;
+
+    nkeys = (ngx_uint_t) (capacity * fill);
+    if (nkeys == 0) {
+        nkeys = 1;
+    }
+
+    if (workload == BENCH_WORKLOAD_ZIPF) {
+        bench_zipf(cdf, nkeys, bs->conf.zipf_s);
+    }
+
+    bench_draw(workload, nkeys, cdf, draws, bs->n, 0);
+
+    if (bench_zone_init(&bz, &bs->conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* every key of the key space is in the zone, unless it does not fit */
+
+    for (k = 0; k < nkeys; k++) {
+        (void) bench_decide(&bz, &bs->conf, k);
+    }
+
+    bench_stats(&bz, &before);
+
+    start = bench_nsec();
+
+    for (i = 0; i < bs->n; i++) {
+        (void) bench_decide(&bz, &bs->conf, draws[i]);
+    }
+
+    elapsed = bench_nsec() - start;
+
+    bench_stats(&bz, &after);
+
+    printf("%-8s %6.2f %10lu %9.1f %10lu %10lu %10lu %10lu\n",
+           bench_workload_names[workload], fill, (unsigned long) nkeys,
+           (double) elapsed / bs->n,
+           (unsigned long) (after.passed - before.passed),
+           (unsigned long) (after.rejected - before.rejected),
+           (unsigned long) (after.evicted - before.evicted),
+           (unsigned long) bench_nodes(&bz));
+
+    bench_zone_done(&bz);
+
+    return NGX_OK;
+}
+
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+        "usage: ngx_http_limit_req2_bench [options]\n"
+        BENCH_COMMON_USAGE
+        "  -n N         timed decisions per run, 2000000\n"
+        "  -m N         decisions per virtual millisecond, 1000\n"
+        "  -f F,...     key space as fractions of the capacity, "
+                        "0.1,0.5,0.9,2\n"
+        "  -w W,...     uniform, zipf and churn, all of them\n");
+}
+
+
+static ngx_int_t
+bench_options(bench_single_t *bs, int argc, char **argv)
+{
+    int          c;
+    char        *p, *s;
+    ngx_int_t    rc;
+    ngx_uint_t   i;
+
+    bench_conf_init(&bs->conf);
+
+    bs->n = 2000000;
+
+    bs->fills[0] = 0.1;
+    bs->fills[1] = 0.5;
+    bs->fills[2] = 0.9;
+    bs->fills[3] = 2;
+    bs->nfills = 4;
+
+    bs->workloads[0] = BENCH_WORKLOAD_UNIFORM;
+    bs->workloads[1] = BENCH_WORKLOAD_ZIPF;
+    bs->workloads[2] = BENCH_WORKLOAD_CHURN;
+    bs->nworkloads = 3;
+
+    while ((c = getopt(argc, argv, BENCH_COMMON_OPTIONS "n:m:f:w:")) != -1) {
+
+        rc = bench_option(&bs->conf, c, optarg);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
+        switch (c) {
+
+        case 'n':
+            bs->n = atol(optarg);
+            break;
+
+        case 'm':
+            bs->conf.per_ms = atol(optarg);
+            break;
+
+        case 'f':
+            bs->nfills = 0;
+
+            for (s = strtok_r(optarg, ",", &p);
+                 s && bs->nfills < 8;
+                 s = strtok_r(NULL, ",", &p))
+            {
+                bs->fills[bs->nfills++] = atof(s);
+            }
+            break;
+
+        case 'w':
+            bs->nworkloads = 0;
+
+            for (s = strtok_r(optarg, ",", &p);
+                 s && bs->nworkloads < 3;
+                 s = strtok_r(NULL, ",", &p))
+            {
+                for (i = 0; bench_workload_names[i]; i++) {
+                    if (strcmp(s, bench_workload_names[i]) == 0) {
+                        break;
+                    }
+                }
+
+                if (bench_workload_names[i] == NULL) {
+                    return NGX_ERROR;
+                }
+
+                bs->workloads[bs->nworkloads++] = i;
+            }
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+    }
+
+    if (bs->n == 0 || bs->conf.per_ms == 0 || bs->nfills == 0) {
+        return NGX_ERROR;
+    }
+
+    return bench_conf_done(&bs->conf);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    double          *cdf, max;
+    uint32_t        *draws;
+    ngx_uint_t       i, j, capacity;
+    bench_conf_t    *bc;
+    bench_single_t   bs;
+
+    if (bench_options(&bs, argc, argv) != NGX_OK) {
+        bench_usage();
+        return 1;
+    }
+
+    bc = &bs.conf;
+
+    ngx_pagesize = getpagesize();
+    ngx_crc32_table_init();
+
+    draws = malloc(bs.n * sizeof(uint32_t));
+    if (draws == NULL) {
+        return 1;
+    }
+
+    capacity = bench_capacity(bc);
+    if (capacity == 0) {
+        fprintf(stderr, "the zone could not be created\n");
+        return 1;
+    }
+
+    max = 0;
+
+    for (i = 0; i < bs.nfills; i++) {
+        max = ngx_max(max, bs.fills[i]);
+    }
+
+    cdf = malloc((size_t) (capacity * max + 1) * sizeof(double));
+    if (cdf == NULL) {
+        return 1;
+    }
+
+    bench_conf_print(bc);
+
+    printf("capacity %lu keys, %lu decisions per run\n\n",
+           (unsigned long) capacity, (unsigned long) bs.n);
+
+    printf("%-8s %6s %10s %9s %10s %10s %10s %10s\n",
+           "workload", "fill", "keys", "ns/op", "passed", "rejected",
+           "evicted", "nodes");
+
+    for (i = 0; i < bs.nworkloads; i++) {
+        for (j = 0; j < bs.nfills; j++) {
+
+            /* the zone is always full under churn, one run is enough */
+
+            if (bs.workloads[i] == BENCH_WORKLOAD_CHURN && j > 0) {
+                break;
+            }
+
+            if (bench_run(&bs, bs.workloads[i],
+                          bs.workloads[i] == BENCH_WORKLOAD_CHURN
+                          ? 1.0 : bs.fills[j],
+                          capacity, draws, cdf)
+                != NGX_OK)
+            {
+                fprintf(stderr, "the zone could not be created\n");
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_LIMIT_REQ2_BENCH_H_INCLUDED_
+#define _NGX_HTTP_LIMIT_REQ2_BENCH_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <math.h>
+#include "ngx_http_limit_req2_core.h"
+
+
+#define BENCH_WORKLOAD_UNIFORM  0
+#define BENCH_WORKLOAD_ZIPF     1
+#define BENCH_WORKLOAD_CHURN    2
+
+#define BENCH_COMMON_OPTIONS    "z:s:i:H:a:Lr:b:DB:k:Z:"
+
+#define BENCH_COMMON_USAGE                                                    \
+    "  -z MB        zone size, 32\n"                                          \
+    "  -s N         shards, 1\n"                                              \
+    "  -i INDEX     rbtree or hash, rbtree\n"                                 \
+    "  -H HASH      crc32, crc32c or wyhash, crc32\n"                         \
+    "  -a LEN       arena= key length, off\n"                                 \
+    "  -L           disable the lockfree path\n"                              \
+    "  -r RATE      rate, 10r/s, repeated for more tiers as rate= is\n"      \
+    "  -b BURST     burst, 5\n"                                               \
+    "  -D           delay instead of nodelay\n"                               \
+    "  -B TxIxT     block=, auto block after T intervals of I seconds\n"      \
+    "  -k LEN       key length in bytes, at least 4, 4\n"                     \
+    "  -Z S         Zipf exponent, 1.0\n"
+
+
+typedef struct {
+    size_t                          size;
+    ngx_uint_t                      nshards;
+    ngx_uint_t                      index;
+    ngx_flag_t                      lockfree;
+    ngx_flag_t                      lock_stats;
+    size_t                          arena;
+    ngx_http_limit_req2_hash_t     *hash;
+    /* as in the zone, 1 corresponds to 0.001 r/s */
+    ngx_uint_t                      rates[LIMIT_REQ2_MAX_TIERS];
+    ngx_uint_t                      ntiers;
+    ngx_uint_t                      burst;
+    ngx_flag_t                      nodelay;
+    ngx_uint_t                      block_stat_times;
+    ngx_uint_t                      block_stat_interval;
+    ngx_uint_t                      block_time;
+    size_t                          key_len;
+    double                          zipf_s;
+
+    /* decisions per virtual millisecond, 0 for the real clock */
+    ngx_uint_t                      per_ms;
+    /* the clock when the zone is created, 0 for the default */
+    ngx_msec_t                      start;
+} bench_conf_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                  zone;
+    ngx_http_limit_req2_ctx_t       ctx;
+    ngx_http_limit_req2_t           rule;
+    ngx_array_t                     vars;
+    ngx_http_limit_req2_variable_t  var;
+    ngx_msec_t                      now;
+    ngx_uint_t                      decisions;
+    u_char                         *buf;
+} bench_zone_t;
+
+
+extern char  *bench_workload_names[];
+
+
+void bench_conf_init(bench_conf_t *bc);
+ngx_int_t bench_option(bench_conf_t *bc, int c, char *arg);
+ngx_int_t bench_conf_done(bench_conf_t *bc);
+void bench_conf_print(bench_conf_t *bc);
+
+uint64_t bench_nsec(void);
+uint64_t bench_random(uint64_t *s);
+void bench_zipf(double *cdf, ngx_uint_t n, double s);
+void bench_draw(ngx_uint_t workload, ngx_uint_t nkeys, double *cdf,
+    uint32_t *draws, ngx_uint_t n, uint64_t seed);
+
+ngx_int_t bench_zone_init(bench_zone_t *bz, bench_conf_t *bc);
+void bench_zone_done(bench_zone_t *bz);
+ngx_int_t bench_decide(bench_zone_t *bz, bench_conf_t *bc, uint32_t k);
+void bench_stats(bench_zone_t *bz, ngx_http_limit_req2_stats_t *st);
+ngx_uint_t bench_nodes(bench_zone_t *bz);
+
+
+#endif /* _NGX_HTTP_LIMIT_REQ2_BENCH_H_INCLUDED_ */
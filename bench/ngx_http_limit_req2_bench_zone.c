@@ -0,0 +1,478 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * A zone with one rule, set up as the zone and limit_req2 directives
+ * would, and the decisions on it, for the benchmarks.
+ */
+
+
+#include "ngx_http_limit_req2_bench.h"
+
+
+char  *bench_workload_names[] = { "uniform", "zipf", "churn", NULL };
+
+
+void
+bench_conf_init(bench_conf_t *bc)
+{
+    bc->size = 32 * 1024 * 1024;
+    bc->nshards = 1;
+    bc->index = LIMIT_REQ2_INDEX_RBTREE;
+    bc->lockfree = 1;
+    bc->lock_stats = 0;
+    bc->arena = 0;
+    bc->hash = &ngx_http_limit_req2_hashes[0];
+    bc->ntiers = 0;
+    bc->burst = 5;
+    bc->nodelay = 1;
+    bc->block_stat_times = 0;
+    bc->key_len = 4;
+    bc->zipf_s = 1.0;
+    bc->per_ms = 1000;
+    bc->start = 0;
+}
+
+
+ngx_int_t
+bench_option(bench_conf_t *bc, int c, char *arg)
+{
+    char        *p;
+    ngx_int_t    rate, scale;
+    ngx_uint_t   i;
+
+    switch (c) {
+
+    case 'z':
+        bc->size = (size_t) atol(arg) * 1024 * 1024;
+        return NGX_OK;
+
+    case 's':
+        bc->nshards = atol(arg);
+        if (bc->nshards == 0 || bc->nshards > LIMIT_REQ2_MAX_SHARDS) {
+            return NGX_ERROR;
+        }
+        return NGX_OK;
+
+    case 'i':
+        if (strcmp(arg, "rbtree") == 0) {
+            bc->index = LIMIT_REQ2_INDEX_RBTREE;
+            return NGX_OK;
+        }
+
+        if (strcmp(arg, "hash") == 0) {
+            bc->index = LIMIT_REQ2_INDEX_HASH;
+            return NGX_OK;
+        }
+
+        return NGX_ERROR;
+
+    case 'H':
+        for (i = 0; ngx_http_limit_req2_hashes[i].name.len; i++) {
+            if (ngx_strcmp(ngx_http_limit_req2_hashes[i].name.data, arg) == 0)
+            {
+                bc->hash = &ngx_http_limit_req2_hashes[i];
+                return NGX_OK;
+            }
+        }
+
+        return NGX_ERROR;
+
+    case 'a':
+        bc->arena = atol(arg);
+        if (bc->arena == 0 || bc->arena > LIMIT_REQ2_ARENA_MAX_KEY_LEN) {
+            return NGX_ERROR;
+        }
+        return NGX_OK;
+
+    case 'L':
+        bc->lockfree = 0;
+        return NGX_OK;
+
+    case 'r':
+        if (bc->ntiers == LIMIT_REQ2_MAX_TIERS) {
+            return NGX_ERROR;
+        }
+
+        rate = strtol(arg, &p, 10);
+        scale = 1;
+
+        if (strcmp(p, "r/m") == 0) {
+            scale = 60;
+
+        } else if (strcmp(p, "r/h") == 0) {
+            scale = 3600;
+
+        } else if (*p != '\0' && strcmp(p, "r/s") != 0) {
+            return NGX_ERROR;
+        }
+
+        if (rate <= 0) {
+            return NGX_ERROR;
+        }
+
+        bc->rates[bc->ntiers++] = rate * 1000 / scale;
+        return NGX_OK;
+
+    case 'b':
+        bc->burst = atol(arg);
+        return NGX_OK;
+
+    case 'D':
+        bc->nodelay = 0;
+        return NGX_OK;
+
+    case 'B':
+        if (sscanf(arg, "%lux%lux%lu", &bc->block_stat_times,
+                   &bc->block_stat_interval, &bc->block_time)
+            != 3
+            || bc->block_stat_times == 0 || bc->block_stat_times > 64
+            || bc->block_stat_interval == 0 || bc->block_time == 0)
+        {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+
+    case 'k':
+        bc->key_len = atol(arg);
+        if (bc->key_len < sizeof(uint32_t) || bc->key_len > 65535) {
+            return NGX_ERROR;
+        }
+        return NGX_OK;
+
+    case 'Z':
+        bc->zipf_s = atof(arg);
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+bench_conf_done(bench_conf_t *bc)
+{
+    if (bc->ntiers == 0) {
+        bc->rates[0] = 10 * 1000;
+        bc->ntiers = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+bench_conf_print(bench_conf_t *bc)
+{
+    ngx_uint_t  i;
+
+    printf("zone %luM, %lu shards, index %s, hash %.*s, lockfree %s, "
+           "arena %lu, key %lu bytes\nrate",
+           (unsigned long) (bc->size / 1024 / 1024),
+           (unsigned long) bc->nshards,
+           bc->index == LIMIT_REQ2_INDEX_HASH ? "hash" : "rbtree",
+           (int) bc->hash->name.len, bc->hash->name.data,
+           bc->lockfree ? "on" : "off", (unsigned long) bc->arena,
+           (unsigned long) bc->key_len);
+
+    for (i = 0; i < bc->ntiers; i++) {
+        printf(" %.3fr/s", (double) bc->rates[i] / 1000);
+    }
+
+    printf(", burst %lu%s", (unsigned long) bc->burst,
+           bc->nodelay ? ", nodelay" : "");
+
+    if (bc->block_stat_times) {
+        printf(", block %lux%lux%lu",
+               (unsigned long) bc->block_stat_times,
+               (unsigned long) bc->block_stat_interval,
+               (unsigned long) bc->block_time);
+    }
+
+    printf("\n");
+}
+
+
+uint64_t
+bench_nsec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+uint64_t
+bench_random(uint64_t *s)
+{
+    uint64_t  x;
+
+    /* xorshift64* */
+
+    x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+
+void
+bench_zipf(double *cdf, ngx_uint_t n, double s)
+{
+    double      sum;
+    ngx_uint_t  i;
+
+    sum = 0;
+
+    for (i = 0; i < n; i++) {
+        sum += 1.0 / pow((double) (i + 1), s);
+        cdf[i] = sum;
+    }
+
+    for (i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+}
+
+
+void
+bench_draw(ngx_uint_t workload, ngx_uint_t nkeys, double *cdf,
+    uint32_t *draws, ngx_uint_t n, uint64_t seed)
+{
+    double      u;
+    uint64_t    s;
+    ngx_uint_t  i, lo, hi, mid;
+
+    s = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    for (i = 0; i < n; i++) {
+
+        switch (workload) {
+
+        case BENCH_WORKLOAD_UNIFORM:
+            draws[i] = (uint32_t) (bench_random(&s) % nkeys);
+            break;
+
+        case BENCH_WORKLOAD_ZIPF:
+            u = (double) (bench_random(&s) >> 11) / (double) (1ULL << 53);
+
+            lo = 0;
+            hi = nkeys - 1;
+
+            while (lo < hi) {
+                mid = (lo + hi) / 2;
+
+                if (cdf[mid] < u) {
+                    lo = mid + 1;
+
+                } else {
+                    hi = mid;
+                }
+            }
+
+            /* spread the hot keys over the key space */
+
+            draws[i] = (uint32_t) ((lo * 2654435761ULL) % nkeys);
+            break;
+
+        default: /* BENCH_WORKLOAD_CHURN */
+            draws[i] = (uint32_t) (nkeys + seed * n + i);
+        }
+    }
+}
+
+
+ngx_int_t
+bench_zone_init(bench_zone_t *bz, bench_conf_t *bc)
+{
+    size_t                      bans;
+    ngx_uint_t                  i;
+    ngx_http_limit_req2_ctx_t  *ctx;
+
+    ngx_memzero(bz, sizeof(bench_zone_t));
+
+    /* the mutexes hold the pid of the owner, as those of nginx do */
+
+    ngx_pid = getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ctx = &bz->ctx;
+
+    ngx_str_set(&bz->var.var, "binary_remote_addr");
+    bz->vars.elts = &bz->var;
+    bz->vars.nelts = 1;
+    bz->vars.size = sizeof(ngx_http_limit_req2_variable_t);
+    bz->vars.nalloc = 1;
+
+    for (i = 0; i < LIMIT_REQ2_MAX_TIERS; i++) {
+        ctx->rates[i] = (i < bc->ntiers) ? bc->rates[i] : 0;
+        ctx->bursts[i] = NGX_CONF_UNSET;
+    }
+
+    ctx->ntiers = bc->ntiers;
+    ctx->tiers_size = (bc->ntiers - 1) * sizeof(uint32_t);
+
+    if (bc->block_stat_times) {
+        ctx->block_size = sizeof(ngx_http_limit_req2_node_block_t);
+    }
+
+    bans = ngx_max(bc->size / 8, 2 * ngx_pagesize);
+    ctx->bans_size = ngx_align(bans, ngx_pagesize);
+
+    ctx->arena_key_len = bc->arena;
+    ctx->nshards = bc->nshards;
+    ctx->index = bc->index;
+    ctx->lockfree = bc->lockfree;
+    ctx->lock_stats = bc->lock_stats;
+    ctx->hash = bc->hash;
+    ctx->limit_vars = &bz->vars;
+
+    ngx_http_limit_req2_hash_init(ctx->hash);
+
+    ctx->ban_cache = calloc(LIMIT_REQ2_BAN_CACHE_SLOTS,
+                            sizeof(ngx_http_limit_req2_ban_cache_t));
+    bz->buf = malloc(bc->key_len);
+
+    if (ctx->ban_cache == NULL || bz->buf == NULL) {
+        goto failed;
+    }
+
+    ngx_memset(bz->buf, 'k', bc->key_len);
+
+    bz->rule.shm_zone = &bz->zone;
+    bz->rule.nodelay = bc->nodelay;
+    bz->rule.block_stat_times = bc->block_stat_times;
+    bz->rule.block_stat_interval = bc->block_stat_interval;
+    bz->rule.block_time = bc->block_time;
+
+    for (i = 0; i < bc->ntiers; i++) {
+        bz->rule.bursts[i] = bc->burst * 1000;
+    }
+
+    /* the zone epoch is taken from the clock */
+
+    if (bc->start) {
+        bz->now = bc->start;
+
+    } else {
+        bz->now = bc->per_ms ? 1000000 : bench_nsec() / 1000000;
+    }
+    ngx_time_set(bz->now);
+
+    ngx_str_set(&bz->zone.shm.name, "bench");
+    bz->zone.shm.size = bc->size;
+    bz->zone.data = ctx;
+
+    if (ngx_shm_zone_alloc(&bz->zone) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_http_limit_req2_init_zone(&bz->zone, NULL) != NGX_OK) {
+        ngx_shm_zone_free(&bz->zone);
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    free(ctx->ban_cache);
+    free(bz->buf);
+
+    return NGX_ERROR;
+}
+
+
+void
+bench_zone_done(bench_zone_t *bz)
+{
+    ngx_shm_zone_free(&bz->zone);
+    free(bz->ctx.ban_cache);
+    free(bz->buf);
+}
+
+
+/* the key is the 4 bytes of k followed by padding, as an address would be */
+
+ngx_int_t
+bench_decide(bench_zone_t *bz, bench_conf_t *bc, uint32_t k)
+{
+    ngx_http_limit_req2_hash_t    *h;
+    ngx_http_limit_req2_key_t      key;
+    ngx_http_limit_req2_result_t   res;
+
+    /*
+     * the virtual clock moves a millisecond every per_ms decisions,
+     * the real one is read every 64 decisions, as an event loop would
+     */
+
+    if (bc->per_ms) {
+        if (++bz->decisions % bc->per_ms == 0) {
+            ngx_time_set(++bz->now);
+        }
+
+    } else if (++bz->decisions % 64 == 0) {
+        ngx_time_set(bench_nsec() / 1000000);
+    }
+
+    ngx_memcpy(bz->buf, &k, sizeof(uint32_t));
+
+    h = bz->ctx.hash;
+
+    key.key.data = bz->buf;
+    key.key.len = bc->key_len;
+    key.hash = h->final ^ h->update(h->init, bz->buf, bc->key_len);
+    key.limit_vars = &bz->vars;
+    key.hash_alg = h;
+
+    return ngx_http_limit_req2_account(&bz->ctx, &bz->rule, &key,
+                                       ngx_cycle->log, &res);
+}
+
+
+/* the counters of all workers */
+
+void
+bench_stats(bench_zone_t *bz, ngx_http_limit_req2_stats_t *st)
+{
+    ngx_uint_t                    i, n, k;
+    ngx_atomic_t                 *src, *dst;
+
+    ngx_memzero(st, sizeof(ngx_http_limit_req2_stats_t));
+
+    n = sizeof(ngx_http_limit_req2_stats_t) / sizeof(ngx_atomic_t);
+    dst = (ngx_atomic_t *) st;
+
+    for (i = 0; i < LIMIT_REQ2_STATS_SLOTS; i++) {
+        src = (ngx_atomic_t *) (bz->ctx.sh->stats
+                                + i * LIMIT_REQ2_STATS_STRIDE);
+
+        for (k = 0; k < n; k++) {
+            dst[k] += src[k];
+        }
+    }
+}
+
+
+ngx_uint_t
+bench_nodes(bench_zone_t *bz)
+{
+    ngx_uint_t  i, n;
+
+    n = 0;
+
+    for (i = 0; i < bz->ctx.sh->nshards; i++) {
+        n += bz->ctx.sh->shards[i]->nnodes;
+    }
+
+    return n;
+}
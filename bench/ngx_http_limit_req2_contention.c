@@ -0,0 +1,362 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Decisions per second of N processes sharing one zone, as N workers do.
+ * The zone is mapped shared before fork(), every process has its own ban
+ * cache and its own counters, as a worker has, and draws its keys from
+ * the same uniform or Zipfian key space; the zone holds every key before
+ * the processes start.  The lock wait and hold times are taken from the
+ * lock_stats histograms of the zone, so percentiles are bucket bounds.
+ */
+
+
+#include "ngx_http_limit_req2_bench.h"
+
+
+#define BENCH_MAX_PROCS    256
+#define BENCH_DRAWS        (1 << 20)
+
+
+typedef struct {
+    ngx_atomic_t                  ready;
+    ngx_atomic_t                  go;
+    struct {
+        uint64_t                  decisions;
+        uint64_t                  elapsed;
+    } procs[BENCH_MAX_PROCS];
+} bench_shared_t;
+
+
+typedef struct {
+    bench_conf_t                  conf;
+    ngx_uint_t                    procs[16];
+    ngx_uint_t                    nprocs;
+    ngx_uint_t                    nkeys;
+    ngx_uint_t                    workload;
+    ngx_msec_t                    time;
+} bench_contention_t;
+
+
+static void
+bench_worker(bench_contention_t *bt, bench_zone_t *bz, bench_shared_t *sh,
+    double *cdf, ngx_uint_t i)
+{
+    uint64_t   start, deadline;
+    uint32_t  *draws;
+    uint64_t   n;
+
+    ngx_worker = i;
+    ngx_pid = getpid();
+
+    draws = malloc(BENCH_DRAWS * sizeof(uint32_t));
+    if (draws == NULL) {
+        _exit(1);
+    }
+
+    bench_draw(bt->workload, bt->nkeys, cdf, draws, BENCH_DRAWS, i + 1);
+
+    (void) ngx_atomic_fetch_add(&sh->ready, 1);
+
+    while (!sh->go) {
+        ngx_cpu_pause();
+    }
+
+    start = bench_nsec();
+    deadline = start + (uint64_t) bt->time * 1000000;
+
+    for (n = 0; /* void */ ; n++) {
+        (void) bench_decide(bz, &bt->conf, draws[n & (BENCH_DRAWS - 1)]);
+
+        if ((n & 1023) == 1023 && bench_nsec() >= deadline) {
+            break;
+        }
+    }
+
+    sh->procs[i].decisions = n + 1;
+    sh->procs[i].elapsed = bench_nsec() - start;
+
+    _exit(0);
+}
+
+
+/* the upper bound in microseconds of the bucket with the q-th quantile */
+
+static unsigned long
+bench_percentile(ngx_atomic_t *after, ngx_atomic_t *before, double q)
+{
+    uint64_t    total, n;
+    ngx_uint_t  k;
+
+    total = 0;
+
+    for (k = 0; k < LIMIT_REQ2_LOCK_BUCKETS; k++) {
+        total += after[k] - before[k];
+    }
+
+    n = 0;
+
+    for (k = 0; k < LIMIT_REQ2_LOCK_BUCKETS - 1; k++) {
+        n += after[k] - before[k];
+
+        if (n >= total * q) {
+            break;
+        }
+    }
+
+    return 1UL << k;
+}
+
+
+static ngx_int_t
+bench_run(bench_contention_t *bt, ngx_uint_t nprocs, double *cdf)
+{
+    int                           status;
+    pid_t                         pid;
+    uint64_t                      decisions, elapsed, locks, waited;
+    ngx_uint_t                    i, k;
+    bench_zone_t                  bz;
+    bench_shared_t               *sh;
+    ngx_http_limit_req2_stats_t   before, after;
+
+    sh = mmap(NULL, sizeof(bench_shared_t), PROT_READ|PROT_WRITE,
+              MAP_ANON|MAP_SHARED, -1, 0);
+    if (sh == MAP_FAILED) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sh, sizeof(bench_shared_t));
+
+    if (bench_zone_init(&bz, &bt->conf) != NGX_OK) {
+        (void) munmap(sh, sizeof(bench_shared_t));
+        return NGX_ERROR;
+    }
+
+    for (k = 0; k < bt->nkeys; k++) {
+        (void) bench_decide(&bz, &bt->conf, (uint32_t) k);
+    }
+
+    for (i = 0; i < nprocs; i++) {
+        pid = fork();
+
+        if (pid == -1) {
+            perror("fork()");
+            exit(1);
+        }
+
+        if (pid == 0) {
+            bench_worker(bt, &bz, sh, cdf, i);
+        }
+    }
+
+    while (sh->ready != nprocs) {
+        (void) usleep(1000);
+    }
+
+    bench_stats(&bz, &before);
+
+    sh->go = 1;
+
+    for (i = 0; i < nprocs; i++) {
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "a benchmark process failed\n");
+            exit(1);
+        }
+    }
+
+    bench_stats(&bz, &after);
+
+    decisions = 0;
+    elapsed = 0;
+
+    for (i = 0; i < nprocs; i++) {
+        decisions += sh->procs[i].decisions;
+        elapsed = ngx_max(elapsed, sh->procs[i].elapsed);
+    }
+
+    locks = 0;
+
+    for (k = 0; k < LIMIT_REQ2_LOCK_BUCKETS; k++) {
+        locks += after.lock_wait[k] - before.lock_wait[k];
+    }
+
+    waited = locks - (after.lock_wait[0] - before.lock_wait[0]);
+
+    printf("%5lu %12.0f %12.0f %6.1f%% %6.1f%% %8lu %8lu %8lu %8lu %8lu "
+           "%8.2f%%\n",
+           (unsigned long) nprocs,
+           (double) decisions * 1e9 / elapsed,
+           (double) decisions * 1e9 / elapsed / nprocs,
+           decisions ? (double) locks * 100 / decisions : 0.0,
+           locks ? (double) waited * 100 / locks : 0.0,
+           bench_percentile(after.lock_wait, before.lock_wait, 0.5),
+           bench_percentile(after.lock_wait, before.lock_wait, 0.99),
+           bench_percentile(after.lock_wait, before.lock_wait, 0.999),
+           bench_percentile(after.lock_hold, before.lock_hold, 0.5),
+           bench_percentile(after.lock_hold, before.lock_hold, 0.99),
+           decisions
+           ? (double) (after.rejected - before.rejected) * 100 / decisions
+           : 0.0);
+
+    bench_zone_done(&bz);
+    (void) munmap(sh, sizeof(bench_shared_t));
+
+    return NGX_OK;
+}
+
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+        "usage: ngx_http_limit_req2_contention [options]\n"
+        BENCH_COMMON_USAGE
+        "  -p N,...     process counts, 1,2,4,8,16,32,64\n"
+        "  -t MS        run time per process count, 2000\n"
+        "  -K N         keys, 100000\n"
+        "  -w W         uniform or zipf, zipf\n");
+}
+
+
+static ngx_int_t
+bench_options(bench_contention_t *bt, int argc, char **argv)
+{
+    int          c;
+    char        *p, *s;
+    ngx_int_t    rc;
+    ngx_uint_t   i;
+
+    bench_conf_init(&bt->conf);
+
+    /* the real clock, the percentiles come from lock_stats */
+
+    bt->conf.per_ms = 0;
+    bt->conf.lock_stats = 1;
+
+    for (i = 0; i < 7; i++) {
+        bt->procs[i] = 1 << i;
+    }
+
+    bt->nprocs = 7;
+    bt->nkeys = 100000;
+    bt->workload = BENCH_WORKLOAD_ZIPF;
+    bt->time = 2000;
+
+    while ((c = getopt(argc, argv, BENCH_COMMON_OPTIONS "p:t:K:w:")) != -1) {
+
+        rc = bench_option(&bt->conf, c, optarg);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
+        switch (c) {
+
+        case 'p':
+            bt->nprocs = 0;
+
+            for (s = strtok_r(optarg, ",", &p);
+                 s && bt->nprocs < 16;
+                 s = strtok_r(NULL, ",", &p))
+            {
+                bt->procs[bt->nprocs] = atol(s);
+
+                if (bt->procs[bt->nprocs] == 0
+                    || bt->procs[bt->nprocs] > BENCH_MAX_PROCS)
+                {
+                    return NGX_ERROR;
+                }
+
+                bt->nprocs++;
+            }
+            break;
+
+        case 't':
+            bt->time = atol(optarg);
+            break;
+
+        case 'K':
+            bt->nkeys = atol(optarg);
+            break;
+
+        case 'w':
+            if (strcmp(optarg, "uniform") == 0) {
+                bt->workload = BENCH_WORKLOAD_UNIFORM;
+
+            } else if (strcmp(optarg, "zipf") == 0) {
+                bt->workload = BENCH_WORKLOAD_ZIPF;
+
+            } else {
+                return NGX_ERROR;
+            }
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+    }
+
+    if (bt->nprocs == 0 || bt->nkeys == 0 || bt->time == 0) {
+        return NGX_ERROR;
+    }
+
+    return bench_conf_done(&bt->conf);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    double              *cdf;
+    ngx_uint_t           i;
+    bench_conf_t        *bc;
+    bench_contention_t   bt;
+
+    if (bench_options(&bt, argc, argv) != NGX_OK) {
+        bench_usage();
+        return 1;
+    }
+
+    bc = &bt.conf;
+
+    ngx_pagesize = getpagesize();
+    ngx_crc32_table_init();
+
+    cdf = malloc(bt.nkeys * sizeof(double));
+    if (cdf == NULL) {
+        return 1;
+    }
+
+    bench_zipf(cdf, bt.nkeys, bc->zipf_s);
+
+    bench_conf_print(bc);
+
+    printf("%lu %s keys, %lums per run, %ld cpus\n\n",
+           (unsigned long) bt.nkeys, bench_workload_names[bt.workload],
+           (unsigned long) bt.time, sysconf(_SC_NPROCESSORS_ONLN));
+
+    printf("%5s %12s %12s %7s %7s %8s %8s %8s %8s %8s %9s\n"
+           "%5s %12s %12s %7s %7s %8s %8s %8s %8s %8s %9s\n",
+           "procs", "decisions/s", "per proc", "locked", "waited", "wait",
+           "wait", "wait", "hold", "hold", "rejected",
+           "", "", "", "", "", "p50<us", "p99<us", "p999<us", "p50<us",
+           "p99<us", "");
+
+    for (i = 0; i < bt.nprocs; i++) {
+        if (bench_run(&bt, bt.procs[i], cdf) != NGX_OK) {
+            fprintf(stderr, "the zone could not be created\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,644 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Replays an access log through the zone core on a virtual clock that
+ * follows the time of the log lines, so that zones and rules can be sized
+ * and tuned offline, and variants compared on the same input.
+ *
+ * Fields are separated by spaces, a field in double quotes or in square
+ * brackets is one field, as in the combined log format.  The time is
+ * $msec, [$time_local] or $time_iso8601; the key is the concatenation of
+ * the key fields, as limit_req2_zone concatenates its variables.  The log
+ * is read in full before the replay, so the throughput is of decisions
+ * only, hashing the key included.
+ */
+
+
+#include "ngx_http_limit_req2_bench.h"
+#include <arpa/inet.h>
+
+
+#define BENCH_MAX_FIELDS   32
+
+
+typedef struct {
+    ngx_msec_t                    time;
+    size_t                        offset;
+    size_t                        len;
+} bench_record_t;
+
+
+typedef struct {
+    bench_conf_t                  conf;
+    ngx_uint_t                    time_field;
+    ngx_uint_t                    key_fields[BENCH_MAX_FIELDS];
+    ngx_uint_t                    nkey_fields;
+    ngx_flag_t                    binary;
+    time_t                        interval;
+    char                         *file;
+
+    bench_record_t               *records;
+    ngx_uint_t                    nrecords;
+    ngx_uint_t                    nalloc;
+    ngx_uint_t                    skipped;
+    u_char                       *keys;
+    size_t                        keys_len;
+    size_t                        keys_size;
+} bench_replay_t;
+
+
+typedef struct {
+    uint64_t                      pass;
+    uint64_t                      delay;
+    uint64_t                      reject;
+    uint64_t                      block;
+} bench_decisions_t;
+
+
+static char  *bench_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+
+static ngx_uint_t
+bench_split(u_char *p, u_char *last, ngx_str_t *fields)
+{
+    u_char      close;
+    ngx_uint_t  n;
+
+    n = 0;
+
+    while (p < last && n < BENCH_MAX_FIELDS) {
+
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+
+        close = ' ';
+
+        if (*p == '"') {
+            close = '"';
+            p++;
+
+        } else if (*p == '[') {
+            close = ']';
+            p++;
+        }
+
+        fields[n].data = p;
+
+        while (p < last && *p != close) {
+            if (close == '"' && *p == '\\' && p + 1 < last) {
+                p++;
+            }
+
+            p++;
+        }
+
+        fields[n].len = p - fields[n].data;
+        n++;
+
+        if (p < last) {
+            p++;
+        }
+    }
+
+    return n;
+}
+
+
+/* days since the epoch of a proleptic Gregorian date */
+
+static int64_t
+bench_days(int64_t y, int64_t m, int64_t d)
+{
+    int64_t  era, yoe, doy;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+
+static ngx_msec_t
+bench_parse_time(ngx_str_t *f)
+{
+    int         d, y, h, mi, s, tzh, tzm, n;
+    char        mon[4], sign, buf[64];
+    int64_t     t;
+    ngx_uint_t  m, ms;
+    u_char     *p, *last;
+
+    if (f->len == 0 || f->len >= sizeof(buf)) {
+        return 0;
+    }
+
+    ngx_memcpy(buf, f->data, f->len);
+    buf[f->len] = '\0';
+
+    tzh = 0;
+    tzm = 0;
+    sign = '+';
+    ms = 0;
+
+    /* $time_local, 10/Oct/2000:13:55:36 -0700 */
+
+    if (sscanf(buf, "%d/%3[A-Za-z]/%d:%d:%d:%d %c%2d%2d",
+               &d, mon, &y, &h, &mi, &s, &sign, &tzh, &tzm) >= 6)
+    {
+        for (m = 0; m < 12; m++) {
+            if (strcmp(mon, bench_months[m]) == 0) {
+                break;
+            }
+        }
+
+        if (m == 12) {
+            return 0;
+        }
+
+        m++;
+
+        goto done;
+    }
+
+    /* $time_iso8601, 2000-10-10T13:55:36-07:00 */
+
+    n = sscanf(buf, "%d-%lu-%dT%d:%d:%d%c%2d:%2d",
+               &y, &m, &d, &h, &mi, &s, &sign, &tzh, &tzm);
+
+    if (n >= 6) {
+        if (n < 7 || sign == 'Z') {
+            sign = '+';
+            tzh = 0;
+            tzm = 0;
+        }
+
+        goto done;
+    }
+
+    /* $msec, 1697040000.123 */
+
+    t = 0;
+    p = f->data;
+    last = f->data + f->len;
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        t = t * 10 + *p++ - '0';
+    }
+
+    if (p < last && *p == '.') {
+        for (p++, n = 0; n < 3; n++) {
+            ms = ms * 10 + ((p < last && *p >= '0' && *p <= '9')
+                            ? (ngx_uint_t) (*p++ - '0') : 0);
+        }
+    }
+
+    return t ? (ngx_msec_t) t * 1000 + ms : 0;
+
+done:
+
+    t = bench_days(y, m, d) * 86400 + h * 3600 + mi * 60 + s;
+    t -= (sign == '-' ? -1 : 1) * (tzh * 3600 + tzm * 60);
+
+    return t > 0 ? (ngx_msec_t) t * 1000 : 0;
+}
+
+
+static ngx_int_t
+bench_add_key(bench_replay_t *br, u_char *p, size_t len)
+{
+    u_char  *keys;
+
+    if (br->keys_len + len > br->keys_size) {
+        br->keys_size = ngx_max(br->keys_size * 2, br->keys_len + len);
+
+        keys = realloc(br->keys, br->keys_size);
+        if (keys == NULL) {
+            return NGX_ERROR;
+        }
+
+        br->keys = keys;
+    }
+
+    ngx_memcpy(br->keys + br->keys_len, p, len);
+    br->keys_len += len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+bench_read(bench_replay_t *br, FILE *fp)
+{
+    char             *line, addr[64];
+    size_t            size, start;
+    ssize_t           n;
+    u_char            bin[16];
+    ngx_str_t         fields[BENCH_MAX_FIELDS], *f;
+    ngx_uint_t        nfields, i;
+    ngx_msec_t        t;
+    bench_record_t   *r;
+
+    line = NULL;
+    size = 0;
+
+    while ((n = getline(&line, &size, fp)) != -1) {
+
+        while (n && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            n--;
+        }
+
+        nfields = bench_split((u_char *) line, (u_char *) line + n, fields);
+
+        if (br->time_field > nfields) {
+            br->skipped++;
+            continue;
+        }
+
+        t = bench_parse_time(&fields[br->time_field - 1]);
+        if (t == 0) {
+            br->skipped++;
+            continue;
+        }
+
+        start = br->keys_len;
+
+        for (i = 0; i < br->nkey_fields; i++) {
+            if (br->key_fields[i] > nfields) {
+                break;
+            }
+
+            f = &fields[br->key_fields[i] - 1];
+
+            if (f->len == 0 || (f->len == 1 && f->data[0] == '-')) {
+                break;
+            }
+
+            /* as $binary_remote_addr */
+
+            if (br->binary && f->len < sizeof(addr)) {
+                ngx_memcpy(addr, f->data, f->len);
+                addr[f->len] = '\0';
+
+                if (inet_pton(AF_INET, addr, bin) == 1) {
+                    if (bench_add_key(br, bin, 4) != NGX_OK) {
+                        return NGX_ERROR;
+                    }
+
+                    continue;
+                }
+
+                if (inet_pton(AF_INET6, addr, bin) == 1) {
+                    if (bench_add_key(br, bin, 16) != NGX_OK) {
+                        return NGX_ERROR;
+                    }
+
+                    continue;
+                }
+            }
+
+            if (bench_add_key(br, f->data, f->len) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        /* an empty key is not limited, as in the module */
+
+        if (i < br->nkey_fields || br->keys_len - start > 65535) {
+            br->keys_len = start;
+            br->skipped++;
+            continue;
+        }
+
+        if (br->nrecords == br->nalloc) {
+            br->nalloc = br->nalloc ? br->nalloc * 2 : 65536;
+
+            r = realloc(br->records, br->nalloc * sizeof(bench_record_t));
+            if (r == NULL) {
+                return NGX_ERROR;
+            }
+
+            br->records = r;
+        }
+
+        r = &br->records[br->nrecords++];
+
+        r->time = t;
+        r->offset = start;
+        r->len = br->keys_len - start;
+    }
+
+    free(line);
+
+    return ferror(fp) ? NGX_ERROR : NGX_OK;
+}
+
+
+static ngx_uint_t
+bench_bans(bench_zone_t *bz)
+{
+    ngx_uint_t  i, n;
+
+    n = 0;
+
+    for (i = 0; i < bz->ctx.sh->nshards; i++) {
+        n += bz->ctx.sh->shards[i]->nbans;
+    }
+
+    return n;
+}
+
+
+static void
+bench_interval(time_t sec, bench_decisions_t *d, bench_zone_t *bz)
+{
+    printf("%10ld %10lu %10lu %10lu %10lu %10lu %10lu\n",
+           (long) sec, (unsigned long) d->pass, (unsigned long) d->delay,
+           (unsigned long) d->reject, (unsigned long) d->block,
+           (unsigned long) bench_nodes(bz), (unsigned long) bench_bans(bz));
+
+    ngx_memzero(d, sizeof(bench_decisions_t));
+}
+
+
+static ngx_int_t
+bench_replay(bench_replay_t *br)
+{
+    time_t                         sec;
+    double                         span;
+    uint64_t                       start, elapsed;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i, nodes, peak_nodes, peak_bans;
+    ngx_msec_t                     now;
+    bench_zone_t                   bz;
+    bench_record_t                *r;
+    bench_decisions_t              total, iv;
+    ngx_http_limit_req2_key_t      key;
+    ngx_http_limit_req2_hash_t    *h;
+    ngx_http_limit_req2_stats_t    st;
+    ngx_http_limit_req2_result_t   res;
+
+    br->conf.start = br->records[0].time;
+
+    if (bench_zone_init(&bz, &br->conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    h = bz.ctx.hash;
+    now = br->records[0].time;
+    sec = br->interval ? now / 1000 / br->interval * br->interval : 0;
+
+    ngx_memzero(&total, sizeof(bench_decisions_t));
+    ngx_memzero(&iv, sizeof(bench_decisions_t));
+
+    peak_nodes = 0;
+    peak_bans = 0;
+
+    key.limit_vars = &bz.vars;
+    key.hash_alg = h;
+
+    if (br->interval) {
+        printf("%10s %10s %10s %10s %10s %10s %10s\n",
+               "time", "pass", "delay", "reject", "block", "nodes", "bans");
+    }
+
+    start = bench_nsec();
+
+    for (i = 0; i < br->nrecords; i++) {
+        r = &br->records[i];
+
+        /* the clock does not go back for lines logged out of order */
+
+        if (r->time > now) {
+            now = r->time;
+            ngx_time_set(now);
+        }
+
+        if (br->interval && (time_t) (now / 1000) >= sec + br->interval) {
+            bench_interval(sec, &iv, &bz);
+            sec = now / 1000 / br->interval * br->interval;
+        }
+
+        key.key.data = br->keys + r->offset;
+        key.key.len = r->len;
+        key.hash = h->final ^ h->update(h->init, key.key.data, r->len);
+
+        rc = ngx_http_limit_req2_account(&bz.ctx, &bz.rule, &key,
+                                         ngx_cycle->log, &res);
+
+        if (rc == NGX_BUSY && res.block_stop_time) {
+            total.block++;
+            iv.block++;
+
+        } else if (rc == NGX_BUSY || rc == NGX_ERROR) {
+            total.reject++;
+            iv.reject++;
+
+        } else if (rc == NGX_AGAIN && !br->conf.nodelay) {
+            total.delay++;
+            iv.delay++;
+
+        } else {
+            total.pass++;
+            iv.pass++;
+        }
+
+        if ((i & 63) == 0) {
+            nodes = bench_nodes(&bz);
+            peak_nodes = ngx_max(peak_nodes, nodes);
+            peak_bans = ngx_max(peak_bans, bench_bans(&bz));
+        }
+    }
+
+    elapsed = bench_nsec() - start;
+
+    if (br->interval) {
+        bench_interval(sec, &iv, &bz);
+        printf("\n");
+    }
+
+    bench_stats(&bz, &st);
+
+    span = (double) (now - br->records[0].time) / 1000;
+
+    printf("lines %lu, skipped %lu, %.0fs of log, %.1f r/s on average\n",
+           (unsigned long) br->nrecords, (unsigned long) br->skipped,
+           span, span > 0 ? br->nrecords / span : 0.0);
+
+    printf("pass %lu (%.2f%%), delay %lu (%.2f%%), reject %lu (%.2f%%), "
+           "block %lu (%.2f%%)\n",
+           (unsigned long) total.pass, total.pass * 100.0 / br->nrecords,
+           (unsigned long) total.delay, total.delay * 100.0 / br->nrecords,
+           (unsigned long) total.reject, total.reject * 100.0 / br->nrecords,
+           (unsigned long) total.block, total.block * 100.0 / br->nrecords);
+
+    printf("nodes %lu, peak %lu; bans %lu, peak %lu; "
+           "evicted %lu, alloc failed %lu, auto blocked %lu\n",
+           (unsigned long) bench_nodes(&bz), (unsigned long) peak_nodes,
+           (unsigned long) bench_bans(&bz), (unsigned long) peak_bans,
+           (unsigned long) st.evicted, (unsigned long) st.alloc_failed,
+           (unsigned long) st.auto_blocked);
+
+    printf("%.0f decisions/s, %.1f ns per decision\n",
+           (double) br->nrecords * 1e9 / elapsed,
+           (double) elapsed / br->nrecords);
+
+    bench_zone_done(&bz);
+
+    return NGX_OK;
+}
+
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+        "usage: ngx_http_limit_req2_replay [options] [access.log]\n"
+        BENCH_COMMON_USAGE
+        "  -T N         the time field, $msec, [$time_local] or "
+                        "$time_iso8601, 4\n"
+        "  -K N,...     the key fields, 1\n"
+        "  -A           key fields that are addresses as "
+                        "$binary_remote_addr\n"
+        "  -I SEC       print the decisions every SEC seconds of log\n"
+        "the fields are counted from 1, the log is read from stdin "
+        "without a file\n");
+}
+
+
+static ngx_int_t
+bench_options(bench_replay_t *br, int argc, char **argv)
+{
+    int          c;
+    char        *p, *s;
+    ngx_int_t    rc;
+
+    bench_conf_init(&br->conf);
+
+    br->conf.per_ms = 0;
+    br->time_field = 4;
+    br->key_fields[0] = 1;
+    br->nkey_fields = 1;
+    br->binary = 0;
+    br->interval = 0;
+
+    while ((c = getopt(argc, argv, BENCH_COMMON_OPTIONS "T:K:AI:")) != -1) {
+
+        rc = bench_option(&br->conf, c, optarg);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
+        switch (c) {
+
+        case 'T':
+            br->time_field = atol(optarg);
+            if (br->time_field == 0 || br->time_field > BENCH_MAX_FIELDS) {
+                return NGX_ERROR;
+            }
+            break;
+
+        case 'K':
+            br->nkey_fields = 0;
+
+            for (s = strtok_r(optarg, ",", &p);
+                 s && br->nkey_fields < BENCH_MAX_FIELDS;
+                 s = strtok_r(NULL, ",", &p))
+            {
+                br->key_fields[br->nkey_fields] = atol(s);
+
+                if (br->key_fields[br->nkey_fields] == 0
+                    || br->key_fields[br->nkey_fields] > BENCH_MAX_FIELDS)
+                {
+                    return NGX_ERROR;
+                }
+
+                br->nkey_fields++;
+            }
+
+            if (br->nkey_fields == 0) {
+                return NGX_ERROR;
+            }
+            break;
+
+        case 'A':
+            br->binary = 1;
+            break;
+
+        case 'I':
+            br->interval = atol(optarg);
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+    }
+
+    br->file = (optind < argc) ? argv[optind] : NULL;
+
+    return bench_conf_done(&br->conf);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    FILE            *fp;
+    ngx_int_t        rc;
+    bench_replay_t   br;
+
+    ngx_memzero(&br, sizeof(bench_replay_t));
+
+    if (bench_options(&br, argc, argv) != NGX_OK) {
+        bench_usage();
+        return 1;
+    }
+
+    ngx_pagesize = getpagesize();
+    ngx_crc32_table_init();
+
+    fp = br.file ? fopen(br.file, "r") : stdin;
+    if (fp == NULL) {
+        perror(br.file);
+        return 1;
+    }
+
+    rc = bench_read(&br, fp);
+
+    if (br.file) {
+        (void) fclose(fp);
+    }
+
+    if (rc != NGX_OK) {
+        fprintf(stderr, "the log could not be read\n");
+        return 1;
+    }
+
+    if (br.nrecords == 0) {
+        fprintf(stderr, "no lines with a time and a key, %lu skipped\n",
+                (unsigned long) br.skipped);
+        return 1;
+    }
+
+    bench_conf_print(&br.conf);
+    printf("\n");
+
+    if (bench_replay(&br) != NGX_OK) {
+        fprintf(stderr, "the zone could not be created\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,899 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+static ngx_log_t     ngx_shim_log = { NGX_LOG_ERR };
+static ngx_cycle_t   ngx_shim_cycle = { &ngx_shim_log };
+static ngx_time_t    ngx_shim_time;
+
+volatile ngx_cycle_t  *ngx_cycle = &ngx_shim_cycle;
+ngx_uint_t             ngx_worker;
+ngx_uint_t             ngx_pagesize = 4096;
+ngx_pid_t              ngx_pid;
+ngx_int_t              ngx_ncpu;
+
+volatile ngx_time_t   *ngx_cached_time = &ngx_shim_time;
+volatile ngx_msec_t    ngx_current_msec;
+
+static uint32_t        ngx_crc32_table256[256];
+
+
+void
+ngx_time_set(ngx_msec_t msec)
+{
+    ngx_shim_time.sec = msec / 1000;
+    ngx_shim_time.msec = msec % 1000;
+
+    ngx_current_msec = msec;
+}
+
+
+ngx_int_t
+ngx_memn2cmp(u_char *s1, u_char *s2, size_t n1, size_t n2)
+{
+    size_t     n;
+    ngx_int_t  m, z;
+
+    if (n1 <= n2) {
+        n = n1;
+        z = -1;
+
+    } else {
+        n = n2;
+        z = 1;
+    }
+
+    m = ngx_memcmp(s1, s2, n);
+
+    if (m || n1 == n2) {
+        return m;
+    }
+
+    return z;
+}
+
+
+/* %V, %s, %Z, %%, and the integers as unsigned or signed decimals */
+
+u_char *
+ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
+{
+    u_char      *p, tmp[24];
+    size_t       len;
+    int64_t      i64;
+    uint64_t     ui64;
+    ngx_str_t   *v;
+    ngx_uint_t   sign;
+
+    while (*fmt && buf < last) {
+
+        if (*fmt != '%') {
+            *buf++ = *fmt++;
+            continue;
+        }
+
+        fmt++;
+        sign = 1;
+
+        while (*fmt >= '0' && *fmt <= '9') {
+            fmt++;
+        }
+
+        if (*fmt == 'u') {
+            sign = 0;
+            fmt++;
+        }
+
+        switch (*fmt) {
+
+        case 'V':
+            v = va_arg(args, ngx_str_t *);
+            len = ngx_min(v->len, (size_t) (last - buf));
+            buf = ngx_cpymem(buf, v->data, len);
+            fmt++;
+            continue;
+
+        case 's':
+            p = va_arg(args, u_char *);
+            while (*p && buf < last) {
+                *buf++ = *p++;
+            }
+            fmt++;
+            continue;
+
+        case 'Z':
+            *buf++ = '\0';
+            fmt++;
+            continue;
+
+        case '%':
+            *buf++ = '%';
+            fmt++;
+            continue;
+
+        case 'z':
+        case 'i':
+        case 'M':
+            ui64 = (uint64_t) va_arg(args, ngx_uint_t);
+            i64 = (int64_t) (ngx_int_t) ui64;
+            break;
+
+        case 'P':
+            i64 = (int64_t) va_arg(args, ngx_pid_t);
+            ui64 = (uint64_t) i64;
+            break;
+
+        case 'D':
+        case 'd':
+            i64 = (int64_t) va_arg(args, int32_t);
+            ui64 = (uint64_t) (uint32_t) i64;
+            break;
+
+        case 'L':
+            i64 = va_arg(args, int64_t);
+            ui64 = (uint64_t) i64;
+            break;
+
+        default:
+            fmt++;
+            continue;
+        }
+
+        fmt++;
+
+        if (sign && i64 < 0) {
+            *buf++ = '-';
+            ui64 = (uint64_t) -i64;
+        }
+
+        p = tmp + sizeof(tmp);
+
+        do {
+            *--p = (u_char) (ui64 % 10 + '0');
+        } while (ui64 /= 10);
+
+        len = ngx_min((size_t) (tmp + sizeof(tmp) - p), (size_t) (last - buf));
+        buf = ngx_cpymem(buf, p, len);
+    }
+
+    return buf;
+}
+
+
+u_char *
+ngx_sprintf(u_char *buf, const char *fmt, ...)
+{
+    u_char   *p;
+    va_list   args;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(buf, (void *) -1, fmt, args);
+    va_end(args);
+
+    return p;
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, int err,
+    const char *fmt, ...)
+{
+    u_char   *p, errstr[2048];
+    va_list   args;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(errstr, errstr + sizeof(errstr) - 1, fmt, args);
+    va_end(args);
+
+    *p++ = '\n';
+
+    (void) write(STDERR_FILENO, errstr, p - errstr);
+}
+
+
+void
+ngx_crc32_table_init(void)
+{
+    uint32_t    c;
+    ngx_uint_t  i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        }
+
+        ngx_crc32_table256[i] = c;
+    }
+}
+
+
+void
+ngx_crc32_update(uint32_t *crc, u_char *p, size_t len)
+{
+    uint32_t  c;
+
+    c = *crc;
+
+    while (len--) {
+        c = ngx_crc32_table256[(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+
+    *crc = c;
+}
+
+
+static ngx_inline void ngx_rbtree_left_rotate(ngx_rbtree_node_t **root,
+    ngx_rbtree_node_t *sentinel, ngx_rbtree_node_t *node);
+static ngx_inline void ngx_rbtree_right_rotate(ngx_rbtree_node_t **root,
+    ngx_rbtree_node_t *sentinel, ngx_rbtree_node_t *node);
+
+
+void
+ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  **root, *temp, *sentinel;
+
+    /* a binary tree insert */
+
+    root = &tree->root;
+    sentinel = tree->sentinel;
+
+    if (*root == sentinel) {
+        node->parent = NULL;
+        node->left = sentinel;
+        node->right = sentinel;
+        ngx_rbt_black(node);
+        *root = node;
+
+        return;
+    }
+
+    tree->insert(*root, node, sentinel);
+
+    /* re-balance tree */
+
+    while (node != *root && ngx_rbt_is_red(node->parent)) {
+
+        if (node->parent == node->parent->parent->left) {
+            temp = node->parent->parent->right;
+
+            if (ngx_rbt_is_red(temp)) {
+                ngx_rbt_black(node->parent);
+                ngx_rbt_black(temp);
+                ngx_rbt_red(node->parent->parent);
+                node = node->parent->parent;
+
+            } else {
+                if (node == node->parent->right) {
+                    node = node->parent;
+                    ngx_rbtree_left_rotate(root, sentinel, node);
+                }
+
+                ngx_rbt_black(node->parent);
+                ngx_rbt_red(node->parent->parent);
+                ngx_rbtree_right_rotate(root, sentinel, node->parent->parent);
+            }
+
+        } else {
+            temp = node->parent->parent->left;
+
+            if (ngx_rbt_is_red(temp)) {
+                ngx_rbt_black(node->parent);
+                ngx_rbt_black(temp);
+                ngx_rbt_red(node->parent->parent);
+                node = node->parent->parent;
+
+            } else {
+                if (node == node->parent->left) {
+                    node = node->parent;
+                    ngx_rbtree_right_rotate(root, sentinel, node);
+                }
+
+                ngx_rbt_black(node->parent);
+                ngx_rbt_red(node->parent->parent);
+                ngx_rbtree_left_rotate(root, sentinel, node->parent->parent);
+            }
+        }
+    }
+
+    ngx_rbt_black(*root);
+}
+
+
+void
+ngx_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t  **p;
+
+    for ( ;; ) {
+
+        p = (node->key < temp->key) ? &temp->left : &temp->right;
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+ngx_rbtree_node_t *
+ngx_rbtree_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *root, *sentinel, *parent;
+
+    sentinel = tree->sentinel;
+
+    if (node->right != sentinel) {
+        return ngx_rbtree_min(node->right, sentinel);
+    }
+
+    root = tree->root;
+
+    for ( ;; ) {
+        parent = node->parent;
+
+        if (node == root) {
+            return NULL;
+        }
+
+        if (node == parent->left) {
+            return parent;
+        }
+
+        node = parent;
+    }
+}
+
+
+void
+ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+    ngx_uint_t           red;
+    ngx_rbtree_node_t  **root, *sentinel, *subst, *temp, *w;
+
+    /* a binary tree delete */
+
+    root = &tree->root;
+    sentinel = tree->sentinel;
+
+    if (node->left == sentinel) {
+        temp = node->right;
+        subst = node;
+
+    } else if (node->right == sentinel) {
+        temp = node->left;
+        subst = node;
+
+    } else {
+        subst = ngx_rbtree_min(node->right, sentinel);
+        temp = subst->right;
+    }
+
+    if (subst == *root) {
+        *root = temp;
+        ngx_rbt_black(temp);
+
+        /* DEBUG stuff */
+        node->left = NULL;
+        node->right = NULL;
+        node->parent = NULL;
+        node->key = 0;
+
+        return;
+    }
+
+    red = ngx_rbt_is_red(subst);
+
+    if (subst == subst->parent->left) {
+        subst->parent->left = temp;
+
+    } else {
+        subst->parent->right = temp;
+    }
+
+    if (subst == node) {
+
+        temp->parent = subst->parent;
+
+    } else {
+
+        if (subst->parent == node) {
+            temp->parent = subst;
+
+        } else {
+            temp->parent = subst->parent;
+        }
+
+        subst->left = node->left;
+        subst->right = node->right;
+        subst->parent = node->parent;
+        ngx_rbt_copy_color(subst, node);
+
+        if (node == *root) {
+            *root = subst;
+
+        } else {
+            if (node == node->parent->left) {
+                node->parent->left = subst;
+            } else {
+                node->parent->right = subst;
+            }
+        }
+
+        if (subst->left != sentinel) {
+            subst->left->parent = subst;
+        }
+
+        if (subst->right != sentinel) {
+            subst->right->parent = subst;
+        }
+    }
+
+    /* DEBUG stuff */
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = NULL;
+    node->key = 0;
+
+    if (red) {
+        return;
+    }
+
+    /* a delete fixup */
+
+    while (temp != *root && ngx_rbt_is_black(temp)) {
+
+        if (temp == temp->parent->left) {
+            w = temp->parent->right;
+
+            if (ngx_rbt_is_red(w)) {
+                ngx_rbt_black(w);
+                ngx_rbt_red(temp->parent);
+                ngx_rbtree_left_rotate(root, sentinel, temp->parent);
+                w = temp->parent->right;
+            }
+
+            if (ngx_rbt_is_black(w->left) && ngx_rbt_is_black(w->right)) {
+                ngx_rbt_red(w);
+                temp = temp->parent;
+
+            } else {
+                if (ngx_rbt_is_black(w->right)) {
+                    ngx_rbt_black(w->left);
+                    ngx_rbt_red(w);
+                    ngx_rbtree_right_rotate(root, sentinel, w);
+                    w = temp->parent->right;
+                }
+
+                ngx_rbt_copy_color(w, temp->parent);
+                ngx_rbt_black(temp->parent);
+                ngx_rbt_black(w->right);
+                ngx_rbtree_left_rotate(root, sentinel, temp->parent);
+                temp = *root;
+            }
+
+        } else {
+            w = temp->parent->left;
+
+            if (ngx_rbt_is_red(w)) {
+                ngx_rbt_black(w);
+                ngx_rbt_red(temp->parent);
+                ngx_rbtree_right_rotate(root, sentinel, temp->parent);
+                w = temp->parent->left;
+            }
+
+            if (ngx_rbt_is_black(w->left) && ngx_rbt_is_black(w->right)) {
+                ngx_rbt_red(w);
+                temp = temp->parent;
+
+            } else {
+                if (ngx_rbt_is_black(w->left)) {
+                    ngx_rbt_black(w->right);
+                    ngx_rbt_red(w);
+                    ngx_rbtree_left_rotate(root, sentinel, w);
+                    w = temp->parent->left;
+                }
+
+                ngx_rbt_copy_color(w, temp->parent);
+                ngx_rbt_black(temp->parent);
+                ngx_rbt_black(w->left);
+                ngx_rbtree_right_rotate(root, sentinel, temp->parent);
+                temp = *root;
+            }
+        }
+    }
+
+    ngx_rbt_black(temp);
+}
+
+
+static ngx_inline void
+ngx_rbtree_left_rotate(ngx_rbtree_node_t **root, ngx_rbtree_node_t *sentinel,
+    ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *temp;
+
+    temp = node->right;
+    node->right = temp->left;
+
+    if (temp->left != sentinel) {
+        temp->left->parent = node;
+    }
+
+    temp->parent = node->parent;
+
+    if (node == *root) {
+        *root = temp;
+
+    } else if (node == node->parent->left) {
+        node->parent->left = temp;
+
+    } else {
+        node->parent->right = temp;
+    }
+
+    temp->left = node;
+    node->parent = temp;
+}
+
+
+static ngx_inline void
+ngx_rbtree_right_rotate(ngx_rbtree_node_t **root, ngx_rbtree_node_t *sentinel,
+    ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *temp;
+
+    temp = node->left;
+    node->left = temp->right;
+
+    if (temp->right != sentinel) {
+        temp->right->parent = node;
+    }
+
+    temp->parent = node->parent;
+
+    if (node == *root) {
+        *root = temp;
+
+    } else if (node == node->parent->right) {
+        node->parent->right = temp;
+
+    } else {
+        node->parent->left = temp;
+    }
+
+    temp->right = node;
+    node->parent = temp;
+}
+
+
+ngx_int_t
+ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
+{
+    mtx->lock = &addr->lock;
+    mtx->spin = 2048;
+
+    addr->lock = 0;
+    addr->wait = 0;
+
+    return NGX_OK;
+}
+
+
+ngx_uint_t
+ngx_shmtx_trylock(ngx_shmtx_t *mtx)
+{
+    return (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid));
+}
+
+
+void
+ngx_shmtx_lock(ngx_shmtx_t *mtx)
+{
+    ngx_uint_t  i, n;
+
+    for ( ;; ) {
+
+        if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+            return;
+        }
+
+        for (n = 1; n < mtx->spin; n <<= 1) {
+
+            for (i = 0; i < n; i++) {
+                ngx_cpu_pause();
+            }
+
+            if (*mtx->lock == 0
+                && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
+            {
+                return;
+            }
+        }
+
+        (void) usleep(0);
+    }
+}
+
+
+void
+ngx_shmtx_unlock(ngx_shmtx_t *mtx)
+{
+    ngx_memory_barrier();
+
+    *mtx->lock = 0;
+}
+
+
+ngx_uint_t
+ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid)
+{
+    return ngx_atomic_cmp_set(mtx->lock, pid, 0);
+}
+
+
+#define NGX_SLAB_RUN   ((ngx_uint_t) 1 << (sizeof(ngx_uint_t) * 8 - 1))
+
+
+typedef struct ngx_slab_run_s  ngx_slab_run_t;
+
+struct ngx_slab_run_s {
+    ngx_slab_run_t  *next;
+    ngx_uint_t       npages;
+};
+
+
+void
+ngx_slab_init(ngx_slab_pool_t *pool)
+{
+    ngx_uint_t  n;
+
+    pool->min_shift = 3;
+    pool->min_size = (size_t) 1 << pool->min_shift;
+
+    n = ((u_char *) pool->end - (u_char *) pool - sizeof(ngx_slab_pool_t))
+        / (ngx_pagesize + sizeof(ngx_uint_t));
+
+    pool->pages = (ngx_uint_t *) ((u_char *) pool + sizeof(ngx_slab_pool_t));
+    ngx_memzero(pool->pages, n * sizeof(ngx_uint_t));
+
+    pool->start = ngx_align_ptr(pool->pages + n, ngx_pagesize);
+
+    if (pool->start + n * ngx_pagesize > pool->end) {
+        n = (pool->end - pool->start) / ngx_pagesize;
+    }
+
+    pool->next = pool->start;
+    pool->end = pool->start + n * ngx_pagesize;
+    pool->pfree = n;
+
+    ngx_memzero(pool->chunks, sizeof(pool->chunks));
+    pool->runs = NULL;
+
+    pool->log_ctx = &pool->zero;
+    pool->zero = '\0';
+}
+
+
+void *
+ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    p = ngx_slab_alloc_locked(pool, size);
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return p;
+}
+
+
+static u_char *
+ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t npages)
+{
+    u_char           *p;
+    ngx_slab_run_t   *run, **prev;
+
+    for (prev = (ngx_slab_run_t **) &pool->runs, run = *prev;
+         run;
+         prev = &run->next, run = run->next)
+    {
+        if (run->npages < npages) {
+            continue;
+        }
+
+        if (run->npages == npages) {
+            *prev = run->next;
+
+        } else {
+            *prev = (ngx_slab_run_t *) ((u_char *) run + npages * ngx_pagesize);
+            (*prev)->next = run->next;
+            (*prev)->npages = run->npages - npages;
+        }
+
+        pool->pfree -= npages;
+
+        return (u_char *) run;
+    }
+
+    if ((ngx_uint_t) (pool->end - pool->next) < npages * ngx_pagesize) {
+        return NULL;
+    }
+
+    p = pool->next;
+    pool->next += npages * ngx_pagesize;
+    pool->pfree -= npages;
+
+    return p;
+}
+
+
+void *
+ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
+{
+    u_char      *p, *c;
+    ngx_uint_t   shift, page, npages;
+
+    if (size > ngx_pagesize / 2) {
+        npages = (size + ngx_pagesize - 1) / ngx_pagesize;
+
+        p = ngx_slab_alloc_pages(pool, npages);
+        if (p == NULL) {
+            goto fail;
+        }
+
+        page = (p - pool->start) / ngx_pagesize;
+        pool->pages[page] = NGX_SLAB_RUN | npages;
+
+        return p;
+    }
+
+    for (shift = pool->min_shift; ((size_t) 1 << shift) < size; shift++) {
+        /* void */
+    }
+
+    if (pool->chunks[shift] == NULL) {
+        p = ngx_slab_alloc_pages(pool, 1);
+        if (p == NULL) {
+            goto fail;
+        }
+
+        page = (p - pool->start) / ngx_pagesize;
+        pool->pages[page] = shift;
+
+        for (c = p + ngx_pagesize - ((size_t) 1 << shift);
+             c >= p;
+             c -= (size_t) 1 << shift)
+        {
+            *(void **) c = pool->chunks[shift];
+            pool->chunks[shift] = c;
+        }
+    }
+
+    p = pool->chunks[shift];
+    pool->chunks[shift] = *(void **) p;
+
+    return p;
+
+fail:
+
+    if (!pool->log_nomem) {
+        return NULL;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                  "ngx_slab_alloc() failed: no memory%s", pool->log_ctx);
+
+    return NULL;
+}
+
+
+void *
+ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    p = ngx_slab_alloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+void
+ngx_slab_free(ngx_slab_pool_t *pool, void *p)
+{
+    ngx_shmtx_lock(&pool->mutex);
+
+    ngx_slab_free_locked(pool, p);
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
+
+
+void
+ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
+{
+    ngx_uint_t       page, desc;
+    ngx_slab_run_t  *run;
+
+    page = ((u_char *) p - pool->start) / ngx_pagesize;
+    desc = pool->pages[page];
+
+    if (desc & NGX_SLAB_RUN) {
+        run = p;
+        run->npages = desc & ~NGX_SLAB_RUN;
+        run->next = pool->runs;
+        pool->runs = run;
+        pool->pfree += run->npages;
+
+        return;
+    }
+
+    *(void **) p = pool->chunks[desc];
+    pool->chunks[desc] = p;
+}
+
+
+ngx_int_t
+ngx_shm_zone_alloc(ngx_shm_zone_t *shm_zone)
+{
+    ngx_slab_pool_t  *sp;
+
+    shm_zone->shm.addr = mmap(NULL, shm_zone->shm.size,
+                              PROT_READ|PROT_WRITE,
+                              MAP_ANON|MAP_SHARED, -1, 0);
+
+    if (shm_zone->shm.addr == MAP_FAILED) {
+        return NGX_ERROR;
+    }
+
+    if (shm_zone->shm.log == NULL) {
+        shm_zone->shm.log = ngx_cycle->log;
+    }
+
+    shm_zone->shm.exists = 0;
+
+    sp = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    sp->end = shm_zone->shm.addr + shm_zone->shm.size;
+    sp->min_shift = 3;
+    sp->addr = shm_zone->shm.addr;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(sp);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_shm_zone_free(ngx_shm_zone_t *shm_zone)
+{
+    (void) munmap(shm_zone->shm.addr, shm_zone->shm.size);
+}
@@ -0,0 +1,3497 @@
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_limit_req2_core.h"
+
+
+/*
+ * The snapshot file of persist=: a header, then a record for every node
+ * and every unexpired ban, each followed by its key padded to 8 bytes.
+ * Nothing in it points into the zone and its times are absolute, keys are
+ * hashed again as they are restored, so a snapshot can be loaded into a
+ * zone of another size, shard count, index or hash.  Integers are in the
+ * byte order of the host, the magic does not match on a host of the other
+ * order.
+ */
+
+#define LIMIT_REQ2_SNAPSHOT_MAGIC      0x3251524c   /* "LRQ2" */
+#define LIMIT_REQ2_SNAPSHOT_VERSION    1
+
+#define LIMIT_REQ2_SNAPSHOT_NODE       1
+#define LIMIT_REQ2_SNAPSHOT_BAN        2
+
+/* entries per hold of a shard lock, a buffer holds two of the longest keys */
+#define LIMIT_REQ2_SNAPSHOT_SLICE      128
+#define LIMIT_REQ2_SNAPSHOT_BUFFER     (256 * 1024)
+
+
+typedef struct {
+    uint32_t                     magic;
+    uint32_t                     version;
+    uint32_t                     ntiers;
+    uint32_t                     reserved;
+    /* the time of the snapshot, msec */
+    uint64_t                     time;
+} ngx_http_limit_req2_snapshot_header_t;
+
+
+typedef struct {
+    uint16_t                     type;
+    uint16_t                     len;
+    uint32_t                     reserved;
+    /* the last request in msec and the end of the ban in seconds, or 0 */
+    uint64_t                     last;
+    uint64_t                     block_stop_time;
+    /* as of the last request, 1 corresponds to 0.001 r/s */
+    uint32_t                     excess[LIMIT_REQ2_MAX_TIERS];
+} ngx_http_limit_req2_snapshot_record_t;
+
+
+#define ngx_http_limit_req2_snapshot_size(len)                               \
+    (sizeof(ngx_http_limit_req2_snapshot_record_t) + ngx_align(len, 8))
+
+
+/* the entries added to a new zone from a snapshot or the previous zone */
+
+typedef struct {
+    ngx_http_limit_req2_ctx_t   *ctx;
+    /* the number of rates of the source */
+    ngx_uint_t                   ntiers;
+    ngx_msec_t                   now;
+    time_t                       sec;
+    ngx_uint_t                   nodes;
+    ngx_uint_t                   bans;
+    ngx_uint_t                   dropped;
+} ngx_http_limit_req2_load_t;
+
+
+static ngx_int_t ngx_http_limit_req2_lookup(ngx_log_t *log,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_shard_t *shard,
+    ngx_http_limit_req2_t *limit_req2, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t tokens, ngx_http_limit_req2_result_t *res);
+#if (NGX_HTTP_LIMIT_REQ2_LOCKFREE)
+static ngx_int_t ngx_http_limit_req2_lookup_fast(ngx_log_t *log,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_shard_t *shard,
+    ngx_http_limit_req2_t *limit_req2, ngx_http_limit_req2_key_t *key,
+    ngx_http_limit_req2_result_t *res);
+#endif
+static size_t ngx_http_limit_req2_node_size(ngx_http_limit_req2_ctx_t *ctx,
+    size_t len);
+static ngx_rbtree_node_t *ngx_http_limit_req2_alloc_node(
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_shard_t *shard,
+    size_t len);
+static void ngx_http_limit_req2_init_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_rbtree_node_t *node, ngx_http_limit_req2_key_t *key, ngx_msec_t now);
+static void ngx_http_limit_req2_free_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_http_limit_req2_index_full(
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_shard_t *shard);
+static void ngx_http_limit_req2_insert_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_rbtree_node_t *node);
+static void ngx_http_limit_req2_delete_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_rbtree_node_t *node);
+static void ngx_http_limit_req2_restore(ngx_shm_zone_t *shm_zone);
+static void ngx_http_limit_req2_migrate(ngx_shm_zone_t *shm_zone,
+    ngx_shm_zone_t *old_zone);
+
+
+static inline
+int get_stat_bit(uint64_t stat, int idx)
+{
+    stat >>= idx;
+    return stat & 1;
+}
+
+static inline
+void set_stat_bit(uint64_t *pstat, int idx, int val)
+{
+    uint64_t tmp = val <<= idx;
+    *pstat |= tmp;
+}
+
+/*
+ * Key hash functions, the update is called on the whole key.  crc32 is the
+ * historical 32-bit hash; crc32c uses the SSE4.2 instruction when the cpu
+ * has it; wyhash is a 64-bit multiply-mix hash that is much cheaper than a
+ * byte-wise crc on long composite keys and gives a full 64-bit node key.
+ */
+
+static uint64_t
+ngx_http_limit_req2_crc32_update(uint64_t hash, u_char *p, size_t len)
+{
+    uint32_t  crc;
+
+    crc = (uint32_t) hash;
+
+    ngx_crc32_update(&crc, p, len);
+
+    return crc;
+}
+
+
+static uint32_t  ngx_http_limit_req2_crc32c_table[256];
+
+
+static uint64_t
+ngx_http_limit_req2_crc32c_update_sw(uint64_t hash, u_char *p, size_t len)
+{
+    uint32_t  crc;
+
+    crc = (uint32_t) hash;
+
+    while (len--) {
+        crc = ngx_http_limit_req2_crc32c_table[(crc ^ *p++) & 0xff]
+              ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if ((__GNUC__ >= 5 || __clang__) && __x86_64__)
+
+#define NGX_HTTP_LIMIT_REQ2_HAVE_SSE42  1
+
+__attribute__((target("sse4.2")))
+static uint64_t
+ngx_http_limit_req2_crc32c_update_hw(uint64_t hash, u_char *p, size_t len)
+{
+    uint64_t  crc, v;
+
+    crc = (uint32_t) hash;
+
+    while (len >= 8) {
+        ngx_memcpy(&v, p, 8);
+        crc = __builtin_ia32_crc32di(crc, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __builtin_ia32_crc32qi((uint32_t) crc, *p++);
+    }
+
+    return crc;
+}
+
+#endif
+
+
+static void
+ngx_http_limit_req2_crc32c_init(void)
+{
+    uint32_t    c;
+    ngx_uint_t  i, k;
+
+    if (ngx_http_limit_req2_crc32c_table[1]) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+
+        ngx_http_limit_req2_crc32c_table[i] = c;
+    }
+}
+
+
+/* wyhash, final version 4, public domain (The Unlicense), by Wang Yi */
+
+static const uint64_t  ngx_http_limit_req2_wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+
+static ngx_inline void
+ngx_http_limit_req2_wymum(uint64_t *a, uint64_t *b)
+{
+#if (__SIZEOF_INT128__)
+    __uint128_t  r;
+
+    r = *a;
+    r *= *b;
+
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    uint64_t  ha, hb, la, lb, rh, rm0, rm1, rl, t, c, lo, hi;
+
+    ha = *a >> 32;
+    hb = *b >> 32;
+    la = (uint32_t) *a;
+    lb = (uint32_t) *b;
+
+    rh = ha * hb;
+    rm0 = ha * lb;
+    rm1 = hb * la;
+    rl = la * lb;
+
+    t = rl + (rm0 << 32);
+    c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+
+static ngx_inline uint64_t
+ngx_http_limit_req2_wymix(uint64_t a, uint64_t b)
+{
+    ngx_http_limit_req2_wymum(&a, &b);
+
+    return a ^ b;
+}
+
+
+static ngx_inline uint64_t
+ngx_http_limit_req2_wyr8(u_char *p)
+{
+    uint64_t  v;
+
+    ngx_memcpy(&v, p, 8);
+
+    return v;
+}
+
+
+static ngx_inline uint64_t
+ngx_http_limit_req2_wyr4(u_char *p)
+{
+    uint32_t  v;
+
+    ngx_memcpy(&v, p, 4);
+
+    return v;
+}
+
+
+static uint64_t
+ngx_http_limit_req2_wyhash_update(uint64_t seed, u_char *p, size_t len)
+{
+    size_t           i;
+    uint64_t         a, b, see1, see2;
+    const uint64_t  *s;
+
+    s = ngx_http_limit_req2_wyp;
+
+    seed ^= ngx_http_limit_req2_wymix(seed ^ s[0], s[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (ngx_http_limit_req2_wyr4(p) << 32)
+                | ngx_http_limit_req2_wyr4(p + ((len >> 3) << 2));
+            b = (ngx_http_limit_req2_wyr4(p + len - 4) << 32)
+                | ngx_http_limit_req2_wyr4(p + len - 4 - ((len >> 3) << 2));
+
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8)
+                | p[len - 1];
+            b = 0;
+
+        } else {
+            a = 0;
+            b = 0;
+        }
+
+    } else {
+        i = len;
+
+        if (i > 48) {
+            see1 = seed;
+            see2 = seed;
+
+            do {
+                seed = ngx_http_limit_req2_wymix(
+                           ngx_http_limit_req2_wyr8(p) ^ s[1],
+                           ngx_http_limit_req2_wyr8(p + 8) ^ seed);
+                see1 = ngx_http_limit_req2_wymix(
+                           ngx_http_limit_req2_wyr8(p + 16) ^ s[2],
+                           ngx_http_limit_req2_wyr8(p + 24) ^ see1);
+                see2 = ngx_http_limit_req2_wymix(
+                           ngx_http_limit_req2_wyr8(p + 32) ^ s[3],
+                           ngx_http_limit_req2_wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = ngx_http_limit_req2_wymix(
+                       ngx_http_limit_req2_wyr8(p) ^ s[1],
+                       ngx_http_limit_req2_wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        a = ngx_http_limit_req2_wyr8(p + i - 16);
+        b = ngx_http_limit_req2_wyr8(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+
+    ngx_http_limit_req2_wymum(&a, &b);
+
+    return ngx_http_limit_req2_wymix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+
+ngx_http_limit_req2_hash_t  ngx_http_limit_req2_hashes[] = {
+    { ngx_string("crc32"), 0xffffffff, 0xffffffff,
+      ngx_http_limit_req2_crc32_update },
+    { ngx_string("crc32c"), 0xffffffff, 0xffffffff,
+      ngx_http_limit_req2_crc32c_update_sw },
+    { ngx_string("wyhash"), 0, 0,
+      ngx_http_limit_req2_wyhash_update },
+    { ngx_null_string, 0, 0, NULL }
+};
+
+
+void
+ngx_http_limit_req2_hash_init(ngx_http_limit_req2_hash_t *h)
+{
+    if (h->update != ngx_http_limit_req2_crc32c_update_sw) {
+        return;
+    }
+
+    ngx_http_limit_req2_crc32c_init();
+
+#if (NGX_HTTP_LIMIT_REQ2_HAVE_SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        h->update = ngx_http_limit_req2_crc32c_update_hw;
+    }
+#endif
+}
+
+
+/*
+ * With lock_stats the time spent waiting for the lock of a shard and the
+ * time it is held go to log2 histograms: bucket 0 counts the times below
+ * 1us, bucket k the ones below 2^k us, and the last bucket all the rest.
+ */
+
+static ngx_inline uint64_t
+ngx_http_limit_req2_usec(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+static ngx_inline void
+ngx_http_limit_req2_histogram_add(ngx_atomic_t *h, ngx_atomic_t *sum,
+    uint64_t us)
+{
+    uint64_t    v;
+    ngx_uint_t  k;
+
+    for (k = 0, v = us; v && k < LIMIT_REQ2_LOCK_BUCKETS - 1; k++) {
+        v >>= 1;
+    }
+
+    (void) ngx_atomic_fetch_add(&h[k], 1);
+    (void) ngx_atomic_fetch_add(sum, (ngx_atomic_int_t) us);
+}
+
+
+/*
+ * Takes a mutex of the zone other than that of the slab pool.  When a
+ * worker dies nginx forces open the mutexes of the slab pools only, so a
+ * mutex that stays locked is checked for its holder and forced open if
+ * the process has exited.  Without atomic operations the lock file is
+ * released by the kernel.  With tries the mutex is given up after as many
+ * rounds of spinning, 1ms apart, and 0 is returned.
+ */
+
+static ngx_uint_t
+ngx_http_limit_req2_shmtx_lock(ngx_shmtx_t *mtx, ngx_uint_t tries)
+{
+    ngx_uint_t  i, k, n;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_pid_t   pid;
+#endif
+
+    for (n = 0; tries == 0 || n < tries; n++) {
+
+        if (ngx_shmtx_trylock(mtx)) {
+            return 1;
+        }
+
+        if (ngx_ncpu > 1) {
+
+            for (k = 1; k < mtx->spin; k <<= 1) {
+
+                for (i = 0; i < k; i++) {
+                    ngx_cpu_pause();
+                }
+
+                if (ngx_shmtx_trylock(mtx)) {
+                    return 1;
+                }
+            }
+        }
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        pid = (ngx_pid_t) *mtx->lock;
+
+        if (pid && pid != ngx_pid
+            && kill(pid, 0) == -1 && ngx_errno == NGX_ESRCH
+            && ngx_shmtx_force_unlock(mtx, pid))
+        {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "limit_req2 forced open a mutex held by "
+                          "exited process %P", pid);
+            continue;
+        }
+
+#endif
+
+        if (tries) {
+            ngx_msleep(1);
+
+        } else {
+            ngx_sched_yield();
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_uint_t
+ngx_http_limit_req2_lock(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard)
+{
+    uint64_t                      start;
+    ngx_http_limit_req2_stats_t  *st;
+
+    if (!ctx->lock_stats) {
+        (void) ngx_http_limit_req2_shmtx_lock(&shard->mutex, 0);
+        return 0;
+    }
+
+    if (ngx_shmtx_trylock(&shard->mutex)) {
+        ctx->lock_time = ngx_http_limit_req2_usec();
+        start = ctx->lock_time;
+
+    } else {
+        start = ngx_http_limit_req2_usec();
+        (void) ngx_http_limit_req2_shmtx_lock(&shard->mutex, 0);
+        ctx->lock_time = ngx_http_limit_req2_usec();
+    }
+
+    st = ngx_http_limit_req2_worker_stats(ctx);
+
+    ngx_http_limit_req2_histogram_add(st->lock_wait, &st->lock_wait_sum,
+                                      ctx->lock_time - start);
+
+    return (ngx_uint_t) (ctx->lock_time - start);
+}
+
+
+/*
+ * Takes the lock of a shard without waiting, or waiting for up to tries
+ * rounds of ngx_http_limit_req2_shmtx_lock(); 0 if it was not taken.
+ */
+
+ngx_uint_t
+ngx_http_limit_req2_trylock(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_uint_t tries)
+{
+    ngx_uint_t  locked;
+
+    locked = tries ? ngx_http_limit_req2_shmtx_lock(&shard->mutex, tries)
+                   : ngx_shmtx_trylock(&shard->mutex);
+
+    if (locked && ctx->lock_stats) {
+        ctx->lock_time = ngx_http_limit_req2_usec();
+    }
+
+    return locked;
+}
+
+
+void
+ngx_http_limit_req2_unlock(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard)
+{
+    uint64_t                      now;
+    ngx_http_limit_req2_stats_t  *st;
+
+    if (!ctx->lock_stats) {
+        ngx_shmtx_unlock(&shard->mutex);
+        return;
+    }
+
+    now = ngx_http_limit_req2_usec();
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    st = ngx_http_limit_req2_worker_stats(ctx);
+
+    ngx_http_limit_req2_histogram_add(st->lock_hold, &st->lock_hold_sum,
+                                      now - ctx->lock_time);
+}
+
+
+static void
+ngx_http_limit_req2_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_http_limit_req2_node_t  *lrn, *lrnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lrn = (ngx_http_limit_req2_node_t *) &node->color;
+            lrnt = (ngx_http_limit_req2_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lrn->data, lrnt->data, lrn->len, lrnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/*
+ * Structural changes of a shard (rbtree links) are bracketed by an odd/even
+ * sequence counter, so that the lockfree path can validate an unlocked walk.
+ */
+
+static ngx_inline void
+ngx_http_limit_req2_write_begin(ngx_http_limit_req2_shard_t *shard)
+{
+    shard->seq++;
+    ngx_memory_barrier();
+}
+
+
+static ngx_inline void
+ngx_http_limit_req2_write_end(ngx_http_limit_req2_shard_t *shard)
+{
+    ngx_memory_barrier();
+    shard->seq++;
+}
+
+
+static ngx_inline ngx_int_t
+ngx_http_limit_req2_in_zone(ngx_http_limit_req2_ctx_t *ctx, void *p,
+    size_t size)
+{
+    return (u_char *) p >= ctx->shpool->start
+           && (u_char *) p + size <= ctx->shpool->end;
+}
+
+
+/*
+ * With "index=hash" a shard is indexed by a Robin Hood open addressing
+ * table: probe sequences are kept sorted by displacement, so a miss stops
+ * as soon as a slot is closer to its home than the probe, and deletion
+ * shifts the following entries back instead of leaving tombstones.
+ */
+
+#define ngx_http_limit_req2_slot_dist(shard, i, hash)                        \
+    (((i) - ((hash) & (shard)->mask)) & (shard)->mask)
+
+
+static ngx_rbtree_node_t *
+ngx_http_limit_req2_find_slot(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t unlocked)
+{
+    ngx_uint_t                   i, dist, hash;
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_req2_slot_t  *slot;
+    ngx_http_limit_req2_node_t  *lr;
+
+    hash = (ngx_uint_t) key->hash;
+    i = hash & shard->mask;
+
+    for (dist = 0; dist <= shard->mask; dist++) {
+
+        slot = &shard->slots[i];
+        node = slot->node;
+
+        if (node == NULL
+            || ngx_http_limit_req2_slot_dist(shard, i, slot->hash) < dist)
+        {
+            return NULL;
+        }
+
+        if (slot->hash == hash) {
+
+            if (unlocked
+                && !ngx_http_limit_req2_in_zone(ctx, node,
+                          offsetof(ngx_rbtree_node_t, color)
+                          + offsetof(ngx_http_limit_req2_node_t, data)))
+            {
+                return NULL;
+            }
+
+            lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+            if (unlocked && !ngx_http_limit_req2_in_zone(ctx, lr->data,
+                                                         lr->len))
+            {
+                return NULL;
+            }
+
+            if (ngx_memn2cmp(key->key.data, lr->data, key->key.len, lr->len)
+                == 0)
+            {
+                return node;
+            }
+        }
+
+        i = (i + 1) & shard->mask;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_limit_req2_insert_slot(ngx_http_limit_req2_shard_t *shard,
+    ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                  i, dist, d;
+    ngx_http_limit_req2_slot_t  cur, tmp;
+
+    cur.hash = node->key;
+    cur.node = node;
+
+    i = cur.hash & shard->mask;
+
+    for (dist = 0; /* void */ ; dist++) {
+
+        if (shard->slots[i].node == NULL) {
+            shard->slots[i] = cur;
+            shard->nelts++;
+            return;
+        }
+
+        d = ngx_http_limit_req2_slot_dist(shard, i, shard->slots[i].hash);
+
+        if (d < dist) {
+            tmp = shard->slots[i];
+            shard->slots[i] = cur;
+            cur = tmp;
+            dist = d;
+        }
+
+        i = (i + 1) & shard->mask;
+    }
+}
+
+
+static void
+ngx_http_limit_req2_delete_slot(ngx_http_limit_req2_shard_t *shard,
+    ngx_rbtree_node_t *node)
+{
+    ngx_uint_t  i, j;
+
+    i = node->key & shard->mask;
+
+    while (shard->slots[i].node != node) {
+        i = (i + 1) & shard->mask;
+    }
+
+    for ( ;; ) {
+        j = (i + 1) & shard->mask;
+
+        if (shard->slots[j].node == NULL
+            || ngx_http_limit_req2_slot_dist(shard, j,
+                                             shard->slots[j].hash) == 0)
+        {
+            shard->slots[i].node = NULL;
+            break;
+        }
+
+        shard->slots[i] = shard->slots[j];
+        i = j;
+    }
+
+    shard->nelts--;
+}
+
+
+ngx_rbtree_node_t *
+ngx_http_limit_req2_find(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t unlocked)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   depth, hash;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_req2_node_t  *lr;
+
+    if (ctx->index == LIMIT_REQ2_INDEX_HASH) {
+        return ngx_http_limit_req2_find_slot(ctx, shard, key, unlocked);
+    }
+
+    hash = (ngx_uint_t) key->hash;
+    node = shard->rbtree.root;
+    sentinel = &shard->sentinel;
+
+    for (depth = 0; node != sentinel; depth++) {
+
+        /* an unlocked walk racing with a writer may see stale links */
+
+        if (unlocked
+            && (depth == LIMIT_REQ2_LOCKFREE_MAX_DEPTH
+                || !ngx_http_limit_req2_in_zone(ctx, node,
+                          offsetof(ngx_rbtree_node_t, color)
+                          + offsetof(ngx_http_limit_req2_node_t, data))))
+        {
+            return NULL;
+        }
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+        if (unlocked && !ngx_http_limit_req2_in_zone(ctx, lr->data, lr->len)) {
+            return NULL;
+        }
+
+        rc = ngx_memn2cmp(key->key.data, lr->data, key->key.len, lr->len);
+
+        if (rc == 0) {
+            return node;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_uint_t
+ngx_http_limit_req2_index_full(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard)
+{
+    /* keep the load factor of the hash index below 7/8 */
+
+    return ctx->index == LIMIT_REQ2_INDEX_HASH
+           && shard->nelts >= shard->mask + 1 - ((shard->mask + 1) >> 3);
+}
+
+
+static void
+ngx_http_limit_req2_insert_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_rbtree_node_t *node)
+{
+    ngx_http_limit_req2_node_t  *lr;
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    ngx_queue_insert_head(&shard->queue, &lr->queue);
+    shard->nnodes++;
+
+    ngx_http_limit_req2_write_begin(shard);
+
+    if (ctx->index == LIMIT_REQ2_INDEX_HASH) {
+        ngx_http_limit_req2_insert_slot(shard, node);
+
+    } else {
+        ngx_rbtree_insert(&shard->rbtree, node);
+    }
+
+    ngx_http_limit_req2_write_end(shard);
+}
+
+
+static void
+ngx_http_limit_req2_delete_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_rbtree_node_t *node)
+{
+    ngx_http_limit_req2_node_t  *lr;
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    ngx_queue_remove(&lr->queue);
+    shard->nnodes--;
+
+    ngx_http_limit_req2_write_begin(shard);
+
+    if (ctx->index == LIMIT_REQ2_INDEX_HASH) {
+        ngx_http_limit_req2_delete_slot(shard, node);
+
+    } else {
+        ngx_rbtree_delete(&shard->rbtree, node);
+    }
+
+    ngx_http_limit_req2_write_end(shard);
+}
+
+
+static void
+ngx_http_limit_req2_ban_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_http_limit_req2_ban_t   *ban, *bant;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ban = (ngx_http_limit_req2_ban_t *) node;
+            bant = (ngx_http_limit_req2_ban_t *) temp;
+
+            p = (ngx_memn2cmp(ban->data, bant->data, ban->len, bant->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+ngx_http_limit_req2_ban_t *
+ngx_http_limit_req2_ban_find(ngx_http_limit_req2_shard_t *shard,
+    ngx_http_limit_req2_key_t *key)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  hash;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_limit_req2_ban_t  *ban;
+
+    hash = (ngx_uint_t) key->hash;
+    node = shard->bans.root;
+    sentinel = &shard->bans_sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        ban = (ngx_http_limit_req2_ban_t *) node;
+
+        rc = ngx_memn2cmp(key->key.data, ban->data, key->key.len, ban->len);
+
+        if (rc == 0) {
+            return ban;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * The ban pool is nested in the zone, nginx does not force its mutex open
+ * when a worker dies, so it is taken as a shard mutex is.
+ */
+
+static void *
+ngx_http_limit_req2_ban_alloc(ngx_http_limit_req2_ctx_t *ctx, size_t size)
+{
+    void             *p;
+    ngx_slab_pool_t  *banpool;
+
+    banpool = ctx->sh->banpool;
+
+    (void) ngx_http_limit_req2_shmtx_lock(&banpool->mutex, 0);
+
+    p = ngx_slab_alloc_locked(banpool, size);
+
+    ngx_shmtx_unlock(&banpool->mutex);
+
+    return p;
+}
+
+
+static void
+ngx_http_limit_req2_ban_free(ngx_http_limit_req2_ctx_t *ctx, void *p)
+{
+    ngx_slab_pool_t  *banpool;
+
+    banpool = ctx->sh->banpool;
+
+    (void) ngx_http_limit_req2_shmtx_lock(&banpool->mutex, 0);
+
+    ngx_slab_free_locked(banpool, p);
+
+    ngx_shmtx_unlock(&banpool->mutex);
+}
+
+
+static void
+ngx_http_limit_req2_ban_delete(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_ban_t *ban)
+{
+    ngx_rbtree_delete(&shard->ban_expire, &ban->expire);
+    ngx_rbtree_delete(&shard->bans, &ban->node);
+
+    shard->nbans--;
+
+    ngx_http_limit_req2_ban_free(ctx, ban);
+}
+
+
+/*
+ * Drops up to n bans that are over, the oldest first; a ban is in effect
+ * while block_stop_time >= now.
+ */
+
+static void
+ngx_http_limit_req2_ban_expire(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_uint_t now, ngx_uint_t n)
+{
+    ngx_rbtree_node_t          *node;
+    ngx_http_limit_req2_ban_t  *ban;
+
+    while (n-- && shard->ban_expire.root != &shard->ban_expire_sentinel) {
+
+        node = ngx_rbtree_min(shard->ban_expire.root,
+                              &shard->ban_expire_sentinel);
+
+        if (node->key >= now) {
+            return;
+        }
+
+        ban = (ngx_http_limit_req2_ban_t *)
+                  ((u_char *) node
+                   - offsetof(ngx_http_limit_req2_ban_t, expire));
+
+        ngx_http_limit_req2_ban_delete(ctx, shard, ban);
+    }
+}
+
+
+/* sets or moves the ban of the key, NGX_ERROR if the ban pool is full */
+
+ngx_int_t
+ngx_http_limit_req2_ban_set(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t block_stop_time)
+{
+    size_t                      n;
+    ngx_http_limit_req2_ban_t  *ban;
+
+    ban = ngx_http_limit_req2_ban_find(shard, key);
+
+    if (ban) {
+        if (ban->expire.key != block_stop_time) {
+            ngx_rbtree_delete(&shard->ban_expire, &ban->expire);
+
+            /* the workers may have cached the longer ban */
+
+            if (block_stop_time < ban->expire.key) {
+                (void) ngx_atomic_fetch_add(&ctx->sh->gen, 1);
+            }
+
+            ban->expire.key = block_stop_time;
+            ngx_rbtree_insert(&shard->ban_expire, &ban->expire);
+        }
+
+        return NGX_OK;
+    }
+
+    n = offsetof(ngx_http_limit_req2_ban_t, data) + key->key.len;
+
+    ban = ngx_http_limit_req2_ban_alloc(ctx, n);
+
+    if (ban == NULL) {
+        ngx_http_limit_req2_ban_expire(ctx, shard, ngx_time(), (ngx_uint_t) -1);
+
+        ban = ngx_http_limit_req2_ban_alloc(ctx, n);
+        if (ban == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate ban%s, the ban is not stored",
+                          ctx->shpool->log_ctx);
+            return NGX_ERROR;
+        }
+    }
+
+    ban->node.key = (ngx_rbtree_key_t) key->hash;
+    ban->expire.key = block_stop_time;
+    ban->len = (u_short) key->key.len;
+    ngx_memcpy(ban->data, key->key.data, key->key.len);
+
+    ngx_rbtree_insert(&shard->bans, &ban->node);
+    ngx_rbtree_insert(&shard->ban_expire, &ban->expire);
+
+    shard->nbans++;
+
+    /* the workers may hold leases of the key */
+
+    (void) ngx_atomic_fetch_add(&ctx->sh->gen, 1);
+
+    return NGX_OK;
+}
+
+
+/* drops the ban of the key and resets its rate state */
+
+ngx_int_t
+ngx_http_limit_req2_ban_clear(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key)
+{
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_req2_ban_t   *ban;
+    ngx_http_limit_req2_node_t  *lr;
+
+    ban = ngx_http_limit_req2_ban_find(shard, key);
+
+    if (ban) {
+        ngx_http_limit_req2_ban_delete(ctx, shard, ban);
+    }
+
+    node = ngx_http_limit_req2_find(ctx, shard, key, 0);
+
+    if (node) {
+        lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+        lr->block_stop = 0;
+        lr->state = ngx_http_limit_req2_state(
+                       ngx_http_limit_req2_state_last(lr->state), 0);
+        ngx_memzero(ngx_http_limit_req2_node_tiers(lr), ctx->tiers_size);
+    }
+
+    if (ban == NULL && node == NULL) {
+        return NGX_DECLINED;
+    }
+
+    (void) ngx_atomic_fetch_add(&ctx->sh->gen, 1);
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_limit_req2_node_size(ngx_http_limit_req2_ctx_t *ctx, size_t len)
+{
+    len += offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_limit_req2_node_t, data);
+
+    if (ctx->tiers_size || ctx->seg_size || ctx->block_size) {
+        len = ngx_align(len, sizeof(uint32_t)) + ctx->tiers_size
+              + ctx->seg_size;
+    }
+
+    if (ctx->block_size) {
+        len = ngx_align(len, sizeof(uint64_t)) + ctx->block_size;
+    }
+
+    return len;
+}
+
+
+/*
+ * With arena= every shard has a preallocated array of nodes of one size,
+ * large enough for a key of arena_key_len bytes.  A node is taken from the
+ * free list or from the untouched end of the array; keys that are longer,
+ * or do not fit once the arena is full, overflow to the slab allocator.
+ *
+ * The slab allocator has one mutex for the whole zone, so a sharded zone
+ * does not give the nodes it frees back to it: they are kept in the list
+ * of their size class in the shard and reused under the shard lock only.
+ */
+
+static ngx_int_t
+ngx_http_limit_req2_free_class(ngx_http_limit_req2_ctx_t *ctx, size_t len)
+{
+    size_t      size;
+    ngx_uint_t  shift;
+
+    if (ctx->nshards == 1) {
+        return NGX_DECLINED;
+    }
+
+    size = ngx_http_limit_req2_node_size(ctx, len);
+
+    /* larger chunks take whole pages */
+
+    if (size > ngx_pagesize / 2) {
+        return NGX_DECLINED;
+    }
+
+    for (shift = LIMIT_REQ2_FREE_MIN_SHIFT; (size_t) 1 << shift < size;
+         shift++)
+    {
+        /* void */
+    }
+
+    shift -= LIMIT_REQ2_FREE_MIN_SHIFT;
+
+    return (shift < LIMIT_REQ2_FREE_CLASSES) ? (ngx_int_t) shift
+                                             : NGX_DECLINED;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_limit_req2_alloc_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, size_t len)
+{
+    ngx_int_t           class;
+    ngx_rbtree_node_t  *node;
+
+    if (len <= ctx->arena_key_len) {
+
+        node = shard->arena_free;
+
+        if (node) {
+            shard->arena_free = node->left;
+            return node;
+        }
+
+        if (shard->arena_next + ctx->arena_stride <= shard->arena_end) {
+            node = (ngx_rbtree_node_t *) shard->arena_next;
+            shard->arena_next += ctx->arena_stride;
+            return node;
+        }
+    }
+
+    class = ngx_http_limit_req2_free_class(ctx, len);
+
+    if (class != NGX_DECLINED && shard->free[class]) {
+        node = shard->free[class];
+        shard->free[class] = node->left;
+        shard->nfree[class]--;
+        return node;
+    }
+
+    return ngx_slab_alloc(ctx->shpool, ngx_http_limit_req2_node_size(ctx, len));
+}
+
+
+/* a new node of the key, with no excess and the last request at now */
+
+static void
+ngx_http_limit_req2_init_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_rbtree_node_t *node, ngx_http_limit_req2_key_t *key, ngx_msec_t now)
+{
+    ngx_http_limit_req2_node_t      *lr;
+    ngx_http_limit_req2_node_seg_t  *seg;
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    node->key = (ngx_rbtree_key_t) key->hash;
+    lr->len = (u_short) key->key.len;
+
+    lr->state = ngx_http_limit_req2_state(now, 0);
+
+    lr->block_stop = 0;
+
+    ngx_memcpy(lr->data, key->key.data, key->key.len);
+    ngx_memzero(ngx_http_limit_req2_node_tiers(lr), ctx->tiers_size);
+
+    if (ctx->seg_size) {
+        seg = ngx_http_limit_req2_node_seg(ctx, lr);
+        seg->last_seg = 0;
+        seg->curr_seg = 1;
+    }
+
+    if (ctx->block_size) {
+        ngx_memzero(ngx_http_limit_req2_node_block(ctx, lr), ctx->block_size);
+    }
+}
+
+
+static void
+ngx_http_limit_req2_free_node(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_rbtree_node_t *node)
+{
+    ngx_int_t                    class;
+    ngx_http_limit_req2_node_t  *lr;
+
+    if ((u_char *) node >= shard->arena && (u_char *) node < shard->arena_end)
+    {
+        node->left = shard->arena_free;
+        shard->arena_free = node;
+        return;
+    }
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    class = ngx_http_limit_req2_free_class(ctx, lr->len);
+
+    if (class != NGX_DECLINED && shard->nfree[class] < LIMIT_REQ2_FREE_MAX) {
+        node->left = shard->free[class];
+        shard->free[class] = node;
+        shard->nfree[class]++;
+        return;
+    }
+
+    ngx_slab_free(ctx->shpool, node);
+}
+
+
+/*
+ * replicate: queues a change of the worker to be sent to the peers, a
+ * change that does not fit before the next send is dropped.
+ */
+
+void
+ngx_http_limit_req2_replicate_add(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_uint_t type, ngx_http_limit_req2_key_t *key, ngx_uint_t value)
+{
+    u_char                           *p;
+    ngx_http_limit_req2_replicate_t  *rp;
+
+    rp = ctx->replicate;
+
+    if (key->key.len > LIMIT_REQ2_REPLICATE_KEY_LEN
+        || (size_t) (rp->end - rp->last)
+           < LIMIT_REQ2_REPLICATE_HEADER + key->key.len)
+    {
+        ngx_http_limit_req2_count(ctx, replicate_dropped);
+        return;
+    }
+
+    p = rp->last;
+
+    *p++ = (u_char) type;
+    *p++ = (u_char) (key->key.len >> 8);
+    *p++ = (u_char) key->key.len;
+    *p++ = (u_char) (value >> 24);
+    *p++ = (u_char) (value >> 16);
+    *p++ = (u_char) (value >> 8);
+    *p++ = (u_char) value;
+
+    rp->last = ngx_cpymem(p, key->key.data, key->key.len);
+}
+
+
+/*
+ * cluster: adds the tokens a request took from the node of a key to the
+ * delta of the key, sent to the peers with the next sync.  The delta of
+ * the key that had the slot, and the delta of a key too long for a slot,
+ * are queued as they are.
+ */
+
+void
+ngx_http_limit_req2_cluster_add(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_key_t *key, ngx_uint_t tokens)
+{
+    ngx_http_limit_req2_key_t     k;
+    ngx_http_limit_req2_delta_t  *d;
+
+    if (key->key.len > LIMIT_REQ2_LOCAL_KEY_LEN) {
+        ngx_http_limit_req2_replicate_add(ctx, LIMIT_REQ2_REPLICATE_DELTA,
+                                          key, tokens);
+        return;
+    }
+
+    d = &ctx->deltas[(key->hash >> 8) & (LIMIT_REQ2_DELTA_SLOTS - 1)];
+
+    if (d->tokens) {
+
+        if (d->hash == key->hash
+            && d->len == key->key.len
+            && ngx_memcmp(d->data, key->key.data, key->key.len) == 0)
+        {
+            d->tokens += tokens;
+            return;
+        }
+
+        k.key.data = d->data;
+        k.key.len = d->len;
+
+        ngx_http_limit_req2_replicate_add(ctx, LIMIT_REQ2_REPLICATE_DELTA,
+                                          &k, d->tokens);
+    }
+
+    d->hash = key->hash;
+    d->tokens = tokens;
+    d->len = (u_short) key->key.len;
+    ngx_memcpy(d->data, key->key.data, key->key.len);
+}
+
+
+/* cluster: queues the deltas of the worker, once every sync */
+
+void
+ngx_http_limit_req2_cluster_collect(ngx_http_limit_req2_ctx_t *ctx)
+{
+    ngx_uint_t                    i;
+    ngx_http_limit_req2_key_t     k;
+    ngx_http_limit_req2_delta_t  *d;
+
+    for (i = 0; i < LIMIT_REQ2_DELTA_SLOTS; i++) {
+        d = &ctx->deltas[i];
+
+        if (d->tokens == 0) {
+            continue;
+        }
+
+        k.key.data = d->data;
+        k.key.len = d->len;
+
+        ngx_http_limit_req2_replicate_add(ctx, LIMIT_REQ2_REPLICATE_DELTA,
+                                          &k, d->tokens);
+        d->tokens = 0;
+    }
+}
+
+
+/*
+ * cluster: adds the tokens the peer took from a key to the excess of its
+ * node, as if they were taken now, so the excess is drained up to now
+ * first.  A key not in the zone gets a node, the peer's requests are the
+ * first ones of the key.
+ */
+
+static void
+ngx_http_limit_req2_cluster_fold(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t tokens)
+{
+    int64_t                       e;
+    uint32_t                     *tiers;
+    ngx_uint_t                    k;
+    ngx_time_t                   *tp;
+    ngx_msec_t                    now;
+    ngx_msec_int_t                ms;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req2_node_t   *lr;
+    ngx_http_limit_req2_state_t   state;
+
+    tp = ngx_timeofday();
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    node = ngx_http_limit_req2_find(ctx, shard, key, 0);
+
+    if (node == NULL) {
+
+        if (ngx_http_limit_req2_index_full(ctx, shard)) {
+            ngx_http_limit_req2_expire(ctx, shard, 0,
+                                       LIMIT_REQ2_EXPIRE_BATCH);
+        }
+
+        node = ngx_http_limit_req2_alloc_node(ctx, shard, key->key.len);
+        if (node == NULL) {
+            ngx_http_limit_req2_expire(ctx, shard, 0,
+                                       LIMIT_REQ2_EXPIRE_BATCH);
+            node = ngx_http_limit_req2_alloc_node(ctx, shard, key->key.len);
+            if (node == NULL) {
+                ngx_http_limit_req2_count(ctx, alloc_failed);
+
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "could not allocate node%s, the delta of "
+                              "a peer is dropped", ctx->shpool->log_ctx);
+                return;
+            }
+        }
+
+        ngx_http_limit_req2_init_node(ctx, node, key, now);
+        ngx_http_limit_req2_insert_node(ctx, shard, node);
+    }
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    /* the lockfree path may change the state of a single tier zone */
+
+    for ( ;; ) {
+        state = lr->state;
+
+        ms = ngx_http_limit_req2_state_ms(state, now);
+        ms = ngx_abs(ms);
+
+        e = (int64_t) ngx_http_limit_req2_state_excess(state)
+            - (int64_t) (ctx->rates[0] * ms / 1000);
+
+        e = ngx_max(e, 0) + (int64_t) tokens * 1000;
+        e = ngx_min(e, (int64_t) LIMIT_REQ2_EXCESS_MAX);
+
+        if (ngx_http_limit_req2_state_cas(lr, state,
+                ngx_http_limit_req2_state(now, e)))
+        {
+            break;
+        }
+    }
+
+    tiers = ngx_http_limit_req2_node_tiers(lr);
+
+    for (k = 1; k < ctx->ntiers; k++) {
+        e = (int64_t) tiers[k - 1] - (int64_t) (ctx->rates[k] * ms / 1000);
+
+        e = ngx_max(e, 0) + (int64_t) tokens * 1000;
+        tiers[k - 1] = (uint32_t) ngx_min(e, (int64_t) LIMIT_REQ2_EXCESS_MAX);
+    }
+}
+
+
+/*
+ * Applies the changes of a datagram of a peer, one shard lock each.  The
+ * changes are not queued again, so they never go back to the peers.
+ */
+
+ngx_int_t
+ngx_http_limit_req2_replicate_apply(ngx_http_limit_req2_ctx_t *ctx,
+    u_char *p, u_char *last)
+{
+    size_t                        len;
+    ngx_uint_t                    type, value;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req2_key_t     key;
+    ngx_http_limit_req2_node_t   *lr;
+    ngx_http_limit_req2_shard_t  *shard;
+
+    while (p < last) {
+
+        if ((size_t) (last - p) < LIMIT_REQ2_REPLICATE_HEADER) {
+            return NGX_ERROR;
+        }
+
+        type = p[0];
+        len = (size_t) p[1] << 8 | p[2];
+        value = (ngx_uint_t) p[3] << 24 | (ngx_uint_t) p[4] << 16
+                | (ngx_uint_t) p[5] << 8 | p[6];
+
+        p += LIMIT_REQ2_REPLICATE_HEADER;
+
+        if (len == 0
+            || (size_t) (last - p) < len
+            || type < LIMIT_REQ2_REPLICATE_SET
+            || type > LIMIT_REQ2_REPLICATE_DELTA)
+        {
+            return NGX_ERROR;
+        }
+
+        key.key.data = p;
+        key.key.len = len;
+        key.hash = ctx->hash->final
+                   ^ ctx->hash->update(ctx->hash->init, p, len);
+        key.hash_alg = ctx->hash;
+        key.limit_vars = NULL;
+
+        p += len;
+
+        /* a peer may sync a zone that is not a cluster one here */
+
+        if (type == LIMIT_REQ2_REPLICATE_DELTA && ctx->deltas == NULL) {
+            continue;
+        }
+
+        shard = ngx_http_limit_req2_shard(ctx, key.hash);
+
+        (void) ngx_http_limit_req2_lock(ctx, shard);
+
+        if (type == LIMIT_REQ2_REPLICATE_DELTA) {
+            ngx_http_limit_req2_cluster_fold(ctx, shard, &key, value);
+
+        } else if (type == LIMIT_REQ2_REPLICATE_CLEAR) {
+            (void) ngx_http_limit_req2_ban_clear(ctx, shard, &key);
+
+        } else {
+            value += (ngx_uint_t) ngx_time();
+
+            if (ngx_http_limit_req2_ban_set(ctx, shard, &key, value)
+                == NGX_OK)
+            {
+                node = ngx_http_limit_req2_find(ctx, shard, &key, 0);
+
+                if (node) {
+                    lr = (ngx_http_limit_req2_node_t *) &node->color;
+                    lr->block_stop = ngx_http_limit_req2_zone_sec(ctx, value);
+                }
+            }
+        }
+
+        ngx_http_limit_req2_unlock(ctx, shard);
+
+        ngx_http_limit_req2_count(ctx, replicate_received);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_lookup(ngx_log_t *log,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_shard_t *shard,
+    ngx_http_limit_req2_t *limit_req2, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t tokens, ngx_http_limit_req2_result_t *res)
+{
+    ngx_int_t                        e, base[LIMIT_REQ2_MAX_TIERS];
+    ngx_uint_t                       k, n, exceeded;
+    ngx_msec_t                       d;
+    uint32_t                        *tiers, te[LIMIT_REQ2_MAX_TIERS];
+    ngx_time_t                      *tp;
+    ngx_msec_t                       now;
+    ngx_msec_int_t                   ms;
+    ngx_rbtree_node_t               *node;
+    ngx_http_limit_req2_node_t      *lr;
+    ngx_http_limit_req2_ban_t       *ban;
+    ngx_http_limit_req2_state_t      state;
+
+    ngx_uint_t                       stat_interval, stat_times, now_sec, diff;
+    ngx_int_t                        check_all_bit, last_zero_pos;
+    ngx_uint_t                       j;
+    uint32_t                         now_rel;
+    ngx_http_limit_req2_node_seg_t   *seg;
+    ngx_http_limit_req2_node_block_t *blk;
+
+    ngx_msec_t                       last_rate_seg;
+    ngx_msec_t                       curr_rate_seg;
+
+    tp = ngx_timeofday();
+    now_sec = (ngx_uint_t) (tp->sec);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "limit_req2_lookup hash: %uL key: \"%V\"",
+                   key->hash, &key->key);
+
+    node = ngx_http_limit_req2_find(ctx, shard, key, 0);
+
+    if (node == NULL) {
+        res->excess = 0;
+        res->delay = 0;
+        res->tier = 0;
+        res->tokens = 0;
+        res->block_stop_time = 0;
+
+        res->last_seg = 0;
+        res->curr_seg = 1;
+        res->curr_seg_time_diff = 0;
+
+        /* the rate state of a banned key may have been evicted */
+
+        ban = shard->nbans ? ngx_http_limit_req2_ban_find(shard, key) : NULL;
+
+        if (ban && ban->expire.key >= now_sec) {
+            res->block_stop_time = ban->expire.key;
+            return NGX_BUSY;
+        }
+
+        return NGX_DECLINED;
+    }
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+    tiers = ngx_http_limit_req2_node_tiers(lr);
+
+    ngx_queue_remove(&lr->queue);
+    ngx_queue_insert_head(&shard->queue, &lr->queue);
+
+    state = lr->state;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+            "limit_req2 lookup sucess "
+            "now_sec: %ui "
+            "block_stop: %uD "
+            "excess: %ui.%03ui",
+            now_sec, lr->block_stop,
+            ngx_http_limit_req2_state_excess(state) / 1000,
+            ngx_http_limit_req2_state_excess(state) % 1000);
+
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    /* block check, the node holds a copy of the ban of the key */
+    if (lr->block_stop >= ngx_http_limit_req2_zone_sec(ctx, now_sec)) {
+        res->block_stop_time = ctx->sh->epoch + lr->block_stop;
+        return NGX_BUSY;
+    }
+
+    /*
+     * every tier is a separate leaky bucket sharing the time of the
+     * last request, the request is limited by the first tier over its
+     * burst, or delayed by the tier that needs the longest delay;
+     * a lease takes as many of the requested tokens as all tiers have
+     * room for; the lockfree path may update the state of a single
+     * tier zone concurrently, so the new state is published with
+     * a compare-and-set
+     */
+
+    for ( ;; ) {
+        ms = ngx_http_limit_req2_state_ms(state, now);
+        ms = ngx_abs(ms);
+
+        n = tokens;
+        exceeded = 0;
+
+        for (k = 0; k < ctx->ntiers; k++) {
+            e = (k == 0) ? ngx_http_limit_req2_state_excess(state)
+                         : (ngx_int_t) tiers[k - 1];
+
+            base[k] = e - ctx->rates[k] * ms / 1000;
+
+            /* room left below the burst */
+            e = (ngx_int_t) limit_req2->bursts[k] - base[k];
+
+            if (e < 1000) {
+                res->excess = base[k] + 1000;
+                res->tier = k;
+                exceeded = 1;
+                break;
+            }
+
+            if ((ngx_uint_t) e / 1000 < n) {
+                n = e / 1000;
+            }
+        }
+
+        if (exceeded) {
+            break;
+        }
+
+        res->excess = 0;
+        res->delay = 0;
+        res->tier = 0;
+
+        for (k = 0; k < ctx->ntiers; k++) {
+            e = base[k] + (ngx_int_t) (n * 1000);
+
+            if (e < 0) {
+                e = 0;
+            }
+
+            te[k] = (uint32_t) e;
+            d = (ngx_msec_t) e * 1000 / ctx->rates[k];
+
+            if (k == 0 || d > res->delay) {
+                res->excess = e;
+                res->delay = d;
+                res->tier = k;
+            }
+        }
+
+        if (ngx_http_limit_req2_state_cas(lr, state,
+                ngx_http_limit_req2_state(now, te[0])))
+        {
+            for (k = 1; k < ctx->ntiers; k++) {
+                tiers[k - 1] = te[k];
+            }
+
+            break;
+        }
+
+        state = lr->state;
+    }
+
+    res->tokens = exceeded ? 0 : n;
+
+    if (exceeded) {
+
+        /* stat for block */
+        stat_times = limit_req2->block_stat_times;
+
+        if (stat_times != 0) {
+
+            blk = ngx_http_limit_req2_node_block(ctx, lr);
+            now_rel = ngx_http_limit_req2_zone_sec(ctx, now_sec);
+
+            stat_interval = limit_req2->block_stat_interval;
+            diff = now_rel - blk->base;
+
+            if (diff >= stat_interval * stat_times) {
+
+                blk->base = now_rel;
+                blk->stat = 1;
+
+            } else if (diff >= (stat_times-1) * stat_interval) {
+
+                set_stat_bit(&blk->stat,
+                                            stat_times - 1, 1);
+                check_all_bit = 1;
+                last_zero_pos = 0;
+
+                for (j = 0; j < stat_times - 1; ++j) {
+                    if (!get_stat_bit(blk->stat, j)) {
+                        check_all_bit = 0;
+                        last_zero_pos = j;
+                    }
+                }
+
+                if (check_all_bit) {
+                    /* auto block */
+                    lr->block_stop = now_rel + limit_req2->block_time;
+
+                    ngx_http_limit_req2_count(ctx, auto_blocked);
+
+                    (void) ngx_http_limit_req2_ban_set(ctx, shard, key,
+                                           now_sec + limit_req2->block_time);
+
+                    if (ctx->replicate) {
+                        ngx_http_limit_req2_replicate_add(ctx,
+                                           LIMIT_REQ2_REPLICATE_SET, key,
+                                           limit_req2->block_time);
+                    }
+
+                    blk->stat >>= 1;
+                    blk->base += stat_interval;
+                } else {
+                    blk->stat >>= last_zero_pos + 1;
+                    blk->base += (last_zero_pos + 1)
+                        * stat_interval;
+                }
+            } else {
+                set_stat_bit(&blk->stat,
+                            diff / stat_interval, 1);
+            }
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP,
+                    log, 0,
+                    "limit_req2 now_sec: %ui "
+                    "block stop: %uD "
+                    "block_stat_base: %uD "
+                    "block stat: %uL ",
+                    now_sec, lr->block_stop,
+                    blk->base, blk->stat);
+        }
+
+        return NGX_BUSY;
+    }
+
+    if (limit_req2->rate_seg != 0) {
+        seg = ngx_http_limit_req2_node_seg(ctx, lr);
+
+        last_rate_seg = ngx_http_limit_req2_state_last(state)
+                        / limit_req2->rate_seg;
+        curr_rate_seg = (uint32_t) now / limit_req2->rate_seg;
+        if (curr_rate_seg > last_rate_seg + 1) {
+
+            seg->last_seg = 0;
+            seg->curr_seg = 1;
+
+        } else if (curr_rate_seg == last_rate_seg + 1) {
+
+            seg->last_seg = seg->curr_seg;
+            seg->curr_seg = 1;
+
+        } else if (curr_rate_seg == last_rate_seg) {
+
+            ++seg->curr_seg;
+
+        } else {
+            /* never appear */
+            seg->last_seg = 0;
+            seg->curr_seg = 0;
+        }
+
+        res->last_seg = seg->last_seg;
+        res->curr_seg = seg->curr_seg;
+        res->curr_seg_time_diff = (uint32_t) now
+                                  % limit_req2->rate_seg;
+    }
+
+    if (res->excess) {
+        return NGX_AGAIN;
+
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HTTP_LIMIT_REQ2_LOCKFREE)
+
+/*
+ * Accounts a request against an existing node without taking the shard
+ * mutex.  The index is walked under the shard sequence counter and the node
+ * state is updated with a single compare-and-set; NGX_DECLINED means the
+ * caller has to fall back to the locked path (unknown key, concurrent index
+ * change, or the request has to go through block accounting).
+ */
+
+static ngx_int_t
+ngx_http_limit_req2_lookup_fast(ngx_log_t *log,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_shard_t *shard,
+    ngx_http_limit_req2_t *limit_req2, ngx_http_limit_req2_key_t *key,
+    ngx_http_limit_req2_result_t *res)
+{
+    ngx_int_t                     excess;
+    uint32_t                      block_stop;
+    ngx_time_t                   *tp;
+    ngx_msec_t                    now;
+    ngx_msec_int_t                ms;
+    ngx_atomic_uint_t             seq;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req2_node_t   *lr;
+    ngx_http_limit_req2_state_t   state;
+
+    seq = shard->seq;
+
+    if (seq & 1) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memory_barrier();
+
+    node = ngx_http_limit_req2_find(ctx, shard, key, 1);
+
+    if (node == NULL) {
+        return NGX_DECLINED;
+    }
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    state = lr->state;
+    block_stop = lr->block_stop;
+
+    ngx_memory_barrier();
+
+    if (shard->seq != seq) {
+        return NGX_DECLINED;
+    }
+
+    tp = ngx_timeofday();
+
+    if (block_stop >= ngx_http_limit_req2_zone_sec(ctx, tp->sec)) {
+        res->block_stop_time = ctx->sh->epoch + block_stop;
+        return NGX_BUSY;
+    }
+
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+    ms = ngx_http_limit_req2_state_ms(state, now);
+
+    excess = ngx_http_limit_req2_state_excess(state)
+             - ctx->rates[0] * ngx_abs(ms) / 1000 + 1000;
+
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    if ((ngx_uint_t) excess > limit_req2->bursts[0]) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * the node is not moved in the LRU queue here,
+     * ngx_http_limit_req2_expire() requeues recently used nodes instead
+     */
+
+    if (!ngx_http_limit_req2_state_cas(lr, state,
+                                       ngx_http_limit_req2_state(now, excess)))
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "limit_req2 lockfree hit: %uL excess: %ui.%03ui",
+                   key->hash, excess / 1000, excess % 1000);
+
+    res->excess = excess;
+    res->delay = (ngx_msec_t) excess * 1000 / ctx->rates[0];
+    res->tier = 0;
+    res->tokens = 1;
+
+    return excess ? NGX_AGAIN : NGX_OK;
+}
+
+#endif
+
+
+/*
+ * Worker-local cache of banned keys, consulted before the zone is touched.
+ * An entry holds the generation of the zone read before the lookup that
+ * found the ban, so clearing any ban of the zone drops all cached ones.
+ */
+
+static ngx_http_limit_req2_ban_cache_t *
+ngx_http_limit_req2_ban_cache_slot(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_key_t *key)
+{
+    if (key->key.len > LIMIT_REQ2_LOCAL_KEY_LEN) {
+        return NULL;
+    }
+
+    return &ctx->ban_cache[(key->hash >> 8) & (LIMIT_REQ2_BAN_CACHE_SLOTS - 1)];
+}
+
+
+static ngx_uint_t
+ngx_http_limit_req2_ban_cache_get(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_key_t *key, ngx_atomic_uint_t gen)
+{
+    ngx_http_limit_req2_ban_cache_t  *bc;
+
+    bc = ngx_http_limit_req2_ban_cache_slot(ctx, key);
+
+    if (bc == NULL
+        || bc->gen != gen
+        || bc->block_stop_time < (ngx_uint_t) ngx_time()
+        || bc->hash != key->hash
+        || bc->len != key->key.len
+        || ngx_memcmp(bc->data, key->key.data, key->key.len) != 0)
+    {
+        return 0;
+    }
+
+    return bc->block_stop_time;
+}
+
+
+static void
+ngx_http_limit_req2_ban_cache_put(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_key_t *key, ngx_atomic_uint_t gen,
+    ngx_uint_t block_stop_time)
+{
+    ngx_http_limit_req2_ban_cache_t  *bc;
+
+    bc = ngx_http_limit_req2_ban_cache_slot(ctx, key);
+
+    if (bc == NULL) {
+        return;
+    }
+
+    bc->hash = key->hash;
+    bc->block_stop_time = block_stop_time;
+    bc->gen = gen;
+    bc->len = (u_short) key->key.len;
+    ngx_memcpy(bc->data, key->key.data, key->key.len);
+}
+
+
+/*
+ * Per-worker token leases for hot keys.  A key seen again by the worker
+ * within lease_time takes up to "lease" tokens from its node at once and
+ * spends them without touching the zone; tokens left when the lease expires
+ * or the slot is taken by another key are given back to the node.  A worker
+ * holds at most lease - 1 tokens of a key, which bounds the over-admission.
+ */
+
+static void
+ngx_http_limit_req2_lease_return(ngx_log_t *log,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_lease_t *lease)
+{
+    uint32_t                     *tiers;
+    ngx_int_t                     e, refund;
+    ngx_uint_t                    k;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req2_key_t     key;
+    ngx_http_limit_req2_node_t   *lr;
+    ngx_http_limit_req2_shard_t  *shard;
+    ngx_http_limit_req2_state_t   state;
+
+    if (lease->tokens == 0) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "limit_req2 lease return: %uL tokens: %ui",
+                   lease->hash, lease->tokens);
+
+    refund = lease->tokens * 1000;
+    lease->tokens = 0;
+
+    key.key.data = lease->data;
+    key.key.len = lease->len;
+    key.hash = lease->hash;
+
+    shard = ngx_http_limit_req2_shard(ctx, key.hash);
+
+    (void) ngx_http_limit_req2_lock(ctx, shard);
+
+    node = ngx_http_limit_req2_find(ctx, shard, &key, 0);
+
+    if (node) {
+        lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+        do {
+            state = lr->state;
+
+            e = ngx_http_limit_req2_state_excess(state) - refund;
+
+            if (e < 0) {
+                e = 0;
+            }
+
+        } while (!ngx_http_limit_req2_state_cas(lr, state,
+                     ngx_http_limit_req2_state(
+                         ngx_http_limit_req2_state_last(state), e)));
+
+        tiers = ngx_http_limit_req2_node_tiers(lr);
+
+        for (k = 1; k < ctx->ntiers; k++) {
+            e = (ngx_int_t) tiers[k - 1] - refund;
+            tiers[k - 1] = (e < 0) ? 0 : (uint32_t) e;
+        }
+    }
+
+    ngx_http_limit_req2_unlock(ctx, shard);
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_lease_get(ngx_log_t *log,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_http_limit_req2_t *limit_req2,
+    ngx_http_limit_req2_key_t *key, ngx_atomic_uint_t gen,
+    ngx_http_limit_req2_lease_t **lp, ngx_uint_t *tokens)
+{
+    ngx_msec_t                    now;
+    ngx_http_limit_req2_lease_t  *lease;
+
+    *lp = NULL;
+    *tokens = 1;
+
+    if (key->key.len > LIMIT_REQ2_LOCAL_KEY_LEN) {
+        return NGX_DECLINED;
+    }
+
+    lease = &limit_req2->leases[key->hash & (LIMIT_REQ2_LEASE_SLOTS - 1)];
+    now = ngx_current_msec;
+
+    *lp = lease;
+
+    if (lease->hash != key->hash || lease->len != key->key.len
+        || ngx_memcmp(lease->data, key->key.data, key->key.len) != 0)
+    {
+        ngx_http_limit_req2_lease_return(log, ctx, lease);
+
+        lease->hash = key->hash;
+        lease->len = (u_short) key->key.len;
+        ngx_memcpy(lease->data, key->key.data, key->key.len);
+
+    } else if (lease->gen != gen) {
+
+        /* the bans changed since the tokens were taken */
+
+        ngx_http_limit_req2_lease_return(log, ctx, lease);
+
+    } else if ((ngx_msec_int_t) (lease->expire - now) > 0) {
+
+        if (lease->tokens) {
+            lease->tokens--;
+            return NGX_OK;
+        }
+
+        /* seen again within the lease time, the key is hot */
+
+        *tokens = limit_req2->lease;
+
+    } else {
+        ngx_http_limit_req2_lease_return(log, ctx, lease);
+    }
+
+    lease->expire = now + limit_req2->lease_time;
+
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_http_limit_req2_expire(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_uint_t n, ngx_uint_t batch)
+{
+    ngx_int_t                   excess;
+    uint32_t                   *tiers;
+    ngx_time_t                 *tp;
+    ngx_msec_t                  now;
+    ngx_queue_t                *q;
+    ngx_msec_int_t              ms;
+    ngx_rbtree_node_t          *node;
+    ngx_http_limit_req2_node_t *lr;
+    ngx_uint_t                  m, k;
+
+    tp = ngx_timeofday();
+
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    /* bans are kept in their own pool, only the ones that are over go */
+
+    ngx_http_limit_req2_ban_expire(ctx, shard, tp->sec, batch);
+
+    /*
+     * n == 1 deletes up to "batch" zero rate entries
+     * n == 0 deletes oldest entry by force
+     *        and up to "batch" zero rate entries
+     */
+
+    m = 0;
+
+    while (n <= batch) {
+
+        if (ngx_queue_empty(&shard->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&shard->queue);
+
+        lr = ngx_queue_data(q, ngx_http_limit_req2_node_t, queue);
+
+        ms = ngx_http_limit_req2_state_ms(lr->state, now);
+        ms = ngx_abs(ms);
+
+        /*
+         * lockfree hits do not touch the queue, catch up with them here,
+         * a few nodes at a time, as every node moved is a cache miss
+         */
+
+        if (ctx->lockfree && ms < 60000 && m < batch) {
+            m++;
+
+            ngx_queue_remove(&lr->queue);
+            ngx_queue_insert_head(&shard->queue, &lr->queue);
+
+            continue;
+        }
+
+        if (n++ != 0) {
+
+            if (ms < 60000) {
+                return;
+            }
+
+            excess = ngx_http_limit_req2_state_excess(lr->state)
+                     - ctx->rates[0] * ms / 1000;
+
+            if (excess > 0) {
+                return;
+            }
+
+            /* keep the node while a slower tier has not drained */
+
+            tiers = ngx_http_limit_req2_node_tiers(lr);
+
+            for (k = 1; k < ctx->ntiers; k++) {
+                excess = tiers[k - 1] - ctx->rates[k] * ms / 1000;
+
+                if (excess > 0) {
+                    return;
+                }
+            }
+
+        } else {
+            ngx_http_limit_req2_count(ctx, evicted);
+        }
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_http_limit_req2_delete_node(ctx, shard, node);
+
+        ngx_http_limit_req2_free_node(ctx, shard, node);
+    }
+}
+
+
+/*
+ * One decision of a rule for a key: the ban cache of the worker, the lease
+ * of the rule, the lockfree path, and then the node under the lock of its
+ * shard, created by the first request of the key.  Returns NGX_OK or
+ * NGX_AGAIN if the request passes, with res->delay for the latter,
+ * NGX_BUSY if it is limited or banned, and NGX_ERROR if no node could be
+ * allocated.
+ */
+
+ngx_int_t
+ngx_http_limit_req2_account(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_t *limit_req2, ngx_http_limit_req2_key_t *key,
+    ngx_log_t *log, ngx_http_limit_req2_result_t *res)
+{
+    ngx_int_t                        rc;
+    ngx_uint_t                       tokens, taken;
+    ngx_time_t                      *tp;
+    ngx_atomic_uint_t                gen;
+    ngx_rbtree_node_t               *node;
+    ngx_http_limit_req2_shard_t     *shard;
+    ngx_http_limit_req2_lease_t     *lease;
+
+    shard = ngx_http_limit_req2_shard(ctx, key->hash);
+
+    res->excess = 0;
+    res->delay = 0;
+    res->tier = 0;
+    res->tokens = 0;
+    res->last_seg = 0;
+    res->curr_seg = 0;
+    res->curr_seg_time_diff = 0;
+    res->lock_wait = 0;
+
+    lease = NULL;
+    tokens = 1;
+    taken = 0;
+
+    /* read before the lookup, a ban cleared after it is not cached */
+
+    gen = ctx->sh->gen;
+    ngx_memory_barrier();
+
+    res->block_stop_time = ngx_http_limit_req2_ban_cache_get(ctx, key, gen);
+    if (res->block_stop_time) {
+        rc = NGX_BUSY;
+        goto done;
+    }
+
+    if (limit_req2->leases) {
+        rc = ngx_http_limit_req2_lease_get(log, ctx, limit_req2, key, gen,
+                                           &lease, &tokens);
+        if (rc == NGX_OK) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "limit_req2 lease hit: %uL", key->hash);
+            goto done;
+        }
+    }
+
+#if (NGX_HTTP_LIMIT_REQ2_LOCKFREE)
+
+    if (ctx->lockfree && ctx->ntiers == 1 && tokens == 1
+        && limit_req2->rate_seg == 0)
+    {
+        rc = ngx_http_limit_req2_lookup_fast(log, ctx, shard, limit_req2, key,
+                                             res);
+        if (rc != NGX_DECLINED) {
+            taken = res->tokens;
+            goto done;
+        }
+    }
+
+#endif
+
+    res->lock_wait = ngx_http_limit_req2_lock(ctx, shard);
+
+    if (ctx->sweep == 0) {
+        ngx_http_limit_req2_expire(ctx, shard, 1, LIMIT_REQ2_EXPIRE_BATCH);
+    }
+
+    rc = ngx_http_limit_req2_lookup(log, ctx, shard, limit_req2, key, tokens,
+                                    res);
+
+    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "limit_req2 module: %i %ui.%03ui tier: %ui "
+                   "block_stop_time: %ui "
+                   "hash is %uL total_len is %uz",
+                   rc, res->excess / 1000, res->excess % 1000, res->tier,
+                   res->block_stop_time, key->hash, key->key.len);
+
+    if (rc != NGX_DECLINED) {
+        ngx_http_limit_req2_unlock(ctx, shard);
+        taken = res->tokens;
+        goto done;
+    }
+
+    /* first limit_req2 */
+
+    if (ngx_http_limit_req2_index_full(ctx, shard)) {
+        ngx_http_limit_req2_expire(ctx, shard, 0, LIMIT_REQ2_EXPIRE_BATCH);
+    }
+
+    node = ngx_http_limit_req2_alloc_node(ctx, shard, key->key.len);
+    if (node == NULL) {
+        ngx_http_limit_req2_expire(ctx, shard, 0, LIMIT_REQ2_EXPIRE_BATCH);
+        node = ngx_http_limit_req2_alloc_node(ctx, shard, key->key.len);
+        if (node == NULL) {
+            ngx_http_limit_req2_unlock(ctx, shard);
+
+            ngx_http_limit_req2_count(ctx, alloc_failed);
+
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "could not allocate node%s", ctx->shpool->log_ctx);
+            return NGX_ERROR;
+        }
+    }
+
+    tp = ngx_timeofday();
+
+    ngx_http_limit_req2_init_node(ctx, node, key,
+                                  (ngx_msec_t) (tp->sec * 1000 + tp->msec));
+
+    ngx_http_limit_req2_insert_node(ctx, shard, node);
+
+    ngx_http_limit_req2_unlock(ctx, shard);
+
+    rc = NGX_OK;
+    taken = 1;
+
+done:
+
+    if (rc == NGX_BUSY && res->block_stop_time) {
+        ngx_http_limit_req2_ban_cache_put(ctx, key, gen, res->block_stop_time);
+
+        ngx_http_limit_req2_count(ctx, blocked);
+
+    } else if (rc == NGX_BUSY) {
+        ngx_http_limit_req2_count(ctx, rejected);
+
+    } else if (rc == NGX_AGAIN && !limit_req2->nodelay) {
+        ngx_http_limit_req2_count(ctx, delayed);
+
+    } else if (rc != NGX_ERROR) {
+        ngx_http_limit_req2_count(ctx, passed);
+    }
+
+    if (rc == NGX_BUSY || rc == NGX_ERROR) {
+        return rc;
+    }
+
+    /* a lease hit spends tokens taken from the zone and synced already */
+
+    if (ctx->deltas && taken) {
+        ngx_http_limit_req2_cluster_add(ctx, key, taken);
+    }
+
+    /* the request spends one of the tokens, the rest are leased */
+
+    if (lease && res->tokens > 1) {
+        lease->tokens = res->tokens - 1;
+        lease->gen = gen;
+    }
+
+    return rc;
+}
+
+
+/* the first node with a key not less than the key */
+
+static ngx_rbtree_node_t *
+ngx_http_limit_req2_walk_first(ngx_rbtree_t *tree, ngx_rbtree_key_t key)
+{
+    ngx_rbtree_node_t  *node, *sentinel, *found;
+
+    node = tree->root;
+    sentinel = tree->sentinel;
+    found = NULL;
+
+    while (node != sentinel) {
+
+        if (node->key >= key) {
+            found = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
+
+/*
+ * Walks about "slice" entries of a shard under one hold of its lock and
+ * returns the end of what the callbacks wrote; walk->done is set by the
+ * call after the last shard.  The cursor is a key and the number of its
+ * entries already walked, a slice ends between two keys unless a run of
+ * one key is twice as long, so entries added or deleted between slices do
+ * not move it.  With index=hash the cursor is a slot, an entry shifted
+ * over it between two slices can be missed or walked twice.  An entry
+ * that does not fit even as the first of a slice is skipped.
+ */
+
+u_char *
+ngx_http_limit_req2_walk(ngx_http_limit_req2_walk_t *walk, u_char *p,
+    u_char *end, ngx_uint_t slice)
+{
+    u_char                       *q;
+    ngx_uint_t                    n, run;
+    ngx_time_t                   *tp;
+    ngx_rbtree_t                 *tree;
+    ngx_rbtree_key_t              key;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req2_ban_t    *ban;
+    ngx_http_limit_req2_ctx_t    *ctx;
+    ngx_http_limit_req2_shard_t  *shard;
+
+    ctx = walk->ctx;
+
+    if (walk->shard == ctx->sh->nshards) {
+        walk->done = 1;
+        return p;
+    }
+
+    tp = ngx_timeofday();
+
+    walk->now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+    walk->sec = tp->sec;
+
+    shard = ctx->sh->shards[walk->shard];
+
+    if (walk->tries == 0) {
+        (void) ngx_http_limit_req2_lock(ctx, shard);
+
+    } else if (!ngx_http_limit_req2_trylock(ctx, shard, walk->tries)) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "limit_req2 shard %ui stays locked, skipped",
+                      walk->shard);
+
+        walk->skipped++;
+
+        walk->shard++;
+        walk->bans_phase = 0;
+        walk->cursor = 0;
+        walk->skip = 0;
+        walk->slot = 0;
+
+        return p;
+    }
+
+    n = 0;
+
+    if (!walk->bans_phase && ctx->index == LIMIT_REQ2_INDEX_HASH) {
+
+        while (walk->slot <= shard->mask && n < slice) {
+            node = shard->slots[walk->slot].node;
+
+            if (node) {
+                q = walk->node(walk, p, end, node);
+
+                if (q == NULL && n) {
+                    break;
+                }
+
+                if (q) {
+                    p = q;
+                    walk->nodes++;
+                }
+
+                n++;
+            }
+
+            walk->slot++;
+        }
+
+        if (walk->slot > shard->mask) {
+            walk->bans_phase = 1;
+        }
+
+        ngx_http_limit_req2_unlock(ctx, shard);
+
+        return p;
+    }
+
+    tree = walk->bans_phase ? &shard->bans : &shard->rbtree;
+
+    key = walk->cursor;
+    run = 0;
+
+    node = ngx_http_limit_req2_walk_first(tree, key);
+
+    while (node && node->key == key && run < walk->skip) {
+        node = ngx_rbtree_next(tree, node);
+        run++;
+    }
+
+    while (node) {
+
+        if (n >= slice && (node->key != key || n >= 2 * slice)) {
+            break;
+        }
+
+        if (!walk->bans_phase) {
+            q = walk->node(walk, p, end, node);
+
+        } else {
+            ban = ngx_rbtree_data(node, ngx_http_limit_req2_ban_t, node);
+
+            q = (ban->expire.key >= (ngx_uint_t) walk->sec)
+                ? walk->ban(walk, p, end, ban) : p;
+        }
+
+        if (q == NULL && n) {
+            break;
+        }
+
+        if (q && q != p) {
+            p = q;
+
+            if (walk->bans_phase) {
+                walk->bans++;
+
+            } else {
+                walk->nodes++;
+            }
+        }
+
+        n++;
+
+        if (node->key == key) {
+            run++;
+
+        } else {
+            key = node->key;
+            run = 1;
+        }
+
+        node = ngx_rbtree_next(tree, node);
+    }
+
+    if (node) {
+        walk->cursor = node->key;
+        walk->skip = (node->key == key) ? run : 0;
+
+    } else {
+        walk->cursor = 0;
+        walk->skip = 0;
+
+        if (walk->bans_phase) {
+            walk->shard++;
+            walk->slot = 0;
+        }
+
+        walk->bans_phase = !walk->bans_phase;
+    }
+
+    ngx_http_limit_req2_unlock(ctx, shard);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_limit_req2_snapshot_entry(u_char *p,
+    ngx_http_limit_req2_snapshot_record_t *rec, u_char *data)
+{
+    size_t  pad;
+
+    pad = ngx_align(rec->len, 8) - rec->len;
+
+    p = ngx_cpymem(p, rec, sizeof(ngx_http_limit_req2_snapshot_record_t));
+    p = ngx_cpymem(p, data, rec->len);
+    ngx_memzero(p, pad);
+
+    return p + pad;
+}
+
+
+static u_char *
+ngx_http_limit_req2_snapshot_node(ngx_http_limit_req2_walk_t *walk,
+    u_char *p, u_char *end, ngx_rbtree_node_t *node)
+{
+    uint32_t                               *tiers;
+    ngx_uint_t                              k;
+    ngx_msec_int_t                          ms;
+    ngx_http_limit_req2_ctx_t              *ctx;
+    ngx_http_limit_req2_node_t             *lr;
+    ngx_http_limit_req2_state_t             state;
+    ngx_http_limit_req2_snapshot_record_t   rec;
+
+    ctx = walk->ctx;
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    if ((size_t) (end - p) < ngx_http_limit_req2_snapshot_size(lr->len)) {
+        return NULL;
+    }
+
+    state = lr->state;
+    ms = ngx_http_limit_req2_state_ms(state, walk->now);
+
+    ngx_memzero(&rec, sizeof(ngx_http_limit_req2_snapshot_record_t));
+
+    rec.type = LIMIT_REQ2_SNAPSHOT_NODE;
+    rec.len = lr->len;
+    rec.last = (uint64_t) ((int64_t) walk->now - ms);
+
+    if (lr->block_stop) {
+        rec.block_stop_time = ctx->sh->epoch + lr->block_stop;
+    }
+
+    rec.excess[0] = (uint32_t) ngx_http_limit_req2_state_excess(state);
+
+    tiers = ngx_http_limit_req2_node_tiers(lr);
+
+    for (k = 1; k < ctx->ntiers; k++) {
+        rec.excess[k] = tiers[k - 1];
+    }
+
+    return ngx_http_limit_req2_snapshot_entry(p, &rec, lr->data);
+}
+
+
+static u_char *
+ngx_http_limit_req2_snapshot_ban(ngx_http_limit_req2_walk_t *walk,
+    u_char *p, u_char *end, ngx_http_limit_req2_ban_t *ban)
+{
+    ngx_http_limit_req2_snapshot_record_t  rec;
+
+    if ((size_t) (end - p) < ngx_http_limit_req2_snapshot_size(ban->len)) {
+        return NULL;
+    }
+
+    ngx_memzero(&rec, sizeof(ngx_http_limit_req2_snapshot_record_t));
+
+    rec.type = LIMIT_REQ2_SNAPSHOT_BAN;
+    rec.len = ban->len;
+    rec.block_stop_time = ban->expire.key;
+
+    return ngx_http_limit_req2_snapshot_entry(p, &rec, ban->data);
+}
+
+
+/*
+ * Writes the zone to a temporary file next to the persist= file and then
+ * renames it over the file, so that the file is always a whole snapshot.
+ * A call walks the shards a slice at a time until half of the buffer is
+ * filled and writes it with no lock held; it returns NGX_AGAIN until the
+ * walk is done and the file renamed, so that a worker can spread a large
+ * zone over several turns of its event loop.
+ */
+
+ngx_int_t
+ngx_http_limit_req2_snapshot(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_snapshot_t *snap, ngx_log_t *log)
+{
+    u_char                                 *p, *end;
+    ssize_t                                 n;
+    ngx_time_t                             *tp;
+    ngx_http_limit_req2_snapshot_header_t   header;
+
+    if (snap->buf == NULL) {
+
+        snap->temp = ngx_alloc(ctx->persist.len + NGX_INT64_LEN
+                               + sizeof("..tmp"), log);
+        if (snap->temp == NULL) {
+            return NGX_ERROR;
+        }
+
+        snap->buf = ngx_alloc(LIMIT_REQ2_SNAPSHOT_BUFFER, log);
+        if (snap->buf == NULL) {
+            goto done;
+        }
+
+        (void) ngx_sprintf(snap->temp, "%V.%P.tmp%Z", &ctx->persist, ngx_pid);
+
+        /* the snapshot holds every key of the zone */
+
+        snap->fd = ngx_open_file(snap->temp, NGX_FILE_WRONLY,
+                                 NGX_FILE_TRUNCATE, 0600);
+
+        if (snap->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", snap->temp);
+            goto done;
+        }
+
+        tp = ngx_timeofday();
+
+        ngx_memzero(&header, sizeof(ngx_http_limit_req2_snapshot_header_t));
+
+        header.magic = LIMIT_REQ2_SNAPSHOT_MAGIC;
+        header.version = LIMIT_REQ2_SNAPSHOT_VERSION;
+        header.ntiers = (uint32_t) ctx->ntiers;
+        header.time = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        snap->last = ngx_cpymem(snap->buf, &header,
+                             sizeof(ngx_http_limit_req2_snapshot_header_t));
+
+        ngx_memzero(&snap->walk, sizeof(ngx_http_limit_req2_walk_t));
+
+        snap->walk.ctx = ctx;
+        snap->walk.node = ngx_http_limit_req2_snapshot_node;
+        snap->walk.ban = ngx_http_limit_req2_snapshot_ban;
+    }
+
+    p = snap->last;
+    end = snap->buf + LIMIT_REQ2_SNAPSHOT_BUFFER;
+
+    while (!snap->walk.done && p - snap->buf < LIMIT_REQ2_SNAPSHOT_BUFFER / 2) {
+        p = ngx_http_limit_req2_walk(&snap->walk, p, end,
+                                     LIMIT_REQ2_SNAPSHOT_SLICE);
+    }
+
+    n = ngx_write_fd(snap->fd, snap->buf, p - snap->buf);
+
+    if (n != p - snap->buf) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", snap->temp);
+        (void) ngx_close_file(snap->fd);
+        goto failed;
+    }
+
+    snap->last = snap->buf;
+
+    if (!snap->walk.done) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_close_file(snap->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", snap->temp);
+        goto failed;
+    }
+
+    if (ngx_rename_file(snap->temp, ctx->persist.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      snap->temp, &ctx->persist);
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "limit_req2 snapshot \"%V\": %ui nodes, %ui bans",
+                   &ctx->persist, snap->walk.nodes, snap->walk.bans);
+
+    ngx_free(snap->buf);
+    ngx_free(snap->temp);
+    snap->buf = NULL;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_delete_file(snap->temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", snap->temp);
+    }
+
+done:
+
+    if (snap->buf) {
+        ngx_free(snap->buf);
+        snap->buf = NULL;
+    }
+
+    ngx_free(snap->temp);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Adds an entry of a snapshot, or of the zone of the previous cycle, to a
+ * new zone before any worker uses it, so the shards are not locked.  The
+ * excess of a node is drained up to now at the rates of the zone, nodes
+ * left with nothing and bans that are over are not added, nor is the
+ * rate_seg= and block= state of a node.  Only bans are added from a source
+ * with another number of rates.
+ */
+
+static ngx_int_t
+ngx_http_limit_req2_load(ngx_http_limit_req2_load_t *load,
+    ngx_http_limit_req2_snapshot_record_t *rec, u_char *data)
+{
+    int64_t                       excess;
+    uint32_t                     *tiers;
+    ngx_uint_t                    k, active, block_stop_time;
+    ngx_msec_int_t                ms;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_req2_key_t     key;
+    ngx_http_limit_req2_ctx_t    *ctx;
+    ngx_http_limit_req2_node_t   *lr;
+    ngx_http_limit_req2_shard_t  *shard;
+
+    ctx = load->ctx;
+
+    if (rec->len == 0
+        || (rec->type != LIMIT_REQ2_SNAPSHOT_NODE
+            && rec->type != LIMIT_REQ2_SNAPSHOT_BAN))
+    {
+        return NGX_ERROR;
+    }
+
+    block_stop_time = (rec->block_stop_time > (uint64_t) load->sec)
+                      ? (ngx_uint_t) rec->block_stop_time : 0;
+
+    key.key.data = data;
+    key.key.len = rec->len;
+    key.hash = ctx->hash->final
+               ^ ctx->hash->update(ctx->hash->init, data, rec->len);
+    key.hash_alg = ctx->hash;
+    key.limit_vars = NULL;
+
+    shard = ngx_http_limit_req2_shard(ctx, key.hash);
+
+    if (rec->type == LIMIT_REQ2_SNAPSHOT_BAN) {
+
+        if (block_stop_time == 0) {
+            return NGX_OK;
+        }
+
+        if (ngx_http_limit_req2_ban_set(ctx, shard, &key, block_stop_time)
+            != NGX_OK)
+        {
+            load->dropped++;
+            return NGX_OK;
+        }
+
+        load->bans++;
+        return NGX_OK;
+    }
+
+    if (load->ntiers != ctx->ntiers) {
+        return NGX_OK;
+    }
+
+    ms = (ngx_msec_int_t) ((int64_t) load->now - (int64_t) rec->last);
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    active = 0;
+
+    for (k = 0; k < ctx->ntiers; k++) {
+        excess = (int64_t) rec->excess[k]
+                 - (int64_t) (ctx->rates[k] * ms / 1000);
+
+        rec->excess[k] = (excess > 0) ? (uint32_t) excess : 0;
+
+        if (excess > 0) {
+            active = 1;
+        }
+    }
+
+    if (!active && block_stop_time == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_limit_req2_find(ctx, shard, &key, 0)) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_limit_req2_index_full(ctx, shard)) {
+        load->dropped++;
+        return NGX_OK;
+    }
+
+    node = ngx_http_limit_req2_alloc_node(ctx, shard, key.key.len);
+    if (node == NULL) {
+        load->dropped++;
+        return NGX_OK;
+    }
+
+    ngx_http_limit_req2_init_node(ctx, node, &key, load->now);
+
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+
+    lr->state = ngx_http_limit_req2_state(load->now, rec->excess[0]);
+
+    if (block_stop_time) {
+        lr->block_stop = ngx_http_limit_req2_zone_sec(ctx, block_stop_time);
+    }
+
+    tiers = ngx_http_limit_req2_node_tiers(lr);
+
+    for (k = 1; k < ctx->ntiers; k++) {
+        tiers[k - 1] = rec->excess[k];
+    }
+
+    ngx_http_limit_req2_insert_node(ctx, shard, node);
+
+    load->nodes++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req2_load_init(ngx_http_limit_req2_load_t *load,
+    ngx_http_limit_req2_ctx_t *ctx, ngx_uint_t ntiers)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    load->ctx = ctx;
+    load->ntiers = ntiers;
+    load->now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+    load->sec = tp->sec;
+    load->nodes = 0;
+    load->bans = 0;
+    load->dropped = 0;
+}
+
+
+/*
+ * Loads the persist= file into a new zone.  Errors are logged and leave
+ * the rest of the zone empty, they do not fail the configuration.
+ */
+
+static void
+ngx_http_limit_req2_restore(ngx_shm_zone_t *shm_zone)
+{
+    u_char                                 *buf, *pos, *last;
+    size_t                                  size;
+    ssize_t                                 n;
+    ngx_fd_t                                fd;
+    ngx_err_t                               err;
+    ngx_log_t                              *log;
+    ngx_uint_t                              eof;
+    ngx_http_limit_req2_ctx_t              *ctx;
+    ngx_http_limit_req2_load_t              load;
+    ngx_http_limit_req2_snapshot_header_t   header;
+    ngx_http_limit_req2_snapshot_record_t   rec;
+
+    ctx = shm_zone->data;
+    log = shm_zone->shm.log;
+
+    fd = ngx_open_file(ctx->persist.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_open_file_n " \"%V\" failed", &ctx->persist);
+        }
+
+        return;
+    }
+
+    buf = NULL;
+
+    n = ngx_read_fd(fd, &header, sizeof(ngx_http_limit_req2_snapshot_header_t));
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_read_fd_n " \"%V\" failed", &ctx->persist);
+        goto done;
+    }
+
+    if (n != sizeof(ngx_http_limit_req2_snapshot_header_t)
+        || header.magic != LIMIT_REQ2_SNAPSHOT_MAGIC)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "\"%V\" is not a limit_req2 snapshot", &ctx->persist);
+        goto done;
+    }
+
+    if (header.version != LIMIT_REQ2_SNAPSHOT_VERSION) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "limit_req2 snapshot \"%V\" has unknown version %uD",
+                      &ctx->persist, header.version);
+        goto done;
+    }
+
+    if (header.ntiers != ctx->ntiers) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "limit_req2 snapshot \"%V\" has %uD rates "
+                      "while zone \"%V\" has %ui, only bans are restored",
+                      &ctx->persist, header.ntiers, &shm_zone->shm.name,
+                      ctx->ntiers);
+    }
+
+    buf = ngx_alloc(LIMIT_REQ2_SNAPSHOT_BUFFER, log);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    ngx_http_limit_req2_load_init(&load, ctx, header.ntiers);
+
+    pos = buf;
+    last = buf;
+    eof = 0;
+
+    for ( ;; ) {
+
+        /* half a buffer is more than a record of the longest key */
+
+        if (!eof && last - pos < LIMIT_REQ2_SNAPSHOT_BUFFER / 2) {
+            size = last - pos;
+            ngx_memmove(buf, pos, size);
+
+            pos = buf;
+            last = buf + size;
+
+            while (last < buf + LIMIT_REQ2_SNAPSHOT_BUFFER) {
+                n = ngx_read_fd(fd, last, buf + LIMIT_REQ2_SNAPSHOT_BUFFER
+                                          - last);
+                if (n == -1) {
+                    ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                                  ngx_read_fd_n " \"%V\" failed",
+                                  &ctx->persist);
+                    goto done;
+                }
+
+                if (n == 0) {
+                    eof = 1;
+                    break;
+                }
+
+                last += n;
+            }
+        }
+
+        if (pos == last) {
+            break;
+        }
+
+        if ((size_t) (last - pos)
+            < sizeof(ngx_http_limit_req2_snapshot_record_t))
+        {
+            goto invalid;
+        }
+
+        ngx_memcpy(&rec, pos, sizeof(ngx_http_limit_req2_snapshot_record_t));
+
+        size = ngx_http_limit_req2_snapshot_size(rec.len);
+
+        if ((size_t) (last - pos) < size) {
+            goto invalid;
+        }
+
+        if (ngx_http_limit_req2_load(&load, &rec, pos + sizeof(rec))
+            != NGX_OK)
+        {
+            goto invalid;
+        }
+
+        pos += size;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "limit_req2 \"%V\": %ui nodes and %ui bans restored "
+                  "from \"%V\", %ui did not fit",
+                  &shm_zone->shm.name, load.nodes, load.bans, &ctx->persist,
+                  load.dropped);
+
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "limit_req2 snapshot \"%V\" is truncated or corrupted, "
+                  "%ui nodes and %ui bans restored",
+                  &ctx->persist, load.nodes, load.bans);
+
+done:
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->persist);
+    }
+}
+
+
+/*
+ * Moves the entries of the zone of the previous cycle, which is still
+ * mapped while the new cycle is being created, to the new zone.  The old
+ * zone is walked a slice at a time as for a snapshot, the workers of the
+ * previous cycle still use it and what they change after its slice is
+ * walked is lost.
+ */
+
+static void
+ngx_http_limit_req2_migrate(ngx_shm_zone_t *shm_zone,
+    ngx_shm_zone_t *old_zone)
+{
+    u_char                                 *buf, *p, *pos;
+    ngx_http_limit_req2_ctx_t              *ctx;
+    ngx_http_limit_req2_load_t              load;
+    ngx_http_limit_req2_walk_t              walk;
+    ngx_http_limit_req2_snapshot_record_t   rec;
+
+    ctx = shm_zone->data;
+
+    buf = ngx_alloc(LIMIT_REQ2_SNAPSHOT_BUFFER, shm_zone->shm.log);
+    if (buf == NULL) {
+        return;
+    }
+
+    ngx_memzero(&walk, sizeof(ngx_http_limit_req2_walk_t));
+
+    walk.ctx = old_zone->data;
+    walk.node = ngx_http_limit_req2_snapshot_node;
+    walk.ban = ngx_http_limit_req2_snapshot_ban;
+
+    /* a worker of the previous cycle may have died holding a shard */
+
+    walk.tries = LIMIT_REQ2_MIGRATE_TRIES;
+
+    ngx_http_limit_req2_load_init(&load, ctx, walk.ctx->ntiers);
+
+    while (!walk.done) {
+        p = ngx_http_limit_req2_walk(&walk, buf,
+                                     buf + LIMIT_REQ2_SNAPSHOT_BUFFER,
+                                     LIMIT_REQ2_SNAPSHOT_SLICE);
+
+        pos = buf;
+
+        while (pos < p) {
+            ngx_memcpy(&rec, pos,
+                       sizeof(ngx_http_limit_req2_snapshot_record_t));
+
+            (void) ngx_http_limit_req2_load(&load, &rec, pos + sizeof(rec));
+
+            pos += ngx_http_limit_req2_snapshot_size(rec.len);
+        }
+    }
+
+    ngx_free(buf);
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                  "limit_req2 \"%V\": %ui nodes and %ui bans moved "
+                  "from the previous zone of %uz bytes, %ui did not fit, "
+                  "%ui shards skipped",
+                  &shm_zone->shm.name, load.nodes, load.bans,
+                  old_zone->shm.size, load.dropped, walk.skipped);
+}
+
+
+/*
+ * Whether the zone of the previous cycle can be used as is: NGX_OK, or
+ * NGX_DECLINED if its entries have to be moved to a new zone, or NGX_ABORT
+ * if its keys are made of other variables and its entries are of no use.
+ */
+
+ngx_int_t
+ngx_http_limit_req2_reusable(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_ctx_t *octx)
+{
+    ngx_uint_t                       i;
+    ngx_http_limit_req2_variable_t  *v1, *v2;
+
+    if (ctx->limit_vars->nelts != octx->limit_vars->nelts) {
+        return NGX_ABORT;
+    }
+
+    v1 = ctx->limit_vars->elts;
+    v2 = octx->limit_vars->elts;
+
+    for (i = 0; i < ctx->limit_vars->nelts; i++) {
+        if (ngx_strcmp(v1[i].var.data, v2[i].var.data) != 0) {
+            return NGX_ABORT;
+        }
+    }
+
+    if (ctx->hash != octx->hash
+        || ctx->index != octx->index
+        || ctx->ntiers != octx->ntiers
+        || ctx->bans_size != octx->bans_size
+        || ctx->seg_size != octx->seg_size
+        || ctx->block_size != octx->block_size
+        || ctx->arena_key_len != octx->arena_key_len
+        || ctx->nshards != octx->nshards)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Without atomic operations ngx_shmtx_t locks a file, every mutex of the
+ * zone gets one named as ngx_init_zone_pool() names the one of the slab
+ * pool, with a suffix of its own.
+ */
+
+static ngx_int_t
+ngx_http_limit_req2_shmtx_create(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_shm_zone_t *shm_zone, ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr,
+    u_char *suffix)
+{
+    u_char       *file;
+#if !(NGX_HAVE_ATOMIC_OPS)
+    ngx_cycle_t  *cycle;
+#endif
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    file = NULL;
+
+#else
+
+    cycle = ctx->cycle;
+
+    file = ngx_pnalloc(cycle->pool, cycle->lock_file.len
+                                    + shm_zone->shm.name.len
+                                    + 1 + ngx_strlen(suffix) + 1);
+    if (file == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_sprintf(file, "%V%V.%s%Z",
+                       &cycle->lock_file, &shm_zone->shm.name, suffix);
+
+#endif
+
+    return ngx_shmtx_create(mtx, addr, file);
+}
+
+
+ngx_int_t
+ngx_http_limit_req2_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_limit_req2_ctx_t  *octx = data;
+
+    size_t                        len;
+    u_char                        suffix[NGX_INT_T_LEN + 1];
+    ngx_uint_t                    i, n, nslots;
+    ngx_slab_pool_t              *banpool;
+    ngx_http_limit_req2_ctx_t    *ctx;
+    ngx_http_limit_req2_shard_t  *shard;
+
+    ctx = shm_zone->data;
+
+    /* the node layout is known once all rules are parsed */
+
+    if (ctx->arena_key_len) {
+        ctx->arena_stride = ngx_align(
+                       ngx_http_limit_req2_node_size(ctx, ctx->arena_key_len),
+                       NGX_ALIGNMENT);
+    }
+
+    if (octx) {
+
+        /* the module does not let nginx reuse a zone it cannot take over */
+
+        if (ngx_http_limit_req2_reusable(ctx, octx) != NGX_OK) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req2 \"%V\" cannot reuse the zone "
+                          "of the previous configuration",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                   offsetof(ngx_http_limit_req2_shctx_t, shards)
+                   + ctx->nshards * sizeof(ngx_http_limit_req2_shard_t *));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ctx->sh->gen = 0;
+    ctx->sh->epoch = ngx_time() - 1;
+
+    ctx->sh->stats = ngx_slab_calloc(ctx->shpool, LIMIT_REQ2_STATS_SLOTS
+                                                  * LIMIT_REQ2_STATS_STRIDE);
+    if (ctx->sh->stats == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->sh->nshards = ctx->nshards;
+
+    /*
+     * bans get a slab pool of their own inside the zone, so that they
+     * neither compete with nor are evicted along with the rate state
+     */
+
+    banpool = ngx_slab_alloc(ctx->shpool, ctx->bans_size);
+    if (banpool == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "limit_req2 \"%V\" is too small for bans of %uz bytes",
+                      &shm_zone->shm.name, ctx->bans_size);
+        return NGX_ERROR;
+    }
+
+    banpool->end = (u_char *) banpool + ctx->bans_size;
+    banpool->min_shift = 3;
+    banpool->addr = banpool;
+
+    if (ngx_http_limit_req2_shmtx_create(ctx, shm_zone, &banpool->mutex,
+                                         &banpool->lock, (u_char *) "bans")
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(banpool);
+
+    ctx->sh->banpool = banpool;
+
+    nslots = 0;
+
+    if (ctx->index == LIMIT_REQ2_INDEX_HASH) {
+        len = shm_zone->shm.size / LIMIT_REQ2_INDEX_BYTES_PER_KEY
+              / ctx->nshards;
+
+        for (nslots = 8; nslots < len; nslots <<= 1) { /* void */ }
+    }
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = ngx_slab_alloc(ctx->shpool,
+                               sizeof(ngx_http_limit_req2_shard_t));
+        if (shard == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(suffix, "%ui%Z", i);
+
+        if (ngx_http_limit_req2_shmtx_create(ctx, shm_zone, &shard->mutex,
+                                             &shard->lock, suffix)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_limit_req2_rbtree_insert_value);
+
+        ngx_queue_init(&shard->queue);
+
+        ngx_rbtree_init(&shard->bans, &shard->bans_sentinel,
+                        ngx_http_limit_req2_ban_insert_value);
+        ngx_rbtree_init(&shard->ban_expire, &shard->ban_expire_sentinel,
+                        ngx_rbtree_insert_value);
+        shard->nbans = 0;
+        shard->nnodes = 0;
+
+        shard->slots = NULL;
+        shard->mask = 0;
+        shard->nelts = 0;
+
+        shard->arena = NULL;
+        shard->arena_next = NULL;
+        shard->arena_end = NULL;
+        shard->arena_free = NULL;
+
+        ngx_memzero(shard->free, sizeof(shard->free));
+        ngx_memzero(shard->nfree, sizeof(shard->nfree));
+
+        if (nslots) {
+            shard->slots = ngx_slab_calloc(ctx->shpool,
+                               nslots * sizeof(ngx_http_limit_req2_slot_t));
+            if (shard->slots == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                              "limit_req2 \"%V\" is too small "
+                              "for index of %ui slots",
+                              &shm_zone->shm.name, nslots * ctx->nshards);
+                return NGX_ERROR;
+            }
+
+            shard->mask = nslots - 1;
+        }
+
+        ctx->sh->shards[i] = shard;
+    }
+
+    /*
+     * The arenas take three quarters of the pages left, the rest is kept
+     * for long keys and for nodes that overflow a full arena.
+     */
+
+    if (ctx->arena_key_len) {
+        len = ctx->shpool->pfree * 3 / 4 / ctx->nshards * ngx_pagesize;
+        n = len / ctx->arena_stride;
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req2 \"%V\" is too small for an arena",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < ctx->nshards; i++) {
+            shard = ctx->sh->shards[i];
+
+            shard->arena = ngx_slab_alloc(ctx->shpool, len);
+            if (shard->arena == NULL) {
+                return NGX_ERROR;
+            }
+
+            shard->arena_next = shard->arena;
+            shard->arena_end = shard->arena + n * ctx->arena_stride;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                      "limit_req2 \"%V\" arena: %ui nodes of %uz bytes, "
+                      "%ui keys per megabyte",
+                      &shm_zone->shm.name, n * ctx->nshards,
+                      ctx->arena_stride, 1024 * 1024 / ctx->arena_stride);
+    }
+
+    len = sizeof(" in limit_req2 zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req2 zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    banpool->log_ctx = ctx->shpool->log_ctx;
+    banpool->log_nomem = 0;
+
+    if (ctx->migrate) {
+        ngx_http_limit_req2_migrate(shm_zone, ctx->old_zone);
+
+    } else if (ctx->persist.len) {
+        ngx_http_limit_req2_restore(shm_zone);
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_LIMIT_REQ2_CORE_H_INCLUDED_
+#define _NGX_HTTP_LIMIT_REQ2_CORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_HAVE_ATOMIC_OPS && NGX_PTR_SIZE == 8)
+#define NGX_HTTP_LIMIT_REQ2_LOCKFREE   1
+#endif
+
+#define LIMIT_REQ2_LOCKFREE_MAX_DEPTH  64
+
+
+/*
+ * the node state packs the time of the last request (low 32 bits of msec)
+ * and the excess (high 32 bits), so that it can be updated with one CAS
+ */
+
+typedef uint64_t  ngx_http_limit_req2_state_t;
+
+#define ngx_http_limit_req2_state(last, excess)                              \
+    (((ngx_http_limit_req2_state_t) (excess) << 32) | (uint32_t) (last))
+
+#define ngx_http_limit_req2_state_last(state)   ((uint32_t) (state))
+
+#define ngx_http_limit_req2_state_excess(state)                              \
+    ((ngx_int_t) ((state) >> 32))
+
+#define ngx_http_limit_req2_state_ms(state, now)                             \
+    ((ngx_msec_int_t) (int32_t)                                              \
+         ((uint32_t) (now) - ngx_http_limit_req2_state_last(state)))
+
+#if (NGX_HTTP_LIMIT_REQ2_LOCKFREE)
+#define ngx_http_limit_req2_state_cas(lr, old, new)                          \
+    ngx_atomic_cmp_set((ngx_atomic_t *) &(lr)->state, old, new)
+#else
+#define ngx_http_limit_req2_state_cas(lr, old, new)                          \
+    ((lr)->state = (new), 1)
+#endif
+
+
+/*
+ * Everything a lookup reads is in the first 64 bytes of the node with the
+ * rbtree node, the sections needed only by rate_seg= and block= follow the
+ * key and are present only if a rule of the zone uses them.  Seconds kept
+ * in a node are relative to the creation of the zone.
+ */
+
+typedef struct {
+    u_char                       color;
+    u_char                       dummy;
+    u_short                      len;
+    /* a copy of the ban of the key, for the lockfree path */
+    uint32_t                     block_stop;
+    ngx_queue_t                  queue;
+    /* last and excess, 1 corresponds to 0.001 r/s */
+    ngx_http_limit_req2_state_t  state;
+
+    /*
+     * the key, the excess of the tiers after the first one,
+     * then the rate_seg and the block sections
+     */
+    u_char                       data[1];
+} ngx_http_limit_req2_node_t;
+
+
+typedef struct {
+    /* range count for computing qps */
+    uint32_t                     last_seg;
+    uint32_t                     curr_seg;
+} ngx_http_limit_req2_node_seg_t;
+
+
+typedef struct {
+    uint64_t                     stat;
+    uint32_t                     base;
+} ngx_http_limit_req2_node_block_t;
+
+
+#define ngx_http_limit_req2_node_tiers(lr)                                   \
+    ((uint32_t *) ngx_align_ptr((lr)->data + (lr)->len, sizeof(uint32_t)))
+
+#define ngx_http_limit_req2_node_seg(ctx, lr)                                \
+    ((ngx_http_limit_req2_node_seg_t *)                                      \
+         ((u_char *) ngx_http_limit_req2_node_tiers(lr) + (ctx)->tiers_size))
+
+#define ngx_http_limit_req2_node_block(ctx, lr)                              \
+    ((ngx_http_limit_req2_node_block_t *)                                    \
+         ngx_align_ptr((u_char *) ngx_http_limit_req2_node_seg(ctx, lr)      \
+                       + (ctx)->seg_size, sizeof(uint64_t)))
+
+#define ngx_http_limit_req2_zone_sec(ctx, sec)                               \
+    ((uint32_t) ((sec) - (ctx)->sh->epoch))
+
+
+#define LIMIT_REQ2_MAX_SHARDS          256
+#define LIMIT_REQ2_MAX_TIERS           4
+
+/* stale entries deleted by a request, and by a sweep of a shard */
+#define LIMIT_REQ2_EXPIRE_BATCH        2
+#define LIMIT_REQ2_SWEEP_BATCH         64
+
+#define LIMIT_REQ2_LEASE_SLOTS         64
+#define LIMIT_REQ2_BAN_CACHE_SLOTS     256
+
+/* the longest key kept in worker-local tables */
+#define LIMIT_REQ2_LOCAL_KEY_LEN       64
+
+#define LIMIT_REQ2_INDEX_RBTREE        0
+#define LIMIT_REQ2_INDEX_HASH          1
+
+/* per worker copies of the counters, the workers past the last share one */
+#define LIMIT_REQ2_STATS_SLOTS         64
+#define LIMIT_REQ2_STATS_STRIDE                                              \
+    ngx_align(sizeof(ngx_http_limit_req2_stats_t), 128)
+
+/* log2 buckets of lock_stats, 1us to 4s and above */
+#define LIMIT_REQ2_LOCK_BUCKETS        24
+
+/* the longest inline key of arena= */
+#define LIMIT_REQ2_ARENA_MAX_KEY_LEN   1024
+
+/*
+ * a sharded zone keeps the nodes it frees in lists of its shards, one per
+ * slab size class from 32 bytes on, reused without the slab mutex; nodes
+ * beyond the length of a list go back to the slab for the other shards
+ */
+#define LIMIT_REQ2_FREE_MIN_SHIFT      5
+#define LIMIT_REQ2_FREE_CLASSES        8
+#define LIMIT_REQ2_FREE_MAX            64
+
+/* rounds of about 1ms a reload waits for a shard of the previous zone */
+#define LIMIT_REQ2_MIGRATE_TRIES       1000
+
+/* estimated zone bytes per key, used to size the hash index */
+#define LIMIT_REQ2_INDEX_BYTES_PER_KEY 128
+
+typedef struct {
+    ngx_uint_t                    hash;
+    ngx_rbtree_node_t            *node;
+} ngx_http_limit_req2_slot_t;
+
+
+/*
+ * Bans are kept apart from the rate state, in a pool of their own that is
+ * never evicted, indexed by the key and ordered by block_stop_time.
+ */
+
+typedef struct {
+    /* key is the hash of the key */
+    ngx_rbtree_node_t             node;
+    /* key is block_stop_time */
+    ngx_rbtree_node_t             expire;
+    u_short                       len;
+    u_char                        data[1];
+} ngx_http_limit_req2_ban_t;
+
+
+typedef struct {
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   mutex;
+    /* odd while the index is being changed */
+    ngx_atomic_t                  seq;
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+    ngx_queue_t                   queue;
+
+    /* index=hash */
+    ngx_http_limit_req2_slot_t   *slots;
+    ngx_uint_t                    mask;
+    ngx_uint_t                    nelts;
+
+    ngx_rbtree_t                  bans;
+    ngx_rbtree_node_t             bans_sentinel;
+    ngx_rbtree_t                  ban_expire;
+    ngx_rbtree_node_t             ban_expire_sentinel;
+    ngx_uint_t                    nbans;
+    ngx_uint_t                    nnodes;
+
+    /* arena=, free nodes are linked through their left pointer */
+    u_char                       *arena;
+    u_char                       *arena_next;
+    u_char                       *arena_end;
+    ngx_rbtree_node_t            *arena_free;
+
+    /* shards > 1, freed slab nodes by size class, linked the same way */
+    ngx_rbtree_node_t            *free[LIMIT_REQ2_FREE_CLASSES];
+    ngx_uint_t                    nfree[LIMIT_REQ2_FREE_CLASSES];
+} ngx_http_limit_req2_shard_t;
+
+
+/*
+ * The counters of a zone.  Every worker adds to a copy of its own, in a
+ * cache line of its own, and the stats handler sums the copies.
+ */
+
+typedef struct {
+    ngx_atomic_t                  passed;
+    ngx_atomic_t                  delayed;
+    ngx_atomic_t                  rejected;
+    ngx_atomic_t                  blocked;
+    ngx_atomic_t                  evicted;
+    ngx_atomic_t                  alloc_failed;
+    ngx_atomic_t                  auto_blocked;
+    /* delayed requests rejected as the delay queue was full */
+    ngx_atomic_t                  delay_overflow;
+    /* replicate, changes sent to a peer, applied from one, dropped */
+    ngx_atomic_t                  replicate_sent;
+    ngx_atomic_t                  replicate_received;
+    ngx_atomic_t                  replicate_dropped;
+
+    /* lock_stats, in microseconds */
+    ngx_atomic_t                  lock_wait_sum;
+    ngx_atomic_t                  lock_hold_sum;
+    ngx_atomic_t                  lock_wait[LIMIT_REQ2_LOCK_BUCKETS];
+    ngx_atomic_t                  lock_hold[LIMIT_REQ2_LOCK_BUCKETS];
+} ngx_http_limit_req2_stats_t;
+
+
+#define ngx_http_limit_req2_worker_stats(ctx)                                \
+    ((ngx_http_limit_req2_stats_t *)                                         \
+        ((ctx)->sh->stats + ngx_worker % LIMIT_REQ2_STATS_SLOTS              \
+                            * LIMIT_REQ2_STATS_STRIDE))
+
+#define ngx_http_limit_req2_count(ctx, counter)                              \
+    (void) ngx_atomic_fetch_add(                                             \
+               &ngx_http_limit_req2_worker_stats(ctx)->counter, 1)
+
+
+typedef struct {
+    /*
+     * bumped when a ban is set or cleared, invalidates worker ban caches
+     * and leases
+     */
+    ngx_atomic_t                  gen;
+    /* the time the seconds in nodes are relative to */
+    time_t                        epoch;
+    /* LIMIT_REQ2_STATS_SLOTS copies of ngx_http_limit_req2_stats_t */
+    u_char                       *stats;
+    ngx_slab_pool_t              *banpool;
+    ngx_uint_t                    nshards;
+    /* each shard is a separate slab chunk, so shards never share a line */
+    ngx_http_limit_req2_shard_t  *shards[1];
+} ngx_http_limit_req2_shctx_t;
+
+
+typedef struct {
+    /* excess and delay of the tier that limits the request */
+    ngx_uint_t                   excess;
+    ngx_msec_t                   delay;
+    ngx_uint_t                   tier;
+    /* tokens taken from the node, more than one for a lease */
+    ngx_uint_t                   tokens;
+    ngx_uint_t                   block_stop_time;
+
+    ngx_uint_t                   last_seg;
+    ngx_uint_t                   curr_seg;
+    ngx_uint_t                   curr_seg_time_diff;
+
+    /* microseconds spent waiting for the lock, with lock_stats */
+    ngx_uint_t                   lock_wait;
+} ngx_http_limit_req2_result_t;
+
+
+typedef struct {
+    ngx_str_t                    name;
+    uint64_t                     init;
+    uint64_t                     final;
+    uint64_t                   (*update)(uint64_t hash, u_char *p, size_t len);
+} ngx_http_limit_req2_hash_t;
+
+
+typedef struct {
+    ngx_int_t                    index;
+    ngx_str_t                    var;
+} ngx_http_limit_req2_variable_t;
+
+
+typedef struct {
+    ngx_str_t                    key;
+    uint64_t                     hash;
+    ngx_array_t                 *limit_vars;
+    ngx_http_limit_req2_hash_t  *hash_alg;
+} ngx_http_limit_req2_key_t;
+
+
+/*
+ * A worker-local copy of a ban seen in the zone, valid until its
+ * block_stop_time as long as no ban of the zone has been cleared since.
+ */
+
+typedef struct {
+    uint64_t                     hash;
+    ngx_uint_t                   block_stop_time;
+    ngx_atomic_uint_t            gen;
+    u_short                      len;
+    u_char                       data[LIMIT_REQ2_LOCAL_KEY_LEN];
+} ngx_http_limit_req2_ban_cache_t;
+
+
+/*
+ * replicate: the ban changes made by a worker and not yet sent to the
+ * peers, as the records of a datagram: the type, the key length and the
+ * seconds left of the ban, in network byte order, followed by the key.
+ * The seconds left rather than the time the ban stops keep the peers in
+ * step even if their clocks are not.  A cluster delta has the tokens the
+ * worker took from the key since the last sync in place of the seconds.
+ */
+
+#define LIMIT_REQ2_REPLICATE_SET       1
+#define LIMIT_REQ2_REPLICATE_CLEAR     2
+#define LIMIT_REQ2_REPLICATE_DELTA     3
+#define LIMIT_REQ2_REPLICATE_HEADER    7
+/* the longest key replicated, so that a record always fits a datagram */
+#define LIMIT_REQ2_REPLICATE_KEY_LEN   1024
+
+#define ngx_http_limit_req2_replicate_size(p)                                \
+    (LIMIT_REQ2_REPLICATE_HEADER + ((size_t) (p)[1] << 8 | (p)[2]))
+
+typedef struct {
+    u_char                      *start;
+    u_char                      *last;
+    u_char                      *end;
+} ngx_http_limit_req2_replicate_t;
+
+
+/*
+ * cluster: the tokens a worker took from a key since the last sync, in a
+ * direct mapped table so that a hot key is sent once per sync
+ */
+
+#define LIMIT_REQ2_DELTA_SLOTS         1024
+
+/* the most excess a peer can add, it stays a positive ngx_int_t */
+#define LIMIT_REQ2_EXCESS_MAX          0x7fffffff
+
+typedef struct {
+    uint64_t                     hash;
+    ngx_uint_t                   tokens;
+    u_short                      len;
+    u_char                       data[LIMIT_REQ2_LOCAL_KEY_LEN];
+} ngx_http_limit_req2_delta_t;
+
+
+typedef struct {
+    ngx_http_limit_req2_shctx_t *sh;
+    ngx_slab_pool_t             *shpool;
+    /* integer values, 1 corresponds to 0.001 r/s */
+    ngx_uint_t                   rates[LIMIT_REQ2_MAX_TIERS];
+    /* zone level bursts of the tiers, NGX_CONF_UNSET if not set */
+    ngx_int_t                    bursts[LIMIT_REQ2_MAX_TIERS];
+    ngx_uint_t                   ntiers;
+    size_t                       tiers_size;
+    /* the optional node sections, set by the rules using the zone */
+    size_t                       seg_size;
+    size_t                       block_size;
+    size_t                       bans_size;
+    /* the longest key kept inline in the arena, 0 if there is no arena */
+    size_t                       arena_key_len;
+    size_t                       arena_stride;
+    /* the period of the background expiry, 0 if done by requests */
+    ngx_msec_t                   sweep;
+    ngx_uint_t                   nshards;
+    ngx_uint_t                   index;
+    ngx_flag_t                   lockfree;
+    ngx_flag_t                   lock_stats;
+    /* the time the lock of a shard was taken, for lock_stats */
+    uint64_t                     lock_time;
+    ngx_http_limit_req2_hash_t  *hash;
+    ngx_http_limit_req2_node_t  *node;
+
+    /* max_delayed=, the delay queue of the worker is set by the module */
+    ngx_uint_t                   max_delayed;
+    ngx_msec_t                   delay_tick;
+    void                        *delay;
+
+    /*
+     * persist=, the snapshot file and how often worker 0 writes it; the
+     * snapshot being written is set by the module
+     */
+    ngx_str_t                    persist;
+    ngx_msec_t                   persist_interval;
+    void                        *snapshot;
+
+    /*
+     * a reload that does not reuse the zone of the previous cycle, the
+     * entries of the zone are moved from it unless the key changed
+     */
+    ngx_shm_zone_t              *old_zone;
+    ngx_flag_t                   migrate;
+
+    /* the cycle being configured, for the lock files of the zone mutexes */
+    ngx_cycle_t                 *cycle;
+
+    /* allocated at configuration time, so every worker has its own */
+    ngx_http_limit_req2_ban_cache_t *ban_cache;
+
+    /* replicate, allocated at configuration time as the ban cache is */
+    ngx_http_limit_req2_replicate_t *replicate;
+    /* cluster, LIMIT_REQ2_DELTA_SLOTS, allocated the same way */
+    ngx_http_limit_req2_delta_t *deltas;
+
+    ngx_array_t                 *limit_vars;
+} ngx_http_limit_req2_ctx_t;
+
+
+/*
+ * A worker's lease of tokens taken from a hot node in one go, the tokens
+ * are spent by the following requests with the same key without touching
+ * the zone.  Lease tables are allocated at configuration time, so every
+ * worker has its own copy.
+ */
+
+typedef struct {
+    uint64_t                     hash;
+    ngx_msec_t                   expire;
+    ngx_uint_t                   tokens;
+    /* the generation of the bans when the tokens were taken */
+    ngx_atomic_uint_t            gen;
+    u_short                      len;
+    u_char                       data[LIMIT_REQ2_LOCAL_KEY_LEN];
+} ngx_http_limit_req2_lease_t;
+
+
+typedef struct {
+    ngx_shm_zone_t              *shm_zone;
+    /* integer values, 1 corresponds to 0.001 r/s */
+    ngx_uint_t                   bursts[LIMIT_REQ2_MAX_TIERS];
+
+    ngx_uint_t                   lease;
+    ngx_msec_t                   lease_time;
+    ngx_http_limit_req2_lease_t *leases;
+    ngx_uint_t                   nodelay; /* unsigned  nodelay:1 */
+    ngx_str_t                    forbid_action;
+
+    /* 5x60x1800 */
+    ngx_uint_t                   block_stat_interval;   /* 60 */
+    ngx_uint_t                   block_stat_times;      /* 5 */
+    ngx_uint_t                   block_time;            /* 1800 */
+
+    ngx_uint_t                   rate_seg;
+} ngx_http_limit_req2_t;
+
+
+/*
+ * A walk over the nodes and the unexpired bans of a zone, shard by shard,
+ * in slices of entries taken under one hold of the lock of a shard.  The
+ * callbacks write an entry at p and return the new end, or NULL if there
+ * is no room left before end; the walk then resumes from that entry.
+ */
+
+typedef struct ngx_http_limit_req2_walk_s  ngx_http_limit_req2_walk_t;
+
+typedef u_char *(*ngx_http_limit_req2_walk_node_pt)(
+    ngx_http_limit_req2_walk_t *walk, u_char *p, u_char *end,
+    ngx_rbtree_node_t *node);
+typedef u_char *(*ngx_http_limit_req2_walk_ban_pt)(
+    ngx_http_limit_req2_walk_t *walk, u_char *p, u_char *end,
+    ngx_http_limit_req2_ban_t *ban);
+
+struct ngx_http_limit_req2_walk_s {
+    ngx_http_limit_req2_ctx_t         *ctx;
+    ngx_http_limit_req2_walk_node_pt   node;
+    ngx_http_limit_req2_walk_ban_pt    ban;
+    void                              *data;
+
+    /* the time of the current slice */
+    ngx_msec_t                         now;
+    time_t                             sec;
+
+    ngx_uint_t                         shard;
+    ngx_uint_t                         bans_phase;
+    /* the key to resume from and the entries of that key already walked */
+    ngx_rbtree_key_t                   cursor;
+    ngx_uint_t                         skip;
+    /* index=hash, the slot to resume from */
+    ngx_uint_t                         slot;
+    ngx_uint_t                         done;
+
+    /*
+     * the rounds to wait for the lock of a shard, see
+     * ngx_http_limit_req2_trylock(); 0 waits for as long as it takes,
+     * otherwise a shard that stays locked is skipped
+     */
+    ngx_uint_t                         tries;
+    ngx_uint_t                         skipped;
+
+    ngx_uint_t                         nodes;
+    ngx_uint_t                         bans;
+};
+
+
+/*
+ * persist=, a snapshot being written, the walk of the zone and the
+ * temporary file; buf is NULL when no snapshot is in progress
+ */
+
+typedef struct {
+    ngx_http_limit_req2_walk_t         walk;
+    ngx_fd_t                           fd;
+    u_char                            *temp;
+    u_char                            *buf;
+    u_char                            *last;
+} ngx_http_limit_req2_snapshot_t;
+
+
+static ngx_inline ngx_http_limit_req2_shard_t *
+ngx_http_limit_req2_shard(ngx_http_limit_req2_ctx_t *ctx, ngx_uint_t hash)
+{
+    /* the low bits of the hash pick the index slot, use the high ones here */
+
+    return ctx->sh->shards[(ngx_uint_t) ((uint64_t) hash * 0x9e3779b97f4a7c15ULL
+                                         >> 40) % ctx->sh->nshards];
+}
+
+
+ngx_int_t ngx_http_limit_req2_account(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_t *limit_req2, ngx_http_limit_req2_key_t *key,
+    ngx_log_t *log, ngx_http_limit_req2_result_t *res);
+
+ngx_uint_t ngx_http_limit_req2_trylock(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_uint_t tries);
+ngx_uint_t ngx_http_limit_req2_lock(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard);
+void ngx_http_limit_req2_unlock(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard);
+
+ngx_rbtree_node_t *ngx_http_limit_req2_find(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t unlocked);
+void ngx_http_limit_req2_expire(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_uint_t n, ngx_uint_t batch);
+
+ngx_http_limit_req2_ban_t *ngx_http_limit_req2_ban_find(
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key);
+ngx_int_t ngx_http_limit_req2_ban_set(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key,
+    ngx_uint_t block_stop_time);
+ngx_int_t ngx_http_limit_req2_ban_clear(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_shard_t *shard, ngx_http_limit_req2_key_t *key);
+
+void ngx_http_limit_req2_replicate_add(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_uint_t type, ngx_http_limit_req2_key_t *key, ngx_uint_t value);
+ngx_int_t ngx_http_limit_req2_replicate_apply(ngx_http_limit_req2_ctx_t *ctx,
+    u_char *p, u_char *last);
+void ngx_http_limit_req2_cluster_add(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_key_t *key, ngx_uint_t tokens);
+void ngx_http_limit_req2_cluster_collect(ngx_http_limit_req2_ctx_t *ctx);
+
+u_char *ngx_http_limit_req2_walk(ngx_http_limit_req2_walk_t *walk, u_char *p,
+    u_char *end, ngx_uint_t slice);
+
+ngx_int_t ngx_http_limit_req2_reusable(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_ctx_t *octx);
+ngx_int_t ngx_http_limit_req2_snapshot(ngx_http_limit_req2_ctx_t *ctx,
+    ngx_http_limit_req2_snapshot_t *snap, ngx_log_t *log);
+
+void ngx_http_limit_req2_hash_init(ngx_http_limit_req2_hash_t *h);
+ngx_int_t ngx_http_limit_req2_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+
+extern ngx_http_limit_req2_hash_t  ngx_http_limit_req2_hashes[];
+
+
+#endif /* _NGX_HTTP_LIMIT_REQ2_CORE_H_INCLUDED_ */
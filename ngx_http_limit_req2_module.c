@@ -8,45 +8,138 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_sha1.h>
+#include "ngx_http_limit_req2_core.h"
 
 #define LIMIT_REQ2_BLOCK_ACTION_NONE   0
 #define LIMIT_REQ2_BLOCK_ACTION_QUERY  1
 #define LIMIT_REQ2_BLOCK_ACTION_SET    2
 #define LIMIT_REQ2_BLOCK_ACTION_CLEAR  3
+#define LIMIT_REQ2_BLOCK_ACTION_DUMP   4
 
-typedef struct {
-    u_char                       color;
-    u_char                       dummy;
-    u_short                      len;
-    ngx_queue_t                  queue;
-    ngx_msec_t                   last;
-    /* integer value, 1 corresponds to 0.001 r/s */
-    ngx_uint_t                   excess;
-    ngx_uint_t                   count;
+/* limit_req2_block bulk, the keys are taken as they are or as addresses */
+#define LIMIT_REQ2_BULK_OFF            0
+#define LIMIT_REQ2_BULK_KEYS           1
+#define LIMIT_REQ2_BULK_ADDR           2
 
-    uint64_t                     block_stat;
-    ngx_uint_t                   block_stat_base;
-    ngx_uint_t                   block_stop_time;
+#define LIMIT_REQ2_BULK_LINES          1
+#define LIMIT_REQ2_BULK_JSON           2
+
+/* keys applied under one lock of a shard, and the longest item of a body */
+#define LIMIT_REQ2_BULK_BATCH          256
+#define LIMIT_REQ2_BULK_WINDOW         65536
+
+/*
+ * action=dump, entries per hold of a shard lock, slices per turn of the
+ * event loop, and the key bytes listed; a buffer holds two slices
+ */
+#define LIMIT_REQ2_DUMP_SLICE          128
+#define LIMIT_REQ2_DUMP_SLICES         16
+#define LIMIT_REQ2_DUMP_KEY_LEN        256
+#define LIMIT_REQ2_DUMP_ENTRY_LEN      768
+#define LIMIT_REQ2_DUMP_BUFFER                                               \
+    (2 * LIMIT_REQ2_DUMP_SLICE * LIMIT_REQ2_DUMP_ENTRY_LEN)
+
+#define LIMIT_REQ2_STATS_OFF           0
+#define LIMIT_REQ2_STATS_JSON          1
+#define LIMIT_REQ2_STATS_PROMETHEUS    2
+
+/* $limit_req2_status */
+#define LIMIT_REQ2_STATUS_PASSED       1
+#define LIMIT_REQ2_STATUS_DELAYED      2
+#define LIMIT_REQ2_STATUS_REJECTED     3
+#define LIMIT_REQ2_STATUS_BLOCKED      4
+
+/* the delay queue, a turn of the wheel is 5.12s with the default tick */
+#define LIMIT_REQ2_DELAY_SLOTS         512
+#define LIMIT_REQ2_DELAY_TICK          10
+
+/* persist=, the default period of the snapshots */
+#define LIMIT_REQ2_PERSIST_INTERVAL    60000
+/* the pause between the parts of a snapshot */
+#define LIMIT_REQ2_PERSIST_STEP        10
+
+/*
+ * limit_req2_replicate, a datagram is the magic, the version, the length
+ * of the zone name, the sender, the sequence number of the datagram and
+ * the time it was sent, the name, the records of the changes and the
+ * HMAC-SHA1 of all that with the secret; it is kept below the MTU of an
+ * ethernet path over IPv6
+ */
+#define LIMIT_REQ2_REPLICATE_MAGIC     0x4c523252
+#define LIMIT_REQ2_REPLICATE_VERSION   2
+#define LIMIT_REQ2_REPLICATE_PREFIX    22
+#define LIMIT_REQ2_REPLICATE_MAC       20
+#define LIMIT_REQ2_REPLICATE_DATAGRAM  1452
+#define LIMIT_REQ2_REPLICATE_INTERVAL  100
+/* seconds the time of a datagram may be off from the time of worker 0 */
+#define LIMIT_REQ2_REPLICATE_SKEW      30
+/*
+ * the senders worker 0 keeps the last sequence numbers of, for each peer
+ * and worker: the workers of a reload, those still exiting, and the ids
+ * a sender moves to
+ */
+#define LIMIT_REQ2_REPLICATE_SENDERS   4
+/* the changes of a zone a worker queues between two sends */
+#define LIMIT_REQ2_REPLICATE_BUFFER    65536
+/* datagrams read per turn of the event loop */
+#define LIMIT_REQ2_REPLICATE_READS     64
+
+
+/* action=dump, the position in the zone and the buffers being sent */
+
+typedef struct {
+    ngx_http_limit_req2_walk_t   walk;
 
-    /* range count for computing qps */
-    ngx_uint_t                   last_seg;
-    ngx_uint_t                   curr_seg;
+    ngx_chain_t                 *free;
+    ngx_chain_t                 *busy;
+} ngx_http_limit_req2_dump_t;
 
-    u_char                       data[1];
-} ngx_http_limit_req2_node_t;
 
+/*
+ * The requests a worker delays by a zone with max_delayed=.  They are
+ * kept in a timing wheel of LIMIT_REQ2_DELAY_SLOTS slots of delay_tick
+ * each, advanced by a single timer that runs while the queue is not
+ * empty, rather than in a timer of their own each.  A slot holds the
+ * requests due at its time in this turn of the wheel or a later one, in
+ * the order they were delayed.
+ */
 
 typedef struct {
-    ngx_rbtree_t                  rbtree;
-    ngx_rbtree_node_t             sentinel;
-    ngx_queue_t                   queue;
-} ngx_http_limit_req2_shctx_t;
+    ngx_queue_t                  slots[LIMIT_REQ2_DELAY_SLOTS];
+    ngx_uint_t                   current;
+    /* the time of the current slot */
+    ngx_msec_t                   time;
+    ngx_uint_t                   ndelayed;
+    ngx_http_limit_req2_ctx_t   *ctx;
+    ngx_event_t                  event;
+} ngx_http_limit_req2_delay_t;
 
 
 typedef struct {
-    ngx_int_t                    index;
-    ngx_str_t                    var;
-} ngx_http_limit_req2_variable_t;
+    /* ngx_http_limit_req2_key_t */
+    ngx_array_t                  keys;
+    /* microseconds spent waiting for zone locks, with lock_stats */
+    ngx_uint_t                   lock_wait;
+
+    /* the outcome and the zone that decided it, for the variables */
+    ngx_uint_t                   status;
+    ngx_uint_t                   excess;
+    ngx_str_t                   *zone;
+
+    /* rate_seg=, the requests counted and the milliseconds they span */
+    ngx_uint_t                   rate_count;
+    ngx_uint_t                   rate_span;
+
+    /* in a delay queue, the queue is NULL once the request is released */
+    ngx_queue_t                  queue;
+    ngx_msec_t                   release;
+    ngx_http_request_t          *request;
+    ngx_http_limit_req2_delay_t *delay;
+    unsigned                     queued:1;
+
+    ngx_http_limit_req2_dump_t  *dump;
+} ngx_http_limit_req2_req_ctx_t;
 
 
 typedef struct {
@@ -55,37 +148,64 @@ typedef struct {
 } ngx_http_limit_req_variable_t;
 
 
-typedef struct {
-    ngx_http_limit_req2_shctx_t *sh;
-    ngx_slab_pool_t             *shpool;
-    /* integer value, 1 corresponds to 0.001 r/s */
-    ngx_uint_t                   rate;
-    ngx_http_complex_value_t     key;
-    ngx_http_limit_req2_node_t  *node;
+/*
+ * A worker that sends datagrams, as seen by worker 0: the highest sequence
+ * number it sent and a bit for each of the 64 before it that was received,
+ * and the latest time in its datagrams.
+ */
 
-    ngx_uint_t                   rate_seg;
-    ngx_uint_t                   last_seg;
-    ngx_uint_t                   curr_seg;
-    ngx_uint_t                   curr_seg_time_diff;
+typedef struct {
+    uint64_t                     id;
+    uint32_t                     seq;
+    uint64_t                     window;
+    time_t                       sent;
+    time_t                       seen;
+} ngx_http_limit_req2_sender_t;
 
-    ngx_array_t                 *limit_vars;
-} ngx_http_limit_req2_ctx_t;
 
+/*
+ * limit_req2_replicate: every worker sends the ban changes it made in the
+ * zones with "replicate" to the peers every interval, from a socket of
+ * its own bound to the listen address if there is one; worker 0 receives
+ * the changes of the peers on the listen address.
+ */
 
 typedef struct {
-    ngx_shm_zone_t              *shm_zone;
-    /* integer value, 1 corresponds to 0.001 r/s */
-    ngx_uint_t                   burst;
-    ngx_uint_t                   nodelay; /* unsigned  nodelay:1 */
-    ngx_str_t                    forbid_action;
+    ngx_addr_t                   listen;
+    /* ngx_addr_t */
+    ngx_array_t                  peers;
+    ngx_msec_t                   interval;
+
+    ngx_socket_t                 fd;
+    ngx_connection_t            *connection;
+    ngx_event_t                  event;
+    /* the listen address could not be bound, logged once */
+    ngx_uint_t                   bind_failed;
+
+    /* secret=, the inner and outer hashes of HMAC-SHA1 after the key */
+    ngx_sha1_t                   ipad;
+    ngx_sha1_t                   opad;
+
+    /* the worker as a sender, and its last sequence number */
+    uint64_t                     id;
+    uint32_t                     seq;
 
-    /* 5x60x1800 */
-    ngx_uint_t                   block_stat_interval;   /* 60 */
-    ngx_uint_t                   block_stat_times;      /* 5 */
-    ngx_uint_t                   block_time;            /* 1800 */
+    /*
+     * worker 0, against datagrams that are replayed: nsenders senders of
+     * each peer, and for each peer the latest time in the datagrams of
+     * the senders it had to forget
+     */
+    ngx_http_limit_req2_sender_t *senders;
+    ngx_uint_t                   nsenders;
+    time_t                      *evicted;
+} ngx_http_limit_req2_peers_t;
 
-    ngx_uint_t                   rate_seg;
-} ngx_http_limit_req2_t;
+
+typedef struct {
+    /* ngx_shm_zone_t * */
+    ngx_array_t                  zones;
+    ngx_http_limit_req2_peers_t *peers;
+} ngx_http_limit_req2_main_conf_t;
 
 
 typedef struct {
@@ -106,20 +226,120 @@ typedef struct {
     ngx_int_t                    block_time;
     ngx_shm_zone_t              *block_shm_zone;
     ngx_array_t                 *block_limit_vars;
+    ngx_uint_t                   block_bulk;
 
     ngx_int_t                    enable_record_rate;
+
+    ngx_uint_t                   stats;
 } ngx_http_limit_req2_conf_t;
 
+
+typedef struct {
+    ngx_http_limit_req2_key_t    key;
+    ngx_http_limit_req2_shard_t *shard;
+    ngx_int_t                    block_time;
+    /* the key of bulk=addr */
+    u_char                       addr[16];
+} ngx_http_limit_req2_bulk_key_t;
+
+
+/*
+ * A bulk request of limit_req2_block.  The body is parsed in a window
+ * that is refilled from its buffers and its temporary file, the keys
+ * parsed point into the window and are applied before it is moved.
+ */
+
+typedef struct {
+    ngx_http_request_t          *request;
+    ngx_http_limit_req2_conf_t  *lrcf;
+    ngx_http_limit_req2_ctx_t   *ctx;
+
+    ngx_uint_t                   format;
+    ngx_uint_t                   done;
+    u_char                      *start;
+    u_char                      *pos;
+    u_char                      *last;
+    u_char                      *end;
+
+    ngx_http_limit_req2_bulk_key_t  keys[LIMIT_REQ2_BULK_BATCH];
+    ngx_uint_t                   nkeys;
+
+    ngx_uint_t                   total;
+    ngx_uint_t                   added;
+    ngx_uint_t                   updated;
+    ngx_uint_t                   cleared;
+    ngx_uint_t                   missing;
+    ngx_uint_t                   failed;
+    ngx_uint_t                   invalid;
+    ngx_uint_t                   batches;
+} ngx_http_limit_req2_bulk_t;
+
+
+/* the counters and the current state of a zone, as reported */
+
+typedef struct {
+    ngx_http_limit_req2_stats_t  counters;
+    ngx_atomic_uint_t            nodes;
+    ngx_atomic_uint_t            bans;
+    ngx_atomic_uint_t            pages_used;
+    ngx_atomic_uint_t            pages_free;
+} ngx_http_limit_req2_report_t;
+
+
+typedef struct {
+    ngx_str_t                    name;
+    /* the prometheus metric, its type and extra labels */
+    ngx_str_t                    metric;
+    ngx_str_t                    labels;
+    char                        *type;
+    size_t                       offset;
+} ngx_http_limit_req2_metric_t;
+
 static ngx_str_t   ngx_http_limit_req2_rate = ngx_string("limit_req2_rate");
+static ngx_str_t   ngx_http_limit_req2_lock_wait =
+    ngx_string("limit_req2_lock_wait");
+static ngx_str_t   ngx_http_limit_req2_status =
+    ngx_string("limit_req2_status");
+static ngx_str_t   ngx_http_limit_req2_excess =
+    ngx_string("limit_req2_excess");
+static ngx_str_t   ngx_http_limit_req2_zone_name =
+    ngx_string("limit_req2_zone");
+
+static ngx_str_t   ngx_http_limit_req2_statuses[] = {
+    ngx_null_string,
+    ngx_string("PASSED"),
+    ngx_string("DELAYED"),
+    ngx_string("REJECTED"),
+    ngx_string("BLOCKED")
+};
 
-static void ngx_http_limit_req2_delay(ngx_http_request_t *r);
-static ngx_int_t ngx_http_limit_req2_lookup(ngx_http_request_t *r,
-    ngx_http_limit_req2_t *limit_req2, ngx_uint_t hash, ngx_uint_t *ep,
-    ngx_uint_t *bst, ngx_uint_t *last_seg, ngx_uint_t *curr_seg,
-    ngx_uint_t *curr_seg_time_diff, ngx_int_t block_action);
+static ngx_http_limit_req2_req_ctx_t *ngx_http_limit_req2_get_ctx(
+    ngx_http_request_t *r);
+static ngx_http_limit_req2_req_ctx_t *ngx_http_limit_req2_create_ctx(
+    ngx_http_request_t *r);
+static void ngx_http_limit_req2_cleanup(void *data);
 
-static void ngx_http_limit_req2_expire(ngx_http_request_t *r,
-    ngx_http_limit_req2_ctx_t *ctx, ngx_uint_t n);
+static void ngx_http_limit_req2_delay(ngx_http_request_t *r);
+static ngx_int_t ngx_http_limit_req2_delay_add(ngx_http_request_t *r,
+    ngx_http_limit_req2_delay_t *dq, ngx_msec_t delay);
+static void ngx_http_limit_req2_delay_tick(ngx_event_t *ev);
+static void ngx_http_limit_req2_sweep(ngx_event_t *ev);
+static void ngx_http_limit_req2_persist(ngx_event_t *ev);
+static void ngx_http_limit_req2_replicate_send(
+    ngx_http_limit_req2_peers_t *peers, ngx_shm_zone_t *shm_zone);
+static void ngx_http_limit_req2_replicate_timer(ngx_event_t *ev);
+static void ngx_http_limit_req2_replicate_read(ngx_event_t *rev);
+static void ngx_http_limit_req2_bulk_body(ngx_http_request_t *r);
+static ngx_int_t ngx_http_limit_req2_dump(ngx_http_request_t *r,
+    ngx_http_limit_req2_conf_t *lrcf);
+static void ngx_http_limit_req2_dump_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_limit_req2_send_json(ngx_http_request_t *r,
+    ngx_buf_t *b);
+
+static void *ngx_http_limit_req2_create_main_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_limit_req2_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_limit_req2_init_process(ngx_cycle_t *cycle);
+static void ngx_http_limit_req2_exit_process(ngx_cycle_t *cycle);
 
 static void *ngx_http_limit_req2_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req2_merge_conf(ngx_conf_t *cf, void *parent,
@@ -132,25 +352,13 @@ static char *ngx_http_limit_req2_whitelist(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_limit_req2_block(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_limit_req2_replicate(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static ngx_int_t ngx_http_limit_req2_init(ngx_conf_t *cf);
 
 static ngx_int_t ngx_http_limit_req2_add_variables(ngx_conf_t *cf);
 
 
-static inline
-int get_stat_bit(uint64_t stat, int idx)
-{
-    stat >>= idx;
-    return stat & 1;
-}
-
-static inline
-void set_stat_bit(uint64_t *pstat, int idx, int val)
-{
-    uint64_t tmp = val <<= idx;
-    *pstat |= tmp;
-}
-
 static ngx_conf_enum_t  ngx_http_limit_req2_log_levels[] = {
     { ngx_string("info"), NGX_LOG_INFO },
     { ngx_string("notice"), NGX_LOG_NOTICE },
@@ -165,12 +373,63 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req2_status_bounds = {
 };
 
 
+static ngx_conf_enum_t  ngx_http_limit_req2_stats_formats[] = {
+    { ngx_string("off"), LIMIT_REQ2_STATS_OFF },
+    { ngx_string("json"), LIMIT_REQ2_STATS_JSON },
+    { ngx_string("prometheus"), LIMIT_REQ2_STATS_PROMETHEUS },
+    { ngx_null_string, 0 }
+};
+
+
+#define ngx_http_limit_req2_metric(name, metric, labels, type, field)        \
+    { ngx_string(name), ngx_string(metric), ngx_string(labels), type,        \
+      offsetof(ngx_http_limit_req2_report_t, field) }
+
+static ngx_http_limit_req2_metric_t  ngx_http_limit_req2_metrics[] = {
+    ngx_http_limit_req2_metric("passed", "requests_total",
+                               ",result=\"passed\"", "counter",
+                               counters.passed),
+    ngx_http_limit_req2_metric("delayed", "requests_total",
+                               ",result=\"delayed\"", "counter",
+                               counters.delayed),
+    ngx_http_limit_req2_metric("rejected", "requests_total",
+                               ",result=\"rejected\"", "counter",
+                               counters.rejected),
+    ngx_http_limit_req2_metric("blocked", "requests_total",
+                               ",result=\"blocked\"", "counter",
+                               counters.blocked),
+    ngx_http_limit_req2_metric("evicted", "evictions_total", "", "counter",
+                               counters.evicted),
+    ngx_http_limit_req2_metric("alloc_failed", "alloc_failures_total", "",
+                               "counter", counters.alloc_failed),
+    ngx_http_limit_req2_metric("auto_blocked", "auto_blocks_total", "",
+                               "counter", counters.auto_blocked),
+    ngx_http_limit_req2_metric("delay_overflow", "delay_overflows_total", "",
+                               "counter", counters.delay_overflow),
+    ngx_http_limit_req2_metric("replicate_sent", "replicated_total",
+                               ",direction=\"sent\"", "counter",
+                               counters.replicate_sent),
+    ngx_http_limit_req2_metric("replicate_received", "replicated_total",
+                               ",direction=\"received\"", "counter",
+                               counters.replicate_received),
+    ngx_http_limit_req2_metric("replicate_dropped", "replicate_drops_total",
+                               "", "counter", counters.replicate_dropped),
+    ngx_http_limit_req2_metric("nodes", "nodes", "", "gauge", nodes),
+    ngx_http_limit_req2_metric("bans", "bans", "", "gauge", bans),
+    ngx_http_limit_req2_metric("pages_used", "pages", ",state=\"used\"",
+                               "gauge", pages_used),
+    ngx_http_limit_req2_metric("pages_free", "pages", ",state=\"free\"",
+                               "gauge", pages_free),
+    { ngx_null_string, ngx_null_string, ngx_null_string, NULL, 0 }
+};
+
+
 static ngx_command_t  ngx_http_limit_req2_commands[] = {
 
     { ngx_string("limit_req2_zone"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_limit_req2_zone,
-      0,
+      NGX_HTTP_MAIN_CONF_OFFSET,
       0,
       NULL },
 
@@ -202,6 +461,13 @@ static ngx_command_t  ngx_http_limit_req2_commands[] = {
       offsetof(ngx_http_limit_req2_conf_t, status_code),
       &ngx_http_limit_req2_status_bounds },
 
+    { ngx_string("limit_req2_stats"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_limit_req2_conf_t, stats),
+      &ngx_http_limit_req2_stats_formats },
+
       { ngx_string("limit_req2_block"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_limit_req2_block,
@@ -209,6 +475,13 @@ static ngx_command_t  ngx_http_limit_req2_commands[] = {
       offsetof(ngx_http_limit_req2_conf_t, enable),
       NULL },
 
+    { ngx_string("limit_req2_replicate"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_limit_req2_replicate,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -217,7 +490,7 @@ static ngx_http_module_t  ngx_http_limit_req2_module_ctx = {
     ngx_http_limit_req2_add_variables,     /* preconfiguration */
     ngx_http_limit_req2_init,              /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_limit_req2_create_main_conf,  /* create main configuration */
     NULL,                                  /* init main configuration */
 
     NULL,                                  /* create server configuration */
@@ -234,11 +507,11 @@ ngx_module_t  ngx_http_limit_req2_module = {
     ngx_http_limit_req2_commands,          /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_limit_req2_init_module,       /* init module */
+    ngx_http_limit_req2_init_process,      /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_limit_req2_exit_process,      /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -268,89 +541,173 @@ ngx_http_limit_req2_ip_filter(ngx_http_request_t *r,
 }
 
 
+static ngx_uint_t
+ngx_http_limit_req2_same_vars(ngx_array_t *a, ngx_array_t *b)
+{
+    ngx_uint_t                       i;
+    ngx_http_limit_req2_variable_t  *va, *vb;
+
+    if (a == b) {
+        return 1;
+    }
+
+    if (a->nelts != b->nelts) {
+        return 0;
+    }
+
+    va = a->elts;
+    vb = b->elts;
+
+    for (i = 0; i < a->nelts; i++) {
+        if (va[i].index != vb[i].index) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * Builds the key of the variable list once per request: the values are
+ * concatenated into one buffer that is hashed in a single pass and compared
+ * with a single memcmp by the lookup.  Keys are kept in the request ctx and
+ * are shared by all rules (and the block handler) using the same variables.
+ */
+
 static ngx_int_t
-ngx_http_limit_req2_copy_variables(ngx_http_request_t *r, uint32_t *hash,
-    ngx_array_t *limit_vars, ngx_http_limit_req2_node_t *node)
+ngx_http_limit_req2_get_key(ngx_http_request_t *r, ngx_array_t *limit_vars,
+    ngx_http_limit_req2_hash_t *h, ngx_http_limit_req2_key_t *key)
 {
-    u_char                        *p;
-    size_t                         len, total_len;
-    ngx_uint_t                     j;
-    ngx_http_variable_value_t     *vv;
-    ngx_http_limit_req2_variable_t *lrv;
+    u_char                          *p;
+    size_t                           len;
+    ngx_uint_t                       i, j;
+    ngx_http_variable_value_t       *vv;
+    ngx_http_limit_req2_key_t       *k, *same;
+    ngx_http_limit_req2_req_ctx_t   *rctx;
+    ngx_http_limit_req2_variable_t  *lrv;
 
-    len = 0;
-    total_len = 0;
-    p = NULL;
+    rctx = ngx_http_limit_req2_create_ctx(r);
+    if (rctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    same = NULL;
+    k = rctx->keys.elts;
+
+    for (i = 0; i < rctx->keys.nelts; i++) {
+        if (!ngx_http_limit_req2_same_vars(k[i].limit_vars, limit_vars)) {
+            continue;
+        }
+
+        if (k[i].hash_alg == h) {
+            *key = k[i];
+            return key->key.len ? NGX_OK : NGX_DECLINED;
+        }
 
-    if (node != NULL) {
-        p = node->data;
+        same = &k[i];
     }
 
-    lrv = limit_vars->elts;
-    for (j = 0; j < limit_vars->nelts; j++) {
-        vv = ngx_http_get_indexed_variable(r, lrv[j].index);
-        if (vv == NULL || vv->not_found) {
-            total_len = 0;
-            break;
+    if (same) {
+        *key = *same;
+
+        key->hash_alg = h;
+
+        if (key->key.len) {
+            key->hash = h->final ^ h->update(h->init, key->key.data,
+                                             key->key.len);
         }
 
-        len = vv->len;
+        goto done;
+    }
+
+    key->limit_vars = limit_vars;
+    key->hash_alg = h;
+    key->hash = 0;
+    ngx_str_null(&key->key);
+
+    len = 0;
+    lrv = limit_vars->elts;
 
-        if (len == 0) {
-            total_len = 0;
+    for (j = 0; j < limit_vars->nelts; j++) {
+        vv = ngx_http_get_indexed_variable(r, lrv[j].index);
+        if (vv == NULL || vv->not_found || vv->len == 0) {
+            len = 0;
             break;
         }
 
-        if (len > 65535) {
+        if (vv->len > 65535) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                           "the value of the \"%V\" variable "
                           "is more than 65535 bytes: \"%v\"",
                           &lrv[j].var, vv);
-            total_len = 0;
+            len = 0;
             break;
         }
 
-        if (node == NULL) {
-            total_len += len;
-            ngx_crc32_update(hash, vv->data, len);
-        } else {
-            p = ngx_cpymem(p, vv->data, len);
+        len += vv->len;
+    }
+
+    if (len > 65535) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "limit_req2 key is more than 65535 bytes");
+        len = 0;
+    }
+
+    if (len) {
+        p = ngx_pnalloc(r->pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        key->key.len = len;
+        key->key.data = p;
+
+        /* the variables are cached, this does not evaluate them again */
+
+        for (j = 0; j < limit_vars->nelts; j++) {
+            vv = ngx_http_get_indexed_variable(r, lrv[j].index);
+            p = ngx_cpymem(p, vv->data, vv->len);
         }
+
+        key->hash = h->final ^ h->update(h->init, key->key.data, len);
+    }
+
+done:
+
+    k = ngx_array_push(&rctx->keys);
+    if (k == NULL) {
+        return NGX_ERROR;
     }
 
-    return total_len;
+    *k = *key;
+
+    return key->key.len ? NGX_OK : NGX_DECLINED;
 }
 
 
 static ngx_int_t
 ngx_http_limit_req2_handler(ngx_http_request_t *r)
 {
-    size_t                         n, total_len;
-    uint32_t                       hash;
     ngx_int_t                      rc;
     ngx_msec_t                     delay_time;
-    ngx_uint_t                     excess, delay_excess, delay_postion,
-                                   nodelay, i;
-    ngx_time_t                    *tp;
-    ngx_rbtree_node_t             *node;
+    ngx_uint_t                     delay_excess, delay_postion, nodelay, i;
     ngx_http_limit_req2_t         *limit_req2;
     ngx_http_limit_req2_ctx_t      *ctx;
-    ngx_http_limit_req2_node_t     *lr;
     ngx_http_limit_req2_conf_t     *lrcf;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
+    ngx_http_limit_req2_key_t       key;
+    ngx_http_limit_req2_result_t    res;
 
-    ngx_uint_t                     last_seg, curr_seg, curr_seg_time_diff;
-    ngx_uint_t                     block_stop_time = 0;
-
+    rctx = NULL;
     delay_excess = 0;
-    excess = 0;
+    delay_time = 0;
     delay_postion = 0;
     nodelay = 0;
     ctx = NULL;
     rc = NGX_DECLINED;
 
-    last_seg = 0;
-    curr_seg = 0;
-    curr_seg_time_diff = 0;
+    ngx_memzero(&res, sizeof(ngx_http_limit_req2_result_t));
 
     if (r->main->limit_req_set) {
         return NGX_DECLINED;
@@ -375,107 +732,50 @@ ngx_http_limit_req2_handler(ngx_http_request_t *r)
     for (i = 0; i < lrcf->rules->nelts; i++) {
         ctx = limit_req2[i].shm_zone->data;
 
-        ngx_crc32_init(hash);
+        rc = ngx_http_limit_req2_get_key(r, ctx->limit_vars, ctx->hash, &key);
 
-        total_len = ngx_http_limit_req2_copy_variables(
-          r, &hash, ctx->limit_vars, NULL);
-        if (total_len == 0) {
-            continue;
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        ngx_crc32_final(hash);
+        if (rc == NGX_DECLINED) {
+            continue;
+        }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        rc = ngx_http_limit_req2_account(ctx, &limit_req2[i], &key,
+                                         r->connection->log, &res);
 
-        ngx_http_limit_req2_expire(r, ctx, 1);
+        /* the key has been added to the request context */
 
-        excess = 0;
-        rc = ngx_http_limit_req2_lookup(r, &limit_req2[i], hash, &excess,
-                &block_stop_time, &last_seg, &curr_seg,
-                &curr_seg_time_diff, 0);
-
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "limit_req2 module: %i %ui.%03ui "
-                       "block_stop_time: %ui "
-                       "hash is %D total_len is %uz",
-                       rc, excess / 1000, excess % 1000,
-                       block_stop_time,
-                       hash, total_len);
+        rctx = ngx_http_get_module_ctx(r, ngx_http_limit_req2_module);
+        rctx->lock_wait += res.lock_wait;
 
         /*
          * add variable for computing rate
          */
         if (limit_req2[i].rate_seg > 0) {
 
-            ctx->rate_seg = limit_req2[i].rate_seg;
-            ctx->last_seg = last_seg;
-            ctx->curr_seg = curr_seg;
-            ctx->curr_seg_time_diff = curr_seg_time_diff;
+            rctx->rate_count = res.last_seg + res.curr_seg;
+            rctx->rate_span = limit_req2[i].rate_seg + res.curr_seg_time_diff;
 
             ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                 "limit_req2 rate_seg : %ui "
                 "last_seg : %ui "
                 "curr_seg : %ui "
                 "curr_seg_time_diff : %ui",
-                limit_req2[i].rate_seg, last_seg, curr_seg, curr_seg_time_diff);
-        }
-
-        /* first limit_req2 */
-        if (rc == NGX_DECLINED) {
-
-            n = offsetof(ngx_rbtree_node_t, color)
-                + offsetof(ngx_http_limit_req2_node_t, data)
-                + total_len;
-
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
-            if (node == NULL) {
-                ngx_http_limit_req2_expire(r, ctx, 0);
-                node = ngx_slab_alloc_locked(ctx->shpool, n);
-                if (node == NULL) {
-                    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                                  "could not allocate node%s",
-                                  ctx->shpool->log_ctx);
-
-                    ngx_shmtx_unlock(&ctx->shpool->mutex);
-                    return lrcf->status_code;
-                }
-            }
-
-            lr = (ngx_http_limit_req2_node_t *) &node->color;
-
-            node->key = hash;
-            lr->len = (u_short) total_len;
-
-            tp = ngx_timeofday();
-            lr->last = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
-
-            lr->excess = 0;
-            lr->block_stat = 0;
-            lr->block_stat_base = 0;
-            lr->block_stop_time = 0;
-
-            lr->last_seg = 0;
-            lr->curr_seg = 1;
-            ngx_http_limit_req2_copy_variables(r, &hash, ctx->limit_vars, lr);
-
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-            ngx_rbtree_insert(&ctx->sh->rbtree, node);
-
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-
-            continue;
+                limit_req2[i].rate_seg, res.last_seg, res.curr_seg,
+                res.curr_seg_time_diff);
         }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-
         if (rc == NGX_BUSY || rc == NGX_ERROR) {
             break;
         }
 
         /* NGX_AGAIN or NGX_OK */
 
-        if (delay_excess < excess) {
-            delay_excess = excess;
+        if (res.excess && (delay_excess == 0 || delay_time < res.delay)) {
+            delay_excess = res.excess;
+            delay_time = res.delay;
             nodelay = limit_req2[i].nodelay;
             delay_postion = i;
         }
@@ -483,20 +783,38 @@ ngx_http_limit_req2_handler(ngx_http_request_t *r)
 
     r->main->limit_req_set = 1;
 
+    if (rctx) {
+        if (rc == NGX_BUSY || rc == NGX_ERROR) {
+            rctx->status = res.block_stop_time ? LIMIT_REQ2_STATUS_BLOCKED
+                                               : LIMIT_REQ2_STATUS_REJECTED;
+            rctx->excess = res.excess;
+            rctx->zone = &limit_req2[i].shm_zone->shm.name;
+
+        } else if (delay_excess) {
+            rctx->status = nodelay ? LIMIT_REQ2_STATUS_PASSED
+                                   : LIMIT_REQ2_STATUS_DELAYED;
+            rctx->excess = delay_excess;
+            rctx->zone = &limit_req2[delay_postion].shm_zone->shm.name;
+
+        } else {
+            rctx->status = LIMIT_REQ2_STATUS_PASSED;
+        }
+    }
+
     if (rc == NGX_BUSY || rc == NGX_ERROR) {
         if (rc == NGX_BUSY) {
-            if (block_stop_time) {
+            if (res.block_stop_time) {
                 ngx_log_error(lrcf->limit_log_level, r->connection->log, 0,
                             "limit_req2 blocking requests, "
                             "block_stop_time: %ui by zone \"%V\"",
-                            block_stop_time,
+                            res.block_stop_time,
                             &limit_req2[i].shm_zone->shm.name);
 
             } else {
                 ngx_log_error(lrcf->limit_log_level, r->connection->log, 0,
                             "limit_req2 limiting requests, "
                             "excess: %ui.%03ui by zone \"%V\"",
-                            excess / 1000, excess % 1000,
+                            res.excess / 1000, res.excess % 1000,
                             &limit_req2[i].shm_zone->shm.name);
             }
         }
@@ -532,7 +850,29 @@ ngx_http_limit_req2_handler(ngx_http_request_t *r)
             return NGX_DECLINED;
         }
 
-        delay_time = (ngx_msec_t) delay_excess * 1000 / ctx->rate;
+        ctx = limit_req2[delay_postion].shm_zone->data;
+
+        if (ctx->delay) {
+            rc = ngx_http_limit_req2_delay_add(r, ctx->delay, delay_time);
+
+            if (rc == NGX_ERROR) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (rc == NGX_BUSY) {
+                ngx_http_limit_req2_count(ctx, delay_overflow);
+                rctx->status = LIMIT_REQ2_STATUS_REJECTED;
+
+                ngx_log_error(lrcf->limit_log_level, r->connection->log, 0,
+                              "limit_req2 limiting requests, "
+                              "%ui requests delayed by zone \"%V\"",
+                              ctx->max_delayed,
+                              &limit_req2[delay_postion].shm_zone->shm.name);
+
+                return lrcf->status_code;
+            }
+        }
+
         ngx_log_error(lrcf->delay_log_level, r->connection->log, 0,
                       "delaying request,"
                       "excess: %ui.%03ui, by zone \"%V\", delay \"%M\" ms",
@@ -545,7 +885,10 @@ ngx_http_limit_req2_handler(ngx_http_request_t *r)
 
         r->read_event_handler = ngx_http_test_reading;
         r->write_event_handler = ngx_http_limit_req2_delay;
-        ngx_add_timer(r->connection->write, delay_time);
+
+        if (ctx->delay == NULL) {
+            ngx_add_timer(r->connection->write, delay_time);
+        }
 
         return NGX_AGAIN;
     }
@@ -559,14 +902,18 @@ ngx_http_limit_req2_handler(ngx_http_request_t *r)
 static void
 ngx_http_limit_req2_delay(ngx_http_request_t *r)
 {
-    ngx_event_t  *wev;
+    ngx_event_t                    *wev;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "limit_req2 delay");
 
     wev = r->connection->write;
+    rctx = ngx_http_get_module_ctx(r, ngx_http_limit_req2_module);
 
-    if (!wev->timedout) {
+    /* the delay queue posts the write event of a request it releases */
+
+    if (rctx->queued ? rctx->delay != NULL : !wev->timedout) {
 
         if (ngx_handle_write_event(wev, 0) != NGX_OK) {
             ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -589,486 +936,864 @@ ngx_http_limit_req2_delay(ngx_http_request_t *r)
 }
 
 
-static void
-ngx_http_limit_req2_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static ngx_int_t
+ngx_http_limit_req2_delay_add(ngx_http_request_t *r,
+    ngx_http_limit_req2_delay_t *dq, ngx_msec_t delay)
 {
-    ngx_rbtree_node_t          **p;
-    ngx_http_limit_req2_node_t  *lrn, *lrnt;
+    ngx_uint_t                      ticks;
+    ngx_http_limit_req2_ctx_t      *ctx;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
-    for ( ;; ) {
+    ctx = dq->ctx;
 
-        if (node->key < temp->key) {
+    if (dq->ndelayed >= ctx->max_delayed) {
+        return NGX_BUSY;
+    }
 
-            p = &temp->left;
+    rctx = ngx_http_get_module_ctx(r, ngx_http_limit_req2_module);
 
-        } else if (node->key > temp->key) {
+    /* the wheel stands still while it is empty */
 
-            p = &temp->right;
+    if (dq->ndelayed == 0) {
+        dq->time = ngx_current_msec;
+    }
 
-        } else { /* node->key == temp->key */
+    rctx->release = ngx_current_msec + delay;
+    rctx->request = r;
+    rctx->delay = dq;
+    rctx->queued = 1;
 
-            lrn = (ngx_http_limit_req2_node_t *) &node->color;
-            lrnt = (ngx_http_limit_req2_node_t *) &temp->color;
+    /* the first slot at or after the release time */
 
-            p = (ngx_memn2cmp(lrn->data, lrnt->data, lrn->len, lrnt->len) < 0)
-                ? &temp->left : &temp->right;
-        }
+    ticks = (rctx->release - dq->time + ctx->delay_tick - 1) / ctx->delay_tick;
+    if (ticks == 0) {
+        ticks = 1;
+    }
 
-        if (*p == sentinel) {
-            break;
-        }
+    ngx_queue_insert_tail(
+        &dq->slots[(dq->current + ticks) % LIMIT_REQ2_DELAY_SLOTS],
+        &rctx->queue);
 
-        temp = *p;
+    if (dq->ndelayed++ == 0) {
+        ngx_add_timer(&dq->event, ctx->delay_tick);
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "limit_req2 delay queue: %M ms, %ui ticks, %ui delayed",
+                   delay, ticks, dq->ndelayed);
+
+    return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_limit_req2_lookup(ngx_http_request_t *r,
-    ngx_http_limit_req2_t *limit_req2, ngx_uint_t hash, ngx_uint_t *ep,
-    ngx_uint_t *bst, ngx_uint_t *last_seg, ngx_uint_t *curr_seg,
-    ngx_uint_t *curr_seg_time_diff, ngx_int_t block_action)
+static void
+ngx_http_limit_req2_delay_tick(ngx_event_t *ev)
 {
-    u_char                          *lr_data, *lr_last;
-    size_t                           lr_vv_len;
-    ngx_int_t                        rc, excess;
-    ngx_uint_t                       i;
-    ngx_time_t                      *tp;
-    ngx_msec_t                       now;
-    ngx_msec_int_t                   ms;
-    ngx_rbtree_node_t               *node, *sentinel;
-    ngx_http_limit_req2_ctx_t       *ctx;
-    ngx_http_limit_req2_node_t      *lr;
-    ngx_http_variable_value_t       *vv;
-    ngx_http_limit_req2_variable_t  *lrv;
-
-    ngx_http_limit_req2_conf_t      *lrcf;
-
-    ngx_uint_t                       stat_interval, stat_times, now_sec, diff;
-    ngx_int_t                        check_all_bit, last_zero_pos;
-    ngx_uint_t                       j;
+    ngx_uint_t                      n;
+    ngx_msec_t                      tick;
+    ngx_queue_t                    *slot, *q;
+    ngx_http_limit_req2_delay_t    *dq;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
-    ngx_msec_t                       last_rate_seg;
-    ngx_msec_t                       curr_rate_seg;
+    dq = ev->data;
+    tick = dq->ctx->delay_tick;
 
-    ctx = limit_req2->shm_zone->data;
+    /* the slots passed since the last tick, a turn at most if it is late */
 
-    tp = ngx_timeofday();
-    now_sec = (ngx_uint_t) (tp->sec);
+    for (n = 0;
+         n < LIMIT_REQ2_DELAY_SLOTS
+         && (ngx_msec_int_t) (ngx_current_msec - dq->time)
+            >= (ngx_msec_int_t) tick;
+         n++)
+    {
+        dq->current = (dq->current + 1) % LIMIT_REQ2_DELAY_SLOTS;
+        dq->time += tick;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
-    rc = -1;
+        slot = &dq->slots[dq->current];
+        q = ngx_queue_head(slot);
 
-    lrv = ctx->limit_vars->elts;
+        while (q != ngx_queue_sentinel(slot)) {
+            rctx = ngx_queue_data(q, ngx_http_limit_req2_req_ctx_t, queue);
+            q = ngx_queue_next(q);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                               "limit_req2_lookup hash : %i", hash);
+            /* due in a later turn of the wheel */
 
-    while (node != sentinel) {
+            if ((ngx_msec_int_t) (rctx->release - ngx_current_msec) > 0) {
+                continue;
+            }
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+            ngx_queue_remove(&rctx->queue);
+            rctx->delay = NULL;
+            dq->ndelayed--;
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
+            ngx_post_event(rctx->request->connection->write,
+                           &ngx_posted_events);
         }
+    }
 
-        /* hash == node->key */
+    if (n == LIMIT_REQ2_DELAY_SLOTS) {
+        dq->time = ngx_current_msec;
+    }
 
-        lr = (ngx_http_limit_req2_node_t *) &node->color;
+    if (dq->ndelayed) {
+        ngx_add_timer(ev, dq->time + tick - ngx_current_msec);
+    }
+}
 
-        lr_data = lr->data;
-        lr_last = lr_data + lr->len;
 
-        for (i = 0; i < ctx->limit_vars->nelts; i++) {
-            vv = ngx_http_get_indexed_variable(r, lrv[i].index);
+/*
+ * The request context, also after an internal redirect, forbid_action=
+ * for one, has cleared the module contexts: the cleanup of the request
+ * pool refers to it.
+ */
 
-            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "limit_req2 vv is %i %v node is %s",
-                           lrv[i].index, vv, lr_data);
+static ngx_http_limit_req2_req_ctx_t *
+ngx_http_limit_req2_get_ctx(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
-            lr_vv_len = ngx_min(lr_last - lr_data, vv->len);
+    rctx = ngx_http_get_module_ctx(r, ngx_http_limit_req2_module);
 
-            if ((rc = ngx_memcmp(vv->data, lr_data, lr_vv_len)) != 0) {
-                break;
-            }
+    if (rctx == NULL && (r->internal || r->filter_finalize)) {
 
-            if (lr_vv_len != vv->len) {
-                rc = 1;
+        for (cln = r->pool->cleanup; cln; cln = cln->next) {
+            if (cln->handler == ngx_http_limit_req2_cleanup) {
+                rctx = cln->data;
+                ngx_http_set_ctx(r, rctx, ngx_http_limit_req2_module);
                 break;
             }
-
-            /* lr_vv_len == vv->len */
-            lr_data += lr_vv_len;
-        }
-
-        if (rc == 0 && lr_last > lr_data) {
-            rc = -1;
         }
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "limit_req2 lookup is : %i, size is %ui",
-                       rc, ctx->limit_vars->nelts);
+    return rctx;
+}
 
-        if (rc == 0) {
-            ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
 
-            ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "limit_req2 lookup sucess "
-                    "block_action: %i "
-                    "now_sec: %ui "
-                    "block_stop_time: %i "
-                    "excess: %ui.%03ui",
-                    block_action, now_sec, lr->block_stop_time,
-                    lr->excess / 1000, lr->excess % 1000);
+static ngx_http_limit_req2_req_ctx_t *
+ngx_http_limit_req2_create_ctx(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
-            if (block_action == LIMIT_REQ2_BLOCK_ACTION_QUERY) {
+    rctx = ngx_http_limit_req2_get_ctx(r);
 
-                if (lr->block_stop_time > now_sec) {
-                    *bst = lr->block_stop_time;
-                } else {
-                    *bst = 0;
-                }
+    if (rctx) {
+        return rctx;
+    }
 
-                return NGX_OK;
+    rctx = ngx_pcalloc(r->pool, sizeof(ngx_http_limit_req2_req_ctx_t));
+    if (rctx == NULL) {
+        return NULL;
+    }
 
-            } else if (block_action == LIMIT_REQ2_BLOCK_ACTION_SET) {
+    if (ngx_array_init(&rctx->keys, r->pool, 2,
+                       sizeof(ngx_http_limit_req2_key_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
 
-                lrcf = ngx_http_get_module_loc_conf(r,
-                                            ngx_http_limit_req2_module);
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
 
-                lr->block_stop_time = now_sec + lrcf->block_time;
+    cln->handler = ngx_http_limit_req2_cleanup;
+    cln->data = rctx;
 
-                *bst = lr->block_stop_time;
+    ngx_http_set_ctx(r, rctx, ngx_http_limit_req2_module);
 
-                return NGX_OK;
+    return rctx;
+}
 
-            } else if (block_action == LIMIT_REQ2_BLOCK_ACTION_CLEAR) {
 
-                lr->block_stop_time = 0;
-                lr->excess = 0;
+/* takes a request finalized before it is released out of the delay queue */
 
-                return NGX_OK;
+static void
+ngx_http_limit_req2_cleanup(void *data)
+{
+    ngx_http_limit_req2_req_ctx_t  *rctx = data;
 
-            } else {
+    ngx_http_limit_req2_delay_t  *dq;
 
-                now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
-                ms = (ngx_msec_int_t) (now - lr->last);
+    dq = rctx->delay;
 
-                /* block check */
-                if (lr->block_stop_time >= now_sec) {
-                    *bst = lr->block_stop_time;
-                    return NGX_BUSY;
-                }
+    if (dq == NULL) {
+        return;
+    }
 
-                excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
+    ngx_queue_remove(&rctx->queue);
+    rctx->delay = NULL;
 
-                if (excess < 0) {
-                    excess = 0;
-                }
+    if (--dq->ndelayed == 0 && dq->event.timer_set) {
+        ngx_del_timer(&dq->event);
+    }
+}
 
-                *ep = excess;
-
-                if ((ngx_uint_t) excess > limit_req2->burst) {
-
-                    /* stat for block */
-                    stat_times = limit_req2->block_stat_times;
-
-                    if (stat_times != 0) {
-
-                        stat_interval = limit_req2->block_stat_interval;
-                        diff = now_sec - lr->block_stat_base;
-
-                        if (diff >= stat_interval * stat_times) {
-
-                            lr->block_stat_base = now_sec;
-                            lr->block_stat = 1;
-
-                        } else if (diff >= (stat_times-1) * stat_interval) {
-
-                            set_stat_bit(&lr->block_stat,
-                                                        stat_times - 1, 1);
-                            check_all_bit = 1;
-                            last_zero_pos = 0;
-
-                            for (j = 0; j < stat_times - 1; ++j) {
-                                if (!get_stat_bit(lr->block_stat, j)) {
-                                    check_all_bit = 0;
-                                    last_zero_pos = j;
-                                }
-                            }
-
-                            if (check_all_bit) {
-                                /* auto block */
-                                lr->block_stop_time = now_sec
-                                                + limit_req2->block_time;
-
-                                lr->block_stat >>= 1;
-                                lr->block_stat_base += stat_interval;
-                            } else {
-                                lr->block_stat >>= last_zero_pos + 1;
-                                lr->block_stat_base += (last_zero_pos + 1)
-                                    * stat_interval;
-                            }
-                        } else {
-                            set_stat_bit(&lr->block_stat,
-                                        diff / stat_interval, 1);
-                        }
-
-                        ngx_log_debug4(NGX_LOG_DEBUG_HTTP,
-                                r->connection->log, 0,
-                                "limit_req2 now_sec: %ui "
-                                "block stop_time: %ui "
-                                "block_stat_base: %ui "
-                                "block stat: %ul ",
-                                now_sec, lr->block_stop_time,
-                                lr->block_stat_base, lr->block_stat);
-                    }
-
-                    return NGX_BUSY;
-                }
 
-                if (limit_req2->rate_seg != 0) {
-                    last_rate_seg = lr->last / limit_req2->rate_seg;
-                    curr_rate_seg = now / limit_req2->rate_seg;
-                    if (curr_rate_seg > last_rate_seg + 1) {
+/*
+ * Background expiry: every worker walks the shards of a zone once per
+ * "sweep" period, starting from a different shard, and expires a bounded
+ * batch of stale entries in each shard it can lock without waiting.
+ */
 
-                        lr->last_seg = 0;
-                        lr->curr_seg = 1;
+static void
+ngx_http_limit_req2_sweep(ngx_event_t *ev)
+{
+    ngx_uint_t                    i, k;
+    ngx_http_limit_req2_ctx_t    *ctx;
+    ngx_http_limit_req2_shard_t  *shard;
 
-                    } else if (curr_rate_seg == last_rate_seg + 1) {
+    ctx = ev->data;
 
-                        lr->last_seg = lr->curr_seg;
-                        lr->curr_seg = 1;
+    for (k = 0; k < ctx->sh->nshards; k++) {
 
-                    } else if (curr_rate_seg == last_rate_seg) {
+        i = (k + ngx_worker) % ctx->sh->nshards;
+        shard = ctx->sh->shards[i];
 
-                        ++lr->curr_seg;
+        /* the batches are the longest holds, lock_stats records them */
 
-                    } else {
-                        /* never appear */
-                        lr->last_seg = 0;
-                        lr->curr_seg = 0;
-                    }
+        if (!ngx_http_limit_req2_trylock(ctx, shard, 0)) {
+            continue;
+        }
 
-                    *last_seg = lr->last_seg;
-                    *curr_seg = lr->curr_seg;
-                    *curr_seg_time_diff = now % limit_req2->rate_seg;
-                }
+        ngx_http_limit_req2_expire(ctx, shard, 1, LIMIT_REQ2_SWEEP_BATCH);
 
-                lr->excess = excess;
-                lr->last = now;
+        ngx_http_limit_req2_unlock(ctx, shard);
+    }
 
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, ctx->sweep);
+    }
+}
 
-                if (excess) {
-                    return NGX_AGAIN;
 
-                }
+/*
+ * persist=: worker 0 writes a snapshot of the zone every persist_interval
+ * and once more as it exits, see ngx_http_limit_req2_snapshot().  A turn
+ * of the timer writes a part of the snapshot only, the next part follows
+ * after LIMIT_REQ2_PERSIST_STEP, so that requests are served in between.
+ */
 
-                return NGX_OK;
-            }
-        }
+static void
+ngx_http_limit_req2_persist(ngx_event_t *ev)
+{
+    ngx_int_t                        rc;
+    ngx_http_limit_req2_ctx_t       *ctx;
+    ngx_http_limit_req2_snapshot_t  *snap;
+
+    ctx = ev->data;
+    snap = ctx->snapshot;
 
-        node = (rc < 0) ? node->left : node->right;
+    rc = ngx_http_limit_req2_snapshot(ctx, snap, ev->log);
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, (rc == NGX_AGAIN) ? LIMIT_REQ2_PERSIST_STEP
+                                            : ctx->persist_interval);
     }
+}
 
-    *ep = 0;
 
-    *last_seg = 0;
-    *curr_seg = 1;
-    *curr_seg_time_diff = 0;
+/*
+ * The key of secret= as HMAC-SHA1 (RFC 2104) uses it: a key longer than
+ * a block is hashed, the inner and outer pads are hashed once here and
+ * the state is copied for every datagram.
+ */
+
+static void
+ngx_http_limit_req2_replicate_secret(ngx_http_limit_req2_peers_t *peers,
+    ngx_str_t *secret)
+{
+    u_char      key[64], pad[64];
+    ngx_uint_t  i;
+    ngx_sha1_t  sha1;
 
-    return NGX_DECLINED;
+    ngx_memzero(key, sizeof(key));
+
+    if (secret->len > sizeof(key)) {
+        ngx_sha1_init(&sha1);
+        ngx_sha1_update(&sha1, secret->data, secret->len);
+        ngx_sha1_final(key, &sha1);
+
+    } else {
+        ngx_memcpy(key, secret->data, secret->len);
+    }
+
+    for (i = 0; i < sizeof(key); i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+
+    ngx_sha1_init(&peers->ipad);
+    ngx_sha1_update(&peers->ipad, pad, sizeof(pad));
+
+    for (i = 0; i < sizeof(key); i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+
+    ngx_sha1_init(&peers->opad);
+    ngx_sha1_update(&peers->opad, pad, sizeof(pad));
 }
 
 
 static void
-ngx_http_limit_req2_expire(ngx_http_request_t *r,
-    ngx_http_limit_req2_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req2_replicate_mac(ngx_http_limit_req2_peers_t *peers,
+    u_char *p, size_t len, u_char *mac)
 {
-    ngx_int_t                   excess;
-    ngx_time_t                 *tp;
-    ngx_msec_t                  now;
-    ngx_queue_t                *q;
-    ngx_msec_int_t              ms;
-    ngx_rbtree_node_t          *node;
-    ngx_http_limit_req2_node_t *lr;
-    ngx_http_limit_req2_node_t *first_lr;
-    ngx_uint_t                  m;
+    ngx_sha1_t  sha1;
 
-    tp = ngx_timeofday();
+    sha1 = peers->ipad;
+    ngx_sha1_update(&sha1, p, len);
+    ngx_sha1_final(mac, &sha1);
 
-    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+    sha1 = peers->opad;
+    ngx_sha1_update(&sha1, mac, LIMIT_REQ2_REPLICATE_MAC);
+    ngx_sha1_final(mac, &sha1);
+}
 
-    /*
-     * n == 1 deletes one or two zero rate entries
-     * n == 0 deletes oldest entry by force
-     *        and one or two zero rate entries
-     */
 
-    m = 0;
-    first_lr = NULL;
+/* n bytes of the value, most significant first */
 
-    while (n < 3) {
+static u_char *
+ngx_http_limit_req2_replicate_put(u_char *p, uint64_t value, ngx_uint_t n)
+{
+    while (n--) {
+        *p++ = (u_char) (value >> (n * 8));
+    }
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
-            return;
-        }
+    return p;
+}
 
-        q = ngx_queue_last(&ctx->sh->queue);
 
-        lr = ngx_queue_data(q, ngx_http_limit_req2_node_t, queue);
+static uint64_t
+ngx_http_limit_req2_replicate_get(u_char *p, ngx_uint_t n)
+{
+    uint64_t  value;
+
+    value = 0;
 
-        if (lr->block_stop_time > (ngx_uint_t)tp->sec
-                && first_lr != lr && m++ < 100) {
+    while (n--) {
+        value = value << 8 | *p++;
+    }
 
-            ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    return value;
+}
 
-            continue;
-        }
 
-        if (m == 1) {
-            first_lr = lr;
+/*
+ * replicate: sends the changes the worker queued in a zone to every peer,
+ * in as many datagrams as they take; the changes of a datagram that could
+ * not be sent to a peer are dropped for that peer.
+ */
+
+static void
+ngx_http_limit_req2_replicate_send(ngx_http_limit_req2_peers_t *peers,
+    ngx_shm_zone_t *shm_zone)
+{
+    u_char                           *p, *pos, *start, *end;
+    size_t                            size;
+    uint32_t                          now;
+    ngx_err_t                         err;
+    ngx_uint_t                        i, n;
+    ngx_addr_t                       *peer;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_stats_t      *stats;
+    ngx_http_limit_req2_replicate_t  *rp;
+    u_char                            buf[LIMIT_REQ2_REPLICATE_DATAGRAM];
+
+    ctx = shm_zone->data;
+    rp = ctx->replicate;
+    stats = ngx_http_limit_req2_worker_stats(ctx);
+
+    p = buf;
+
+    *p++ = (u_char) (LIMIT_REQ2_REPLICATE_MAGIC >> 24);
+    *p++ = (u_char) (LIMIT_REQ2_REPLICATE_MAGIC >> 16);
+    *p++ = (u_char) (LIMIT_REQ2_REPLICATE_MAGIC >> 8);
+    *p++ = (u_char) LIMIT_REQ2_REPLICATE_MAGIC;
+    *p++ = LIMIT_REQ2_REPLICATE_VERSION;
+    *p++ = (u_char) shm_zone->shm.name.len;
+
+    (void) ngx_http_limit_req2_replicate_put(p, peers->id, 8);
+
+    start = ngx_cpymem(buf + LIMIT_REQ2_REPLICATE_PREFIX,
+                       shm_zone->shm.name.data, shm_zone->shm.name.len);
+    end = buf + sizeof(buf) - LIMIT_REQ2_REPLICATE_MAC;
+
+    now = (uint32_t) ngx_time();
+
+    peer = peers->peers.elts;
+    pos = rp->start;
+
+    while (pos < rp->last) {
+
+        /* a sender that runs out of sequence numbers starts anew */
+
+        if (++peers->seq == 0) {
+            peers->id++;
+            peers->seq = 1;
+            (void) ngx_http_limit_req2_replicate_put(buf + 6, peers->id, 8);
         }
 
-        if (n++ != 0) {
+        (void) ngx_http_limit_req2_replicate_put(buf + 14, peers->seq, 4);
+        (void) ngx_http_limit_req2_replicate_put(buf + 18, now, 4);
 
-            ms = (ngx_msec_int_t) (now - lr->last);
-            ms = ngx_abs(ms);
+        p = start;
+        n = 0;
 
-            if (ms < 60000) {
-                return;
+        while (pos < rp->last) {
+            size = ngx_http_limit_req2_replicate_size(pos);
+
+            if ((size_t) (end - p) < size) {
+                break;
             }
 
-            excess = lr->excess - ctx->rate * ms / 1000;
+            p = ngx_cpymem(p, pos, size);
+            pos += size;
+            n++;
+        }
+
+        ngx_http_limit_req2_replicate_mac(peers, buf, p - buf, p);
+        p += LIMIT_REQ2_REPLICATE_MAC;
 
-            if (excess > 0) {
-                return;
+        for (i = 0; i < peers->peers.nelts; i++) {
+
+            if (sendto(peers->fd, buf, p - buf, 0, peer[i].sockaddr,
+                       peer[i].socklen)
+                == -1)
+            {
+                err = ngx_socket_errno;
+
+                if (err != NGX_EAGAIN) {
+                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, err,
+                                  "limit_req2 sendto() to %V failed",
+                                  &peer[i].name);
+                }
+
+                (void) ngx_atomic_fetch_add(&stats->replicate_dropped, n);
+                continue;
             }
+
+            (void) ngx_atomic_fetch_add(&stats->replicate_sent, n);
         }
+    }
+
+    rp->last = rp->start;
+}
+
+
+static void
+ngx_http_limit_req2_replicate_flush(ngx_http_limit_req2_main_conf_t *lmcf)
+{
+    ngx_uint_t                   i;
+    ngx_shm_zone_t             **zones;
+    ngx_http_limit_req2_ctx_t   *ctx;
 
-        ngx_queue_remove(q);
+    zones = lmcf->zones.elts;
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        if (ctx->deltas) {
+            ngx_http_limit_req2_cluster_collect(ctx);
+        }
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        if (ctx->replicate && ctx->replicate->last != ctx->replicate->start) {
+            ngx_http_limit_req2_replicate_send(lmcf->peers, zones[i]);
+        }
     }
 }
 
 
+/*
+ * Opens the socket of worker 0 on the listen address.  The address may
+ * still be held by the worker 0 of the previous cycle, so a failure is
+ * logged once and the bind is tried again every interval.
+ */
+
 static ngx_int_t
-ngx_http_limit_req2_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+ngx_http_limit_req2_replicate_listen(ngx_http_limit_req2_main_conf_t *lmcf,
+    ngx_log_t *log)
 {
-    ngx_http_limit_req2_ctx_t  *octx = data;
+    ngx_socket_t                  s;
+    ngx_connection_t             *c;
+    ngx_http_limit_req2_peers_t  *peers;
 
-    size_t                       len;
-    ngx_uint_t                   i, j;
-    ngx_http_limit_req2_ctx_t    *ctx;
-    ngx_http_limit_req2_variable_t *v1, *v2;
+    peers = lmcf->peers;
 
-    ctx = shm_zone->data;
-    v1 = ctx->limit_vars->elts;
-
-    if (octx) {
-        v2 = octx->limit_vars->elts;
-        if (ctx->limit_vars->nelts != octx->limit_vars->nelts) {
-            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                          "limit_req2 \"%V\" uses the \"%V\" variable "
-                          "while previously it used the \"%V\" variable",
-                          &shm_zone->shm.name, &v1[0].var, &v2[0].var);
-            return NGX_ERROR;
+    s = ngx_socket(peers->listen.sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    if (bind(s, peers->listen.sockaddr, peers->listen.socklen) == -1) {
+
+        if (!peers->bind_failed) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno,
+                          "limit_req2 bind() to %V failed, retrying",
+                          &peers->listen.name);
+            peers->bind_failed = 1;
         }
 
-        for (i = 0, j = 0;
-             i < ctx->limit_vars->nelts && j < octx->limit_vars->nelts;
-             i++, j++)
-        {
-            if (ngx_strcmp(v1[i].var.data, v2[j].var.data) != 0) {
-                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                              "limit_req2 \"%V\" uses the \"%V\" variable "
-                              "while previously it used the \"%V\" variable",
-                              &shm_zone->shm.name, &v1[i].var,
-                              &v2[j].var);
-                return NGX_ERROR;
-            }
+        goto failed;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->type = SOCK_DGRAM;
+    c->data = lmcf;
+    c->log = log;
+    c->read->log = log;
+    c->read->handler = ngx_http_limit_req2_replicate_read;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    if (peers->bind_failed) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "limit_req2 receiving on %V", &peers->listen.name);
+        peers->bind_failed = 0;
+    }
+
+    peers->connection = c;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_limit_req2_replicate_timer(ngx_event_t *ev)
+{
+    ngx_http_limit_req2_peers_t      *peers;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
+
+    lmcf = ev->data;
+    peers = lmcf->peers;
+
+    ngx_http_limit_req2_replicate_flush(lmcf);
+
+    if (ngx_exiting) {
+
+        /* the worker 0 of the next cycle takes the listen address over */
+
+        if (peers->connection) {
+            ngx_close_connection(peers->connection);
+            peers->connection = NULL;
         }
 
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+        return;
+    }
 
-        return NGX_OK;
+    if (ngx_worker == 0 && peers->listen.sockaddr
+        && peers->connection == NULL)
+    {
+        (void) ngx_http_limit_req2_replicate_listen(lmcf, ev->log);
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ngx_add_timer(ev, peers->interval);
+}
 
-    if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
 
-        return NGX_OK;
+/*
+ * Accepts a sequence number of a sender once: a sender not seen yet takes
+ * the slot of the one of the peer seen least recently, a number more than
+ * 64 behind the highest one of the sender is taken as replayed.  A sender
+ * not seen yet is refused datagrams not later than those of the senders
+ * forgotten, they may be replays of a forgotten one.
+ */
+
+static ngx_int_t
+ngx_http_limit_req2_replicate_replay(ngx_http_limit_req2_peers_t *peers,
+    ngx_uint_t peer, uint64_t id, uint32_t seq, time_t sent)
+{
+    uint32_t                       d;
+    ngx_uint_t                     i;
+    ngx_http_limit_req2_sender_t  *senders, *sender, *oldest;
+
+    senders = peers->senders + peer * peers->nsenders;
+    oldest = &senders[0];
+
+    for (i = 0; i < peers->nsenders; i++) {
+        sender = &senders[i];
+
+        if (sender->seen && sender->id == id) {
+            goto found;
+        }
+
+        if (sender->seen < oldest->seen) {
+            oldest = sender;
+        }
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req2_shctx_t));
-    if (ctx->sh == NULL) {
-        return NGX_ERROR;
+    if (sent <= peers->evicted[peer]) {
+        return NGX_DECLINED;
     }
 
-    ctx->shpool->data = ctx->sh;
+    sender = oldest;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req2_rbtree_insert_value);
+    if (sender->seen) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "limit_req2 replicate forgets sender %uL of peer %ui",
+                      sender->id, peer);
 
-    ngx_queue_init(&ctx->sh->queue);
+        if (sender->sent > peers->evicted[peer]) {
+            peers->evicted[peer] = sender->sent;
+        }
+    }
 
-    len = sizeof(" in limit_req2 zone \"\"") + shm_zone->shm.name.len;
+    sender->id = id;
+    sender->seq = seq;
+    sender->window = 1;
+    sender->sent = sent;
+    sender->seen = ngx_time();
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+    return NGX_OK;
+
+found:
+
+    if (seq > sender->seq) {
+        d = seq - sender->seq;
+        sender->window = (d < 64) ? sender->window << d | 1 : 1;
+        sender->seq = seq;
+
+    } else {
+        d = sender->seq - seq;
+
+        if (d >= 64 || (sender->window >> d & 1)) {
+            return NGX_DECLINED;
+        }
+
+        sender->window |= (uint64_t) 1 << d;
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req2 zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    if (sent > sender->sent) {
+        sender->sent = sent;
+    }
 
-    ctx->shpool->log_nomem = 0;
+    sender->seen = ngx_time();
 
     return NGX_OK;
 }
 
 
+/*
+ * Applies a datagram of a peer.  Datagrams from other addresses, of other
+ * versions, or of zones without "replicate" here are ignored; those that
+ * fail the HMAC, are too far off in time or were already received are
+ * dropped.
+ */
+
+static void
+ngx_http_limit_req2_replicate_recv(ngx_http_limit_req2_main_conf_t *lmcf,
+    struct sockaddr *sockaddr, socklen_t socklen, u_char *p, size_t n)
+{
+    u_char                       *last, *start, *reason;
+    size_t                        len;
+    time_t                        sent;
+    uint64_t                      id;
+    uint32_t                      seq;
+    ngx_str_t                     name;
+    ngx_uint_t                    i, k, diff;
+    ngx_addr_t                   *peer;
+    ngx_shm_zone_t              **zones;
+    ngx_http_limit_req2_ctx_t    *ctx;
+    ngx_http_limit_req2_peers_t  *peers;
+    u_char                        mac[LIMIT_REQ2_REPLICATE_MAC];
+    u_char                        text[NGX_SOCKADDR_STRLEN];
+
+    peers = lmcf->peers;
+    peer = peers->peers.elts;
+
+    for (k = 0; k < peers->peers.nelts; k++) {
+        if (ngx_cmp_sockaddr(sockaddr, socklen, peer[k].sockaddr,
+                             peer[k].socklen, 0)
+            == NGX_OK)
+        {
+            break;
+        }
+    }
+
+    if (k == peers->peers.nelts) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "limit_req2 replicate datagram not from a peer");
+        return;
+    }
+
+    start = p;
+    reason = (u_char *) "malformed";
+
+    if (n < LIMIT_REQ2_REPLICATE_PREFIX + LIMIT_REQ2_REPLICATE_MAC
+        || ngx_http_limit_req2_replicate_get(p, 4)
+           != LIMIT_REQ2_REPLICATE_MAGIC
+        || p[4] != LIMIT_REQ2_REPLICATE_VERSION
+        || n < (size_t) LIMIT_REQ2_REPLICATE_PREFIX + p[5]
+               + LIMIT_REQ2_REPLICATE_MAC)
+    {
+        goto invalid;
+    }
+
+    last = p + n - LIMIT_REQ2_REPLICATE_MAC;
+
+    ngx_http_limit_req2_replicate_mac(peers, start, last - start, mac);
+
+    /* in constant time */
+
+    diff = 0;
+
+    for (i = 0; i < LIMIT_REQ2_REPLICATE_MAC; i++) {
+        diff |= mac[i] ^ last[i];
+    }
+
+    if (diff) {
+        reason = (u_char *) "unauthenticated";
+        goto invalid;
+    }
+
+    id = ngx_http_limit_req2_replicate_get(p + 6, 8);
+    seq = (uint32_t) ngx_http_limit_req2_replicate_get(p + 14, 4);
+    sent = (time_t) ngx_http_limit_req2_replicate_get(p + 18, 4);
+
+    if (sent < ngx_time() - LIMIT_REQ2_REPLICATE_SKEW
+        || sent > ngx_time() + LIMIT_REQ2_REPLICATE_SKEW)
+    {
+        reason = (u_char *) "stale";
+        goto invalid;
+    }
+
+    if (ngx_http_limit_req2_replicate_replay(peers, k, id, seq, sent)
+        != NGX_OK)
+    {
+        reason = (u_char *) "replayed";
+        goto invalid;
+    }
+
+    name.len = p[5];
+    name.data = p + LIMIT_REQ2_REPLICATE_PREFIX;
+
+    p += LIMIT_REQ2_REPLICATE_PREFIX + name.len;
+
+    zones = lmcf->zones.elts;
+
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
+
+        if (ctx->replicate
+            && zones[i]->shm.name.len == name.len
+            && ngx_strncmp(zones[i]->shm.name.data, name.data, name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == lmcf->zones.nelts) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "limit_req2 replicate zone \"%V\" not replicated",
+                       &name);
+        return;
+    }
+
+    if (ngx_http_limit_req2_replicate_apply(ctx, p, last) == NGX_OK) {
+        return;
+    }
+
+invalid:
+
+    len = ngx_sock_ntop(sockaddr, socklen, text, NGX_SOCKADDR_STRLEN, 1);
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "limit_req2 %s replicate datagram from %*s",
+                  reason, len, text);
+}
+
+
+static void
+ngx_http_limit_req2_replicate_read(ngx_event_t *rev)
+{
+    ssize_t            n;
+    socklen_t          socklen;
+    ngx_err_t          err;
+    ngx_uint_t         i;
+    ngx_sockaddr_t     sa;
+    ngx_connection_t  *c;
+    u_char             buf[LIMIT_REQ2_REPLICATE_DATAGRAM];
+
+    c = rev->data;
+
+    for (i = 0; i < LIMIT_REQ2_REPLICATE_READS; i++) {
+
+        socklen = sizeof(ngx_sockaddr_t);
+
+        n = recvfrom(c->fd, buf, sizeof(buf), 0, &sa.sockaddr, &socklen);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, rev->log, err,
+                              "limit_req2 recvfrom() failed");
+            }
+
+            rev->ready = 0;
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ALERT, rev->log, 0,
+                              "limit_req2 could not wait for datagrams");
+            }
+
+            return;
+        }
+
+        ngx_http_limit_req2_replicate_recv(c->data, &sa.sockaddr, socklen,
+                                           buf, n);
+    }
+
+    /* there may be more, the other events of the loop go first */
+
+    ngx_post_event(rev, &ngx_posted_events);
+}
+
+
 static ngx_int_t
 ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
 {
-    size_t                         n, total_len;
-    uint32_t                       hash;
     ngx_int_t                      rc;
     ngx_int_t                      block_action;
-    ngx_uint_t                     excess;
     ngx_uint_t                     block_stop_time = 0;
-    ngx_time_t                    *tp;
     ngx_rbtree_node_t             *node;
     ngx_http_limit_req2_ctx_t      *ctx;
+    ngx_http_limit_req2_ban_t      *ban;
     ngx_http_limit_req2_node_t     *lr;
     ngx_http_limit_req2_conf_t     *lrcf;
+    ngx_http_limit_req2_shard_t    *shard;
+    ngx_http_limit_req2_key_t       key;
     ngx_buf_t                      *b;
-    ngx_chain_t                    out;
-
-    ngx_uint_t                     last_seg, curr_seg, curr_seg_time_diff;
 
     lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_req2_module);
 
@@ -1076,6 +1801,21 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
+    if (lrcf->block_action == LIMIT_REQ2_BLOCK_ACTION_DUMP) {
+        return ngx_http_limit_req2_dump(r, lrcf);
+    }
+
+    if (lrcf->block_bulk) {
+        rc = ngx_http_read_client_request_body(r,
+                                               ngx_http_limit_req2_bulk_body);
+
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+
+        return NGX_DONE;
+    }
+
     rc = ngx_http_discard_request_body(r);
     if (rc != NGX_OK) {
         return rc;
@@ -1089,17 +1829,19 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
     block_action = lrcf->block_action;
     ctx = lrcf->block_shm_zone->data;
 
-    ngx_crc32_init(hash);
+    rc = ngx_http_limit_req2_get_key(r, lrcf->block_limit_vars, ctx->hash,
+                                     &key);
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    total_len = 0;
-    total_len = ngx_http_limit_req2_copy_variables(r, &hash,
-            lrcf->block_limit_vars, NULL);
+    shard = NULL;
 
-    if (total_len != 0) {
-        ngx_crc32_final(hash);
+    if (rc == NGX_OK) {
+        shard = ngx_http_limit_req2_shard(ctx, key.hash);
     }
 
-    if (total_len == 0) {
+    if (rc == NGX_DECLINED) {
         ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
                         "limit_req2_block limit vars is empty");
 
@@ -1109,15 +1851,17 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
 
     } else if (block_action == LIMIT_REQ2_BLOCK_ACTION_QUERY) { /* query */
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
-        rc = ngx_http_limit_req2_lookup(r,
-                NULL, hash, &excess,
-                &block_stop_time,
-                &last_seg, &curr_seg, &curr_seg_time_diff,
-                block_action);
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        (void) ngx_http_limit_req2_lock(ctx, shard);
 
-        if (rc == NGX_OK) {
+        ban = ngx_http_limit_req2_ban_find(shard, &key);
+
+        if (ban && ban->expire.key > (ngx_uint_t) ngx_time()) {
+            block_stop_time = ban->expire.key;
+        }
+
+        ngx_http_limit_req2_unlock(ctx, shard);
+
+        if (ban) {
             ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
                             "limit_req2_block_query, "
                             "block_stop_time: %ui "
@@ -1126,7 +1870,7 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
                             &lrcf->block_shm_zone->shm.name);
         } else {
             ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                            "limit_req2_block_query not exists node, "
+                            "limit_req2_block_query not exists ban, "
                             "zone: \"%V\"",
                             &lrcf->block_shm_zone->shm.name);
         }
@@ -1135,87 +1879,62 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
                 "{\"ret\": true, \"block_stop_time\": %ui}", block_stop_time);
 
     } else if (block_action == LIMIT_REQ2_BLOCK_ACTION_SET) { /* set */
-        ngx_shmtx_lock(&ctx->shpool->mutex);
-        rc = ngx_http_limit_req2_lookup(r,
-                NULL, hash, &excess,
-                &block_stop_time,
-                &last_seg, &curr_seg, &curr_seg_time_diff,
-                block_action);
-
-        if (rc == NGX_DECLINED) {
-            n = offsetof(ngx_rbtree_node_t, color)
-                + offsetof(ngx_http_limit_req2_node_t, data)
-                + total_len;
-
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
-            if (node == NULL) {
-                ngx_http_limit_req2_expire(r, ctx, 0);
-                node = ngx_slab_alloc_locked(ctx->shpool, n);
-                if (node == NULL) {
-                    ngx_shmtx_unlock(&ctx->shpool->mutex);
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
-            }
 
-            lr = (ngx_http_limit_req2_node_t *) &node->color;
+        block_stop_time = ngx_time() + lrcf->block_time;
 
-            node->key = hash;
-            lr->len = (u_char) total_len;
+        (void) ngx_http_limit_req2_lock(ctx, shard);
 
-            tp = ngx_timeofday();
-            lr->last = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+        ban = ngx_http_limit_req2_ban_find(shard, &key);
 
-            lr->excess = 0;
-            lr->block_stat = 0;
-            lr->block_stat_base = 0;
-            lr->block_stop_time = tp->sec + lrcf->block_time;
+        rc = ngx_http_limit_req2_ban_set(ctx, shard, &key, block_stop_time);
 
-            block_stop_time = tp->sec + lrcf->block_time;
+        if (rc == NGX_OK) {
+            node = ngx_http_limit_req2_find(ctx, shard, &key, 0);
 
-            ngx_http_limit_req2_copy_variables(r, &hash,
-                                               lrcf->block_limit_vars, lr);
+            if (node) {
+                lr = (ngx_http_limit_req2_node_t *) &node->color;
+                lr->block_stop = ngx_http_limit_req2_zone_sec(ctx,
+                                                             block_stop_time);
+            }
 
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+            if (ctx->replicate) {
+                ngx_http_limit_req2_replicate_add(ctx,
+                                                  LIMIT_REQ2_REPLICATE_SET,
+                                                  &key, lrcf->block_time);
+            }
+        }
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_http_limit_req2_unlock(ctx, shard);
 
-            ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                        "limit_req2_block_set not exists but create new node, "
+        if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                        "limit_req2_block_set %s ban, "
                         "block_stop_time: %ui "
-                        "now_sec: %ui "
                         "block_time: %ui "
                         "zone: \"%V\"",
-                        lr->block_stop_time,
-                        tp->sec,
+                        ban ? "exists" : "new",
+                        block_stop_time,
                         lrcf->block_time,
                         &lrcf->block_shm_zone->shm.name);
 
-        } else {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-
-            ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                            "limit_req2_block_set exists node, "
-                            "block_stop_time: %ui "
-                            "block_time: %ui "
-                            "zone: \"%V\"",
-                            block_stop_time,
-                            lrcf->block_time,
-                            &lrcf->block_shm_zone->shm.name);
-        }
-
         b->last = ngx_sprintf(b->last,
             "{\"ret\": true, \"block_stop_time\": %ui, \"block_time\": %ui}",
             block_stop_time, lrcf->block_time);
 
     } else if (block_action == LIMIT_REQ2_BLOCK_ACTION_CLEAR) { /*clear*/
-        ngx_shmtx_lock(&ctx->shpool->mutex);
-        rc = ngx_http_limit_req2_lookup(r,
-                NULL, hash, &excess,
-                &block_stop_time,
-                &last_seg, &curr_seg, &curr_seg_time_diff,
-                block_action);
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        (void) ngx_http_limit_req2_lock(ctx, shard);
+        rc = ngx_http_limit_req2_ban_clear(ctx, shard, &key);
+        ngx_http_limit_req2_unlock(ctx, shard);
+
+        /* a peer may have the ban even if this node does not */
+
+        if (ctx->replicate) {
+            ngx_http_limit_req2_replicate_add(ctx, LIMIT_REQ2_REPLICATE_CLEAR,
+                                              &key, 0);
+        }
 
         if (rc == NGX_OK) {
             ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
@@ -1239,6 +1958,16 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
                 "{\"ret\": false}", sizeof("{\"ret\": false}") - 1);
     }
 
+    return ngx_http_limit_req2_send_json(r, b);
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_send_json(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t     rc;
+    ngx_chain_t   out;
+
     ngx_str_set(&r->headers_out.content_type, "application/json;charset=UTF-8");
 
     if (r->method == NGX_HTTP_HEAD) {
@@ -1270,248 +1999,2088 @@ ngx_http_limit_req2_block_handler(ngx_http_request_t *r)
     return ngx_http_output_filter(r, &out);
 }
 
-static void *
-ngx_http_limit_req2_create_conf(ngx_conf_t *cf)
+
+/* the end of a JSON string, its escapes are unescaped in place */
+
+static ngx_int_t
+ngx_http_limit_req2_bulk_string(u_char **pos, u_char *last, ngx_str_t *s)
 {
-    ngx_http_limit_req2_conf_t  *conf;
+    u_char  *p, *dst, *end;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req2_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    for (end = *pos + 1; end < last && *end != '"'; end++) {
+        if (*end == '\\') {
+            end++;
+        }
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->shm_zone = NULL;
-     *     conf->burst = 0;
-     *     conf->nodelay = 0;
-     */
+    if (end >= last) {
+        return NGX_AGAIN;
+    }
 
-    conf->enable = NGX_CONF_UNSET;
-    conf->limit_log_level = NGX_CONF_UNSET_UINT;
-    conf->status_code = NGX_CONF_UNSET_UINT;
-    conf->geo_var_index = NGX_CONF_UNSET;
+    s->data = *pos + 1;
+    dst = s->data;
 
-    conf->block_action = NGX_CONF_UNSET;
-    conf->block_time = 1800;
-    conf->block_shm_zone = NULL;
-    conf->block_limit_vars = NULL;
+    *pos = end + 1;
 
-    conf->enable_record_rate = 0;
+    for (p = s->data; p < end; p++) {
+        if (*p == '\\') {
+            p++;
 
-    return conf;
+            if (*p != '"' && *p != '\\' && *p != '/') {
+                return NGX_ERROR;
+            }
+        }
+
+        *dst++ = *p;
+    }
+
+    s->len = dst - s->data;
+
+    return NGX_OK;
 }
 
 
-static char *
-ngx_http_limit_req2_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+/* {"key": "...", "block_time": N}, the object is complete in the window */
+
+static ngx_int_t
+ngx_http_limit_req2_bulk_object(u_char *p, u_char *last, ngx_str_t *key,
+    ngx_int_t *block_time)
 {
-    ngx_http_limit_req2_conf_t *prev = parent;
-    ngx_http_limit_req2_conf_t *conf = child;
+    u_char     *start;
+    ngx_str_t   name, value;
 
-    if (conf->rules == NULL) {
-        conf->rules = prev->rules;
-    }
+    p++;
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    for ( ;; ) {
 
-    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
-                              NGX_LOG_ERR);
+        while (p < last && (*p == ' ' || *p == '\t' || *p == '\r'
+                            || *p == '\n' || *p == ','))
+        {
+            p++;
+        }
 
-    conf->delay_log_level = (conf->limit_log_level == NGX_LOG_INFO) ?
-                                NGX_LOG_INFO : conf->limit_log_level + 1;
+        if (p == last || *p == '}') {
+            return key->data ? NGX_OK : NGX_DECLINED;
+        }
 
-    ngx_conf_merge_uint_value(conf->status_code, prev->status_code,
-                              NGX_HTTP_SERVICE_UNAVAILABLE);
+        if (*p != '"'
+            || ngx_http_limit_req2_bulk_string(&p, last, &name) != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
 
-    ngx_conf_merge_value(conf->geo_var_index, prev->geo_var_index,
-                         NGX_CONF_UNSET);
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ':')) {
+            p++;
+        }
 
-    ngx_conf_merge_str_value(conf->geo_var_value, prev->geo_var_value, "");
+        if (p < last && *p == '"') {
+            if (ngx_http_limit_req2_bulk_string(&p, last, &value) != NGX_OK) {
+                return NGX_DECLINED;
+            }
 
-    ngx_conf_merge_value(conf->block_action, prev->block_action, 0);
+        } else {
+            for (start = p; p < last && *p >= '0' && *p <= '9'; p++) {
+                /* void */
+            }
 
-    ngx_conf_merge_value(conf->block_time, prev->block_time, 1800);
+            value.data = start;
+            value.len = p - start;
+        }
 
-    if (conf->block_shm_zone == NULL) {
-        conf->block_shm_zone = prev->block_shm_zone;
-    }
+        if (name.len == 3 && ngx_strncmp(name.data, "key", 3) == 0) {
+            *key = value;
 
-    if (conf->block_limit_vars == NULL) {
-        conf->block_limit_vars = prev->block_limit_vars;
-    }
+        } else if (name.len == 10
+                   && ngx_strncmp(name.data, "block_time", 10) == 0)
+        {
+            *block_time = ngx_atoi(value.data, value.len);
 
-    return NGX_CONF_OK;
+            if (*block_time <= 0) {
+                return NGX_DECLINED;
+            }
+
+        } else {
+            return NGX_DECLINED;
+        }
+    }
 }
 
 
-static char *
-ngx_http_limit_req2_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+/*
+ * The next key of a bulk body, a line "key [block_time]" or an element
+ * of a JSON array, "key" or {"key": "key", "block_time": N}.  NGX_AGAIN
+ * asks for more of the body, NGX_DECLINED skips an invalid element and
+ * NGX_DONE is the end of the body.
+ */
+
+static ngx_int_t
+ngx_http_limit_req2_bulk_parse(ngx_http_limit_req2_bulk_t *bk,
+    ngx_uint_t last_buf, ngx_str_t *key, ngx_int_t *block_time)
 {
-    u_char                         *p;
-    size_t                          len;
-    ssize_t                         size;
-    ngx_str_t                      *value, name, s;
-    ngx_int_t                       rate, scale;
-    ngx_uint_t                      i;
-    ngx_array_t                    *variables;
-    ngx_shm_zone_t                 *shm_zone;
-    ngx_http_limit_req2_ctx_t      *ctx;
-    ngx_http_limit_req2_variable_t *v;
+    u_char      *p, *last, *eol, *start;
+    ngx_int_t    rc;
+    ngx_uint_t   depth, quoted;
 
-    value = cf->args->elts;
+    last = bk->last;
 
-    ctx = NULL;
-    v = NULL;
-    size = 0;
-    rate = 1;
-    scale = 1;
-    name.len = 0;
+    for ( ;; ) {
 
-    variables = ngx_array_create(cf->pool, 5,
-                                 sizeof(ngx_http_limit_req2_variable_t));
-    if (variables == NULL) {
-        return NGX_CONF_ERROR;
-    }
+        for (p = bk->pos; p < last; p++) {
+            if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'
+                && (*p != ',' || bk->format != LIMIT_REQ2_BULK_JSON))
+            {
+                break;
+            }
+        }
 
-    for (i = 1; i < cf->args->nelts; i++) {
+        bk->pos = p;
 
-        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+        if (p == last) {
+            if (!last_buf) {
+                return NGX_AGAIN;
+            }
 
-            name.data = value[i].data + 5;
+            return (bk->format == LIMIT_REQ2_BULK_JSON && !bk->done)
+                   ? NGX_ERROR : NGX_DONE;
+        }
 
-            p = (u_char *) ngx_strchr(name.data, ':');
+        if (bk->done) {
+            return NGX_ERROR;
+        }
 
-            if (p == NULL) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "invalid zone size \"%V\"", &value[i]);
-                return NGX_CONF_ERROR;
+        if (bk->format == 0) {
+            if (*p == '[') {
+                bk->format = LIMIT_REQ2_BULK_JSON;
+                bk->pos++;
+                continue;
             }
 
-            name.len = p - name.data;
+            bk->format = LIMIT_REQ2_BULK_LINES;
+        }
 
-            s.data = p + 1;
-            s.len = value[i].data + value[i].len - s.data;
+        ngx_str_null(key);
+        *block_time = 0;
 
-            size = ngx_parse_size(&s);
+        if (bk->format == LIMIT_REQ2_BULK_LINES) {
 
-            if (size == NGX_ERROR) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "invalid zone size \"%V\"", &value[i]);
-                return NGX_CONF_ERROR;
-            }
+            eol = ngx_strlchr(p, last, '\n');
 
-            if (size < (ssize_t) (8 * ngx_pagesize)) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "zone \"%V\" is too small", &value[i]);
-                return NGX_CONF_ERROR;
+            if (eol == NULL) {
+                if (!last_buf) {
+                    return NGX_AGAIN;
+                }
+
+                eol = last;
             }
 
-            continue;
-        }
+            bk->pos = (eol < last) ? eol + 1 : eol;
 
-        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            while (eol > p && (eol[-1] == '\r' || eol[-1] == ' '
+                               || eol[-1] == '\t'))
+            {
+                eol--;
+            }
 
-            len = value[i].len;
-            p = value[i].data + len - 3;
+            if (*p == '#') {
+                continue;
+            }
 
-            if (ngx_strncmp(p, "r/s", 3) == 0) {
-                scale = 1;
-                len -= 3;
+            for (start = p; p < eol && *p != ' ' && *p != '\t'; p++) {
+                /* void */
+            }
 
-            } else if (ngx_strncmp(p, "r/m", 3) == 0) {
-                scale = 60;
-                len -= 3;
+            key->data = start;
+            key->len = p - start;
+
+            while (p < eol && (*p == ' ' || *p == '\t')) {
+                p++;
             }
 
-            rate = ngx_atoi(value[i].data + 5, len - 5);
-            if (rate <= 0) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "invalid rate \"%V\"", &value[i]);
-                return NGX_CONF_ERROR;
+            if (p < eol) {
+                *block_time = ngx_atoi(p, eol - p);
+
+                if (*block_time <= 0) {
+                    return NGX_DECLINED;
+                }
             }
 
-            continue;
+            return NGX_OK;
         }
 
-        if (value[i].data[0] == '$') {
+        /* LIMIT_REQ2_BULK_JSON */
 
-            value[i].len--;
-            value[i].data++;
+        if (*p == ']') {
+            bk->pos++;
+            bk->done = 1;
+            continue;
+        }
 
-            v = ngx_array_push(variables);
-            if (v == NULL) {
-                return NGX_CONF_ERROR;
+        if (*p == '"') {
+            rc = ngx_http_limit_req2_bulk_string(&bk->pos, last, key);
+
+            if (rc == NGX_AGAIN) {
+                return last_buf ? NGX_ERROR : NGX_AGAIN;
             }
 
-            v->index = ngx_http_get_variable_index(cf, &value[i]);
-            if (v->index == NGX_ERROR) {
-                return NGX_CONF_ERROR;
+            if (rc == NGX_ERROR) {
+                return NGX_DECLINED;
             }
 
-            v->var = value[i];
+            return NGX_OK;
+        }
 
-            continue;
+        if (*p != '{') {
+            return NGX_ERROR;
         }
 
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[i]);
-        return NGX_CONF_ERROR;
-    }
+        /* the end of the object, outside of its strings */
 
-    if (name.len == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "\"%V\" must have \"zone\" parameter",
-                           &cmd->name);
-        return NGX_CONF_ERROR;
-    }
+        depth = 0;
+        quoted = 0;
 
+        for (eol = p; eol < last; eol++) {
 
-    if (variables->nelts == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "no variable is defined for %V \"%V\"",
-                           &cmd->name, &name);
-        return NGX_CONF_ERROR;
-    }
+            if (quoted) {
+                if (*eol == '\\') {
+                    eol++;
 
-    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req2_ctx_t));
-    if (ctx == NULL) {
-        return NGX_CONF_ERROR;
-    }
-    ctx->rate = rate * 1000 / scale;
-    ctx->limit_vars = variables;
+                } else if (*eol == '"') {
+                    quoted = 0;
+                }
 
-    shm_zone = ngx_shared_memory_add(cf, &name, size,
-                                     &ngx_http_limit_req2_module);
-    if (shm_zone == NULL) {
-        return NGX_CONF_ERROR;
-    }
+                continue;
+            }
 
-    if (shm_zone->data) {
+            if (*eol == '"') {
+                quoted = 1;
 
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                   "limit_req2_zone \"%V\" is already bound to variable \"%V\"",
-                   &value[1], &v->var);
-        return NGX_CONF_ERROR;
-    }
+            } else if (*eol == '{') {
+                depth++;
 
-    shm_zone->init = ngx_http_limit_req2_init_zone;
-    shm_zone->data = ctx;
+            } else if (*eol == '}' && --depth == 0) {
+                break;
+            }
+        }
 
-    return NGX_CONF_OK;
+        if (eol >= last) {
+            return last_buf ? NGX_ERROR : NGX_AGAIN;
+        }
+
+        bk->pos = eol + 1;
+
+        return ngx_http_limit_req2_bulk_object(p, eol, key, block_time);
+    }
 }
 
-static char *
-ngx_http_limit_req2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+
+/* the keys parsed, each shard of the batch is locked once */
+
+static void
+ngx_http_limit_req2_bulk_apply(ngx_http_limit_req2_bulk_t *bk)
 {
-    ngx_http_limit_req2_conf_t    *lrcf = conf;
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, j, block_stop_time;
+    ngx_rbtree_node_t                *node;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_ban_t        *ban;
+    ngx_http_limit_req2_node_t       *lr;
+    ngx_http_limit_req2_shard_t      *shard;
+    ngx_http_limit_req2_bulk_key_t   *k;
+    ngx_http_limit_req2_replicate_t  *rp;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
 
-    ngx_int_t                      burst;
-    ngx_str_t                     *value, s, forbid_action;
+    ctx = bk->ctx;
+
+    for (i = 0; i < bk->nkeys; i++) {
+
+        shard = bk->keys[i].shard;
+
+        if (shard == NULL) {
+            continue;
+        }
+
+        (void) ngx_http_limit_req2_lock(ctx, shard);
+
+        for (j = i; j < bk->nkeys; j++) {
+            k = &bk->keys[j];
+
+            if (k->shard != shard) {
+                continue;
+            }
+
+            k->shard = NULL;
+
+            if (bk->lrcf->block_action == LIMIT_REQ2_BLOCK_ACTION_CLEAR) {
+
+                if (ngx_http_limit_req2_ban_clear(ctx, shard, &k->key)
+                    == NGX_OK)
+                {
+                    bk->cleared++;
+
+                } else {
+                    bk->missing++;
+                }
+
+                if (ctx->replicate) {
+                    ngx_http_limit_req2_replicate_add(ctx,
+                                                 LIMIT_REQ2_REPLICATE_CLEAR,
+                                                 &k->key, 0);
+                }
+
+                continue;
+            }
+
+            /* LIMIT_REQ2_BLOCK_ACTION_SET */
+
+            block_stop_time = ngx_time() + k->block_time;
+
+            ban = ngx_http_limit_req2_ban_find(shard, &k->key);
+
+            rc = ngx_http_limit_req2_ban_set(ctx, shard, &k->key,
+                                             block_stop_time);
+            if (rc != NGX_OK) {
+                bk->failed++;
+                continue;
+            }
+
+            if (ban) {
+                bk->updated++;
+
+            } else {
+                bk->added++;
+            }
+
+            node = ngx_http_limit_req2_find(ctx, shard, &k->key, 0);
+
+            if (node) {
+                lr = (ngx_http_limit_req2_node_t *) &node->color;
+                lr->block_stop = ngx_http_limit_req2_zone_sec(ctx,
+                                                             block_stop_time);
+            }
+
+            if (ctx->replicate) {
+                ngx_http_limit_req2_replicate_add(ctx,
+                                                  LIMIT_REQ2_REPLICATE_SET,
+                                                  &k->key, k->block_time);
+            }
+        }
+
+        ngx_http_limit_req2_unlock(ctx, shard);
+    }
+
+    if (bk->nkeys) {
+        bk->batches++;
+    }
+
+    /* a large body is sent on by the batch rather than dropped */
+
+    rp = ctx->replicate;
+
+    if (rp && (size_t) (rp->last - rp->start)
+              >= LIMIT_REQ2_REPLICATE_BUFFER / 2)
+    {
+        lmcf = ngx_http_get_module_main_conf(bk->request,
+                                             ngx_http_limit_req2_module);
+        ngx_http_limit_req2_replicate_send(lmcf->peers,
+                                           bk->lrcf->block_shm_zone);
+    }
+
+    bk->nkeys = 0;
+}
+
+
+/* parses the window up to its last complete item */
+
+static ngx_int_t
+ngx_http_limit_req2_bulk_run(ngx_http_limit_req2_bulk_t *bk,
+    ngx_uint_t last_buf)
+{
+    in_addr_t                        inaddr;
+    ngx_int_t                        rc, block_time;
+    ngx_str_t                        key;
+    ngx_http_limit_req2_hash_t      *h;
+    ngx_http_limit_req2_bulk_key_t  *k;
+
+    h = bk->ctx->hash;
+
+    for ( ;; ) {
+
+        rc = ngx_http_limit_req2_bulk_parse(bk, last_buf, &key, &block_time);
+
+        if (rc == NGX_AGAIN || rc == NGX_DONE || rc == NGX_ERROR) {
+            return rc;
+        }
+
+        bk->total++;
+
+        if (rc == NGX_DECLINED || key.len == 0 || key.len > 65535) {
+            bk->invalid++;
+            continue;
+        }
+
+        k = &bk->keys[bk->nkeys];
+
+        k->block_time = block_time ? block_time : bk->lrcf->block_time;
+        k->key.key = key;
+
+        /* as $binary_remote_addr */
+
+        if (bk->lrcf->block_bulk == LIMIT_REQ2_BULK_ADDR) {
+            inaddr = ngx_inet_addr(key.data, key.len);
+
+            if (inaddr != INADDR_NONE) {
+                ngx_memcpy(k->addr, &inaddr, 4);
+                k->key.key.len = 4;
+
+#if (NGX_HAVE_INET6)
+            } else if (ngx_inet6_addr(key.data, key.len, k->addr) == NGX_OK) {
+                k->key.key.len = 16;
+#endif
+
+            } else {
+                bk->invalid++;
+                continue;
+            }
+
+            k->key.key.data = k->addr;
+        }
+
+        k->key.hash = h->final ^ h->update(h->init, k->key.key.data,
+                                           k->key.key.len);
+        k->key.limit_vars = bk->lrcf->block_limit_vars;
+        k->key.hash_alg = h;
+        k->shard = ngx_http_limit_req2_shard(bk->ctx, k->key.hash);
+
+        if (++bk->nkeys == LIMIT_REQ2_BULK_BATCH) {
+            ngx_http_limit_req2_bulk_apply(bk);
+        }
+    }
+}
+
+
+/* adds up to len bytes of the body, from memory or from its file */
+
+static ngx_int_t
+ngx_http_limit_req2_bulk_fill(ngx_http_limit_req2_bulk_t *bk, u_char *data,
+    ngx_file_t *file, off_t offset, size_t len, size_t *n)
+{
+    size_t   size;
+    ssize_t  rc;
+
+    /* the keys point into the window, they are applied before it moves */
+
+    ngx_http_limit_req2_bulk_apply(bk);
+
+    size = bk->last - bk->pos;
+
+    if (bk->pos != bk->start) {
+        ngx_memmove(bk->start, bk->pos, size);
+        bk->pos = bk->start;
+        bk->last = bk->start + size;
+    }
+
+    size = ngx_min(len, (size_t) (bk->end - bk->last));
+
+    if (size == 0) {
+        ngx_log_error(NGX_LOG_ERR, bk->request->connection->log, 0,
+                      "limit_req2_block bulk item is more than %d bytes",
+                      LIMIT_REQ2_BULK_WINDOW);
+        return NGX_ERROR;
+    }
+
+    if (file) {
+        rc = ngx_read_file(file, bk->last, size, offset);
+
+        if (rc == NGX_ERROR || rc == 0) {
+            return NGX_ERROR;
+        }
+
+        size = rc;
+
+    } else {
+        ngx_memcpy(bk->last, data, size);
+    }
+
+    bk->last += size;
+    *n = size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_bulk(ngx_http_request_t *r, ngx_http_limit_req2_bulk_t *bk)
+{
+    off_t         offset;
+    size_t        n;
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    bk->start = ngx_pnalloc(r->pool, LIMIT_REQ2_BULK_WINDOW);
+    if (bk->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    bk->pos = bk->start;
+    bk->last = bk->start;
+    bk->end = bk->start + LIMIT_REQ2_BULK_WINDOW;
+
+    for (cl = r->request_body ? r->request_body->bufs : NULL;
+         cl;
+         cl = cl->next)
+    {
+        b = cl->buf;
+
+        if (b->in_file) {
+            for (offset = b->file_pos; offset < b->file_last; offset += n) {
+                if (ngx_http_limit_req2_bulk_fill(bk, NULL, b->file, offset,
+                                                  b->file_last - offset, &n)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                if (ngx_http_limit_req2_bulk_run(bk, 0) == NGX_ERROR) {
+                    ngx_http_limit_req2_bulk_apply(bk);
+                    return NGX_DECLINED;
+                }
+            }
+
+            continue;
+        }
+
+        for (offset = 0; offset < b->last - b->pos; offset += n) {
+            if (ngx_http_limit_req2_bulk_fill(bk, b->pos + offset, NULL, 0,
+                                              b->last - b->pos - offset, &n)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            if (ngx_http_limit_req2_bulk_run(bk, 0) == NGX_ERROR) {
+                ngx_http_limit_req2_bulk_apply(bk);
+                return NGX_DECLINED;
+            }
+        }
+    }
+
+    rc = ngx_http_limit_req2_bulk_run(bk, 1);
+
+    ngx_http_limit_req2_bulk_apply(bk);
+
+    return (rc == NGX_ERROR) ? NGX_DECLINED : NGX_OK;
+}
+
+
+/*
+ * limit_req2_block bulk: the keys of the body are set or cleared in
+ * batches, and the response sums them up.  A malformed body stops the
+ * request, the keys before it are applied.
+ */
+
+static void
+ngx_http_limit_req2_bulk_body(ngx_http_request_t *r)
+{
+    ngx_int_t                    rc;
+    ngx_buf_t                   *b;
+    ngx_http_limit_req2_bulk_t  *bk;
+
+    bk = ngx_pcalloc(r->pool, sizeof(ngx_http_limit_req2_bulk_t));
+    if (bk == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    bk->request = r;
+    bk->lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_req2_module);
+    bk->ctx = bk->lrcf->block_shm_zone->data;
+
+    rc = ngx_http_limit_req2_bulk(r, bk);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "limit_req2_block bulk %s, keys: %ui, added: %ui, "
+                  "updated: %ui, cleared: %ui, missing: %ui, failed: %ui, "
+                  "invalid: %ui, batches: %ui, zone: \"%V\"",
+                  bk->lrcf->block_action == LIMIT_REQ2_BLOCK_ACTION_SET
+                  ? "set" : "clear",
+                  bk->total, bk->added, bk->updated, bk->cleared,
+                  bk->missing, bk->failed, bk->invalid, bk->batches,
+                  &bk->lrcf->block_shm_zone->shm.name);
+
+    b = ngx_create_temp_buf(r->pool, 512);
+    if (b == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    b->last = ngx_sprintf(b->last,
+                  "{\"ret\": %s, \"keys\": %ui, \"added\": %ui, "
+                  "\"updated\": %ui, \"cleared\": %ui, \"missing\": %ui, "
+                  "\"failed\": %ui, \"invalid\": %ui%s}",
+                  rc == NGX_OK ? "true" : "false",
+                  bk->total, bk->added, bk->updated, bk->cleared,
+                  bk->missing, bk->failed, bk->invalid,
+                  rc == NGX_OK ? "" : ", \"errmsg\": \"malformed body\"");
+
+    ngx_http_finalize_request(r, ngx_http_limit_req2_send_json(r, b));
+}
+
+
+/* the key as a JSON string, or its hex if it is not printable */
+
+static u_char *
+ngx_http_limit_req2_dump_key(u_char *p, u_char *data, size_t len)
+{
+    size_t   i, n;
+
+    n = ngx_min(len, LIMIT_REQ2_DUMP_KEY_LEN);
+
+    for (i = 0; i < n; i++) {
+        if (data[i] < 0x20 || data[i] > 0x7e) {
+            p = ngx_cpymem(p, "\"key_hex\": \"", sizeof("\"key_hex\": \"") - 1);
+            p = ngx_hex_dump(p, data, n);
+            goto done;
+        }
+    }
+
+    p = ngx_cpymem(p, "\"key\": \"", sizeof("\"key\": \"") - 1);
+    p = (u_char *) ngx_escape_json(p, data, n);
+
+done:
+
+    return ngx_sprintf(p, "\", \"len\": %uz", len);
+}
+
+
+static u_char *
+ngx_http_limit_req2_dump_node(ngx_http_limit_req2_walk_t *walk, u_char *p,
+    u_char *end, ngx_rbtree_node_t *node)
+{
+    ngx_int_t                    excess;
+    ngx_msec_int_t               ms;
+    ngx_uint_t                   block_stop_time;
+    ngx_http_limit_req2_ctx_t   *ctx;
+    ngx_http_limit_req2_node_t  *lr;
+    ngx_http_limit_req2_state_t  state;
+
+    if (end - p < LIMIT_REQ2_DUMP_ENTRY_LEN) {
+        return NULL;
+    }
+
+    ctx = walk->ctx;
+    lr = (ngx_http_limit_req2_node_t *) &node->color;
+    state = lr->state;
+
+    /* the excess of the first tier as of now, as a request would see it */
+
+    ms = ngx_http_limit_req2_state_ms(state, walk->now);
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = ngx_http_limit_req2_state_excess(state)
+             - (ngx_int_t) (ctx->rates[0] * ms / 1000);
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    block_stop_time = 0;
+
+    if (lr->block_stop
+        && lr->block_stop >= ngx_http_limit_req2_zone_sec(ctx, walk->sec))
+    {
+        block_stop_time = ctx->sh->epoch + lr->block_stop;
+    }
+
+    p = ngx_cpymem(p, "{\"type\": \"node\", ",
+                   sizeof("{\"type\": \"node\", ") - 1);
+    p = ngx_http_limit_req2_dump_key(p, lr->data, lr->len);
+
+    return ngx_sprintf(p, ", \"excess\": \"%ui.%03ui\", \"last\": %M.%03M, "
+                       "\"block_stop_time\": %ui}\n",
+                       excess / 1000, excess % 1000,
+                       (walk->now - ms) / 1000, (walk->now - ms) % 1000,
+                       block_stop_time);
+}
+
+
+static u_char *
+ngx_http_limit_req2_dump_ban(ngx_http_limit_req2_walk_t *walk, u_char *p,
+    u_char *end, ngx_http_limit_req2_ban_t *ban)
+{
+    if (end - p < LIMIT_REQ2_DUMP_ENTRY_LEN) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(p, "{\"type\": \"ban\", ",
+                   sizeof("{\"type\": \"ban\", ") - 1);
+    p = ngx_http_limit_req2_dump_key(p, ban->data, ban->len);
+
+    return ngx_sprintf(p, ", \"block_stop_time\": %ui}\n", ban->expire.key);
+}
+
+
+/*
+ * Fills the buffer with a slice of the zone, see ngx_http_limit_req2_walk(),
+ * or with the end line after the last shard.
+ */
+
+static void
+ngx_http_limit_req2_dump_slice(ngx_http_limit_req2_dump_t *dump,
+    ngx_buf_t *b)
+{
+    b->last = ngx_http_limit_req2_walk(&dump->walk, b->last, b->end,
+                                       LIMIT_REQ2_DUMP_SLICE);
+
+    if (dump->walk.done) {
+        b->last = ngx_sprintf(b->last,
+                              "{\"type\": \"end\", \"nodes\": %ui, "
+                              "\"bans\": %ui}\n",
+                              dump->walk.nodes, dump->walk.bans);
+    }
+}
+
+
+/*
+ * Sends the slices as the client takes them, without holding a lock in
+ * between, and gives the event loop a turn every few slices.
+ */
+
+static void
+ngx_http_limit_req2_dump_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_uint_t                      n;
+    ngx_buf_t                      *b;
+    ngx_event_t                    *wev;
+    ngx_chain_t                    *cl;
+    ngx_connection_t               *c;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_limit_req2_dump_t     *dump;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
+
+    c = r->connection;
+    wev = c->write;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "limit_req2 dump: client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    rctx = ngx_http_limit_req2_get_ctx(r);
+    dump = rctx->dump;
+
+    for (n = 0; /* void */ ; n++) {
+
+        if (dump->busy) {
+            cl = NULL;
+            rc = ngx_http_output_filter(r, NULL);
+
+        } else {
+            if (n == LIMIT_REQ2_DUMP_SLICES) {
+                ngx_post_event(wev, &ngx_posted_events);
+                return;
+            }
+
+            cl = ngx_chain_get_free_buf(r->pool, &dump->free);
+            if (cl == NULL) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+
+            b = cl->buf;
+
+            if (b->start == NULL) {
+                b->start = ngx_palloc(r->pool, LIMIT_REQ2_DUMP_BUFFER);
+                if (b->start == NULL) {
+                    ngx_http_finalize_request(r, NGX_ERROR);
+                    return;
+                }
+
+                b->end = b->start + LIMIT_REQ2_DUMP_BUFFER;
+                b->tag = (ngx_buf_tag_t) &ngx_http_limit_req2_module;
+                b->temporary = 1;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+            b->flush = 1;
+
+            ngx_http_limit_req2_dump_slice(dump, b);
+
+            if (dump->walk.done) {
+                b->last_buf = (r == r->main) ? 1 : 0;
+                b->last_in_chain = 1;
+            }
+
+            rc = ngx_http_output_filter(r, cl);
+        }
+
+        ngx_chain_update_chains(r->pool, &dump->free, &dump->busy, &cl,
+                                (ngx_buf_tag_t) &ngx_http_limit_req2_module);
+
+        if (rc == NGX_ERROR || dump->walk.done) {
+            ngx_http_finalize_request(r, rc);
+            return;
+        }
+
+        if (dump->busy) {
+            break;
+        }
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!wev->ready) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_dump(ngx_http_request_t *r,
+    ngx_http_limit_req2_conf_t *lrcf)
+{
+    ngx_int_t                       rc;
+    ngx_http_limit_req2_dump_t     *dump;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    rctx = ngx_http_limit_req2_create_ctx(r);
+    if (rctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    dump = ngx_pcalloc(r->pool, sizeof(ngx_http_limit_req2_dump_t));
+    if (dump == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    dump->walk.ctx = lrcf->block_shm_zone->data;
+    dump->walk.node = ngx_http_limit_req2_dump_node;
+    dump->walk.ban = ngx_http_limit_req2_dump_ban;
+
+    rctx->dump = dump;
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "limit_req2_block dump, zone: \"%V\"",
+                  &lrcf->block_shm_zone->shm.name);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    ngx_str_set(&r->headers_out.content_type, "application/x-ndjson");
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    r->main->count++;
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_limit_req2_dump_handler;
+
+    ngx_http_limit_req2_dump_handler(r);
+
+    return NGX_DONE;
+}
+
+
+/*
+ * limit_req2_stats: the counters of every zone, summed over the worker
+ * copies, and the current number of nodes, bans and slab pages.  Nothing
+ * is locked, the figures are a snapshot that may be slightly inconsistent.
+ */
+
+static void
+ngx_http_limit_req2_report(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_req2_report_t *rep)
+{
+    ngx_uint_t                    i, k;
+    ngx_atomic_t                 *src, *dst;
+    ngx_http_limit_req2_ctx_t    *ctx;
+    ngx_http_limit_req2_shard_t  *shard;
+
+    ngx_memzero(rep, sizeof(ngx_http_limit_req2_report_t));
+
+    ctx = shm_zone->data;
+
+    dst = (ngx_atomic_t *) &rep->counters;
+
+    for (i = 0; i < LIMIT_REQ2_STATS_SLOTS; i++) {
+        src = (ngx_atomic_t *) (ctx->sh->stats + i * LIMIT_REQ2_STATS_STRIDE);
+
+        for (k = 0; k < sizeof(ngx_http_limit_req2_stats_t)
+                        / sizeof(ngx_atomic_t); k++)
+        {
+            dst[k] += src[k];
+        }
+    }
+
+    for (i = 0; i < ctx->sh->nshards; i++) {
+        shard = ctx->sh->shards[i];
+
+        rep->nodes += shard->nnodes;
+        rep->bans += shard->nbans;
+    }
+
+    rep->pages_free = ctx->shpool->pfree;
+    rep->pages_used = (ctx->shpool->last - ctx->shpool->pages)
+                      - ctx->shpool->pfree;
+}
+
+
+static u_char *
+ngx_http_limit_req2_histogram_json(u_char *p, char *name,
+    ngx_atomic_t *h, ngx_atomic_uint_t sum)
+{
+    ngx_uint_t         k;
+    ngx_atomic_uint_t  n;
+
+    for (n = 0, k = 0; k < LIMIT_REQ2_LOCK_BUCKETS; k++) {
+        n += h[k];
+    }
+
+    p = ngx_sprintf(p, ", \"%s\": {\"count\": %uA, \"sum_us\": %uA, "
+                    "\"buckets\": [", name, n, sum);
+
+    for (k = 0; k < LIMIT_REQ2_LOCK_BUCKETS; k++) {
+        p = ngx_sprintf(p, "%s%uA", k ? ", " : "", h[k]);
+    }
+
+    *p++ = ']';
+    *p++ = '}';
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_limit_req2_histogram_prometheus(u_char *p, char *name,
+    ngx_str_t *zone, ngx_atomic_t *h, ngx_atomic_uint_t sum)
+{
+    uint64_t           us;
+    ngx_uint_t         k;
+    ngx_atomic_uint_t  n;
+
+    for (n = 0, k = 0; k < LIMIT_REQ2_LOCK_BUCKETS - 1; k++) {
+        n += h[k];
+        us = (uint64_t) 1 << k;
+
+        p = ngx_sprintf(p, "limit_req2_%s_seconds_bucket"
+                        "{zone=\"%V\",le=\"%uL.%06uL\"} %uA\n",
+                        name, zone, us / 1000000, us % 1000000, n);
+    }
+
+    n += h[k];
+
+    p = ngx_sprintf(p, "limit_req2_%s_seconds_bucket"
+                    "{zone=\"%V\",le=\"+Inf\"} %uA\n", name, zone, n);
+
+    p = ngx_sprintf(p, "limit_req2_%s_seconds_sum{zone=\"%V\"} %uA.%06uA\n",
+                    name, zone, sum / 1000000, sum % 1000000);
+
+    return ngx_sprintf(p, "limit_req2_%s_seconds_count{zone=\"%V\"} %uA\n",
+                       name, zone, n);
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_stats_handler(ngx_http_request_t *r)
+{
+    char                            *lock;
+    size_t                           len;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i, k, n;
+    ngx_buf_t                       *b;
+    ngx_chain_t                      out;
+    ngx_shm_zone_t                 **zones;
+    ngx_http_limit_req2_metric_t    *m, *prev;
+    ngx_http_limit_req2_report_t    *reps;
+    ngx_http_limit_req2_ctx_t       *ctx;
+    ngx_http_limit_req2_conf_t      *lrcf;
+    ngx_http_limit_req2_main_conf_t *lmcf;
+
+    lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_req2_module);
+
+    if (lrcf->stats == LIMIT_REQ2_STATS_OFF) {
+        return NGX_DECLINED;
+    }
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_limit_req2_module);
+
+    zones = lmcf->zones.elts;
+
+    reps = ngx_palloc(r->pool, (lmcf->zones.nelts + 1)
+                               * sizeof(ngx_http_limit_req2_report_t));
+    if (reps == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    len = sizeof("{}\n");
+
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ngx_http_limit_req2_report(zones[i], &reps[i]);
+
+        for (m = ngx_http_limit_req2_metrics; m->name.len; m++) {
+            len += sizeof("# TYPE limit_req2_ counter\n") + m->metric.len
+                   + sizeof("limit_req2_{zone=\"\"} \n") + m->metric.len
+                   + m->labels.len + zones[i]->shm.name.len
+                   + NGX_ATOMIC_T_LEN;
+        }
+
+        ctx = zones[i]->data;
+
+        if (ctx->lock_stats) {
+            len += 2 * (sizeof("# TYPE limit_req2_lock_wait_seconds "
+                               "histogram\n")
+                        + (LIMIT_REQ2_LOCK_BUCKETS + 2)
+                          * (sizeof("limit_req2_lock_wait_seconds_bucket"
+                                    "{zone=\"\",le=\".000000\"} \n")
+                             + zones[i]->shm.name.len
+                             + 2 * NGX_ATOMIC_T_LEN));
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (lrcf->stats == LIMIT_REQ2_STATS_PROMETHEUS) {
+
+        prev = NULL;
+
+        for (m = ngx_http_limit_req2_metrics; m->name.len; m++) {
+
+            if (prev == NULL || prev->metric.len != m->metric.len
+                || ngx_strncmp(prev->metric.data, m->metric.data,
+                               m->metric.len) != 0)
+            {
+                b->last = ngx_sprintf(b->last, "# TYPE limit_req2_%V %s\n",
+                                      &m->metric, m->type);
+            }
+
+            for (i = 0; i < lmcf->zones.nelts; i++) {
+                b->last = ngx_sprintf(b->last,
+                                      "limit_req2_%V{zone=\"%V\"%V} %uA\n",
+                                      &m->metric, &zones[i]->shm.name,
+                                      &m->labels,
+                                      *(ngx_atomic_uint_t *)
+                                          ((u_char *) &reps[i] + m->offset));
+            }
+
+            prev = m;
+        }
+
+        for (k = 0; k < 2; k++) {
+            lock = k ? "lock_hold" : "lock_wait";
+            n = 0;
+
+            for (i = 0; i < lmcf->zones.nelts; i++) {
+                ctx = zones[i]->data;
+
+                if (!ctx->lock_stats) {
+                    continue;
+                }
+
+                if (n++ == 0) {
+                    b->last = ngx_sprintf(b->last,
+                                          "# TYPE limit_req2_%s_seconds "
+                                          "histogram\n", lock);
+                }
+
+                b->last = ngx_http_limit_req2_histogram_prometheus(b->last,
+                              lock, &zones[i]->shm.name,
+                              k ? reps[i].counters.lock_hold
+                                : reps[i].counters.lock_wait,
+                              k ? reps[i].counters.lock_hold_sum
+                                : reps[i].counters.lock_wait_sum);
+            }
+        }
+
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+
+    } else {
+
+        *b->last++ = '{';
+
+        for (i = 0; i < lmcf->zones.nelts; i++) {
+            b->last = ngx_sprintf(b->last, "%s\"%V\": {",
+                                  i ? ", " : "", &zones[i]->shm.name);
+
+            for (m = ngx_http_limit_req2_metrics; m->name.len; m++) {
+                b->last = ngx_sprintf(b->last, "%s\"%V\": %uA",
+                                      (m == ngx_http_limit_req2_metrics)
+                                      ? "" : ", ",
+                                      &m->name,
+                                      *(ngx_atomic_uint_t *)
+                                          ((u_char *) &reps[i] + m->offset));
+            }
+
+            ctx = zones[i]->data;
+
+            if (ctx->lock_stats) {
+                b->last = ngx_http_limit_req2_histogram_json(b->last,
+                              "lock_wait", reps[i].counters.lock_wait,
+                              reps[i].counters.lock_wait_sum);
+                b->last = ngx_http_limit_req2_histogram_json(b->last,
+                              "lock_hold", reps[i].counters.lock_hold,
+                              reps[i].counters.lock_hold_sum);
+            }
+
+            *b->last++ = '}';
+        }
+
+        *b->last++ = '}';
+        *b->last++ = LF;
+
+        ngx_str_set(&r->headers_out.content_type,
+                    "application/json;charset=UTF-8");
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static void *
+ngx_http_limit_req2_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_req2_main_conf_t  *lmcf;
+
+    lmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req2_main_conf_t));
+    if (lmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&lmcf->zones, cf->pool, 4, sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return lmcf;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i, k;
+    ngx_addr_t                       *peer;
+    ngx_event_t                      *ev;
+    ngx_shm_zone_t                  **zones;
+    ngx_core_conf_t                  *ccf;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_delay_t      *dq;
+    ngx_http_limit_req2_peers_t      *peers;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_req2_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+
+    zones = lmcf->zones.elts;
+
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
+
+        if (ctx->max_delayed) {
+            dq = ngx_pcalloc(cycle->pool, sizeof(ngx_http_limit_req2_delay_t));
+            if (dq == NULL) {
+                return NGX_ERROR;
+            }
+
+            for (k = 0; k < LIMIT_REQ2_DELAY_SLOTS; k++) {
+                ngx_queue_init(&dq->slots[k]);
+            }
+
+            dq->ctx = ctx;
+            dq->event.handler = ngx_http_limit_req2_delay_tick;
+            dq->event.data = dq;
+            dq->event.log = cycle->log;
+
+            ctx->delay = dq;
+        }
+
+        if (ctx->persist.len && ngx_worker == 0) {
+            ctx->snapshot = ngx_pcalloc(cycle->pool,
+                                       sizeof(ngx_http_limit_req2_snapshot_t));
+            if (ctx->snapshot == NULL) {
+                return NGX_ERROR;
+            }
+
+            ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+            if (ev == NULL) {
+                return NGX_ERROR;
+            }
+
+            ev->handler = ngx_http_limit_req2_persist;
+            ev->data = ctx;
+            ev->log = cycle->log;
+            ev->cancelable = 1;
+
+            ngx_add_timer(ev, ctx->persist_interval);
+        }
+
+        if (ctx->sweep == 0) {
+            continue;
+        }
+
+        ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+        if (ev == NULL) {
+            return NGX_ERROR;
+        }
+
+        ev->handler = ngx_http_limit_req2_sweep;
+        ev->data = ctx;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, ctx->sweep);
+    }
+
+    peers = lmcf->peers;
+
+    if (peers == NULL) {
+        return NGX_OK;
+    }
+
+    /* the workers of a node differ by pid, the nodes by address */
+
+    peers->id = (uint64_t) ngx_pid << 32 | (uint32_t) ngx_time();
+    peers->seq = 0;
+
+    /* the changes are sent from the listen address, if there is one */
+
+    peer = peers->listen.sockaddr ? &peers->listen : peers->peers.elts;
+
+    peers->fd = ngx_socket(peer->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (peers->fd == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(peers->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        return NGX_ERROR;
+    }
+
+    if (peers->listen.sockaddr) {
+        peer = ngx_palloc(cycle->pool, sizeof(ngx_addr_t));
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        *peer = peers->listen;
+
+        peer->sockaddr = ngx_palloc(cycle->pool, peer->socklen);
+        if (peer->sockaddr == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(peer->sockaddr, peers->listen.sockaddr, peer->socklen);
+        ngx_inet_set_port(peer->sockaddr, 0);
+
+        if (bind(peers->fd, peer->sockaddr, peer->socklen) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          "limit_req2 bind() to the address of %V failed",
+                          &peers->listen.name);
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_worker == 0 && peers->listen.sockaddr) {
+
+        /* the peers are expected to run as many workers as this node */
+
+        ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                               ngx_core_module);
+
+        peers->nsenders = LIMIT_REQ2_REPLICATE_SENDERS
+                          * (ngx_uint_t) ccf->worker_processes;
+
+        peers->senders = ngx_pcalloc(cycle->pool,
+                                     peers->peers.nelts * peers->nsenders
+                                     * sizeof(ngx_http_limit_req2_sender_t));
+        if (peers->senders == NULL) {
+            return NGX_ERROR;
+        }
+
+        peers->evicted = ngx_pcalloc(cycle->pool,
+                                     peers->peers.nelts * sizeof(time_t));
+        if (peers->evicted == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_http_limit_req2_replicate_listen(lmcf, cycle->log);
+    }
+
+    peers->event.handler = ngx_http_limit_req2_replicate_timer;
+    peers->event.data = lmcf;
+    peers->event.log = cycle->log;
+    peers->event.cancelable = 1;
+
+    ngx_add_timer(&peers->event, peers->interval);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req2_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_int_t                         rc;
+    ngx_uint_t                        i;
+    ngx_shm_zone_t                  **zones;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_peers_t      *peers;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_req2_module);
+    if (lmcf == NULL) {
+        return;
+    }
+
+    peers = lmcf->peers;
+
+    if (peers && peers->fd != (ngx_socket_t) -1) {
+        ngx_http_limit_req2_replicate_flush(lmcf);
+
+        if (peers->connection) {
+            ngx_close_connection(peers->connection);
+            peers->connection = NULL;
+        }
+
+        if (ngx_close_socket(peers->fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        peers->fd = (ngx_socket_t) -1;
+    }
+
+    if (ngx_worker != 0) {
+        return;
+    }
+
+    zones = lmcf->zones.elts;
+
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
+
+        if (ctx->snapshot == NULL) {
+            continue;
+        }
+
+        /* a snapshot in progress is finished */
+
+        do {
+            rc = ngx_http_limit_req2_snapshot(ctx, ctx->snapshot,
+                                              cycle->log);
+        } while (rc == NGX_AGAIN);
+    }
+}
+
+
+static void *
+ngx_http_limit_req2_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_req2_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req2_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->shm_zone = NULL;
+     *     conf->burst = 0;
+     *     conf->nodelay = 0;
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->limit_log_level = NGX_CONF_UNSET_UINT;
+    conf->status_code = NGX_CONF_UNSET_UINT;
+    conf->geo_var_index = NGX_CONF_UNSET;
+
+    conf->block_action = NGX_CONF_UNSET;
+    conf->block_time = 1800;
+    conf->block_shm_zone = NULL;
+    conf->block_limit_vars = NULL;
+    conf->block_bulk = NGX_CONF_UNSET_UINT;
+
+    conf->enable_record_rate = 0;
+
+    conf->stats = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_limit_req2_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_limit_req2_conf_t *prev = parent;
+    ngx_http_limit_req2_conf_t *conf = child;
+
+    if (conf->rules == NULL) {
+        conf->rules = prev->rules;
+    }
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
+                              NGX_LOG_ERR);
+
+    conf->delay_log_level = (conf->limit_log_level == NGX_LOG_INFO) ?
+                                NGX_LOG_INFO : conf->limit_log_level + 1;
+
+    ngx_conf_merge_uint_value(conf->status_code, prev->status_code,
+                              NGX_HTTP_SERVICE_UNAVAILABLE);
+
+    ngx_conf_merge_value(conf->geo_var_index, prev->geo_var_index,
+                         NGX_CONF_UNSET);
+
+    ngx_conf_merge_str_value(conf->geo_var_value, prev->geo_var_value, "");
+
+    ngx_conf_merge_value(conf->block_action, prev->block_action, 0);
+
+    ngx_conf_merge_uint_value(conf->stats, prev->stats, LIMIT_REQ2_STATS_OFF);
+
+    ngx_conf_merge_value(conf->block_time, prev->block_time, 1800);
+
+    if (conf->block_shm_zone == NULL) {
+        conf->block_shm_zone = prev->block_shm_zone;
+    }
+
+    if (conf->block_limit_vars == NULL) {
+        conf->block_limit_vars = prev->block_limit_vars;
+    }
+
+    ngx_conf_merge_uint_value(conf->block_bulk, prev->block_bulk,
+                              LIMIT_REQ2_BULK_OFF);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req2_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req2_main_conf_t *lmcf = conf;
+
+    u_char                         *p;
+    size_t                          len;
+    ssize_t                         size;
+    ngx_str_t                      *value, name, s;
+    ngx_int_t                       rate, scale, nshards, burst, arena;
+    ngx_int_t                       max_delayed;
+    ssize_t                         bans;
+    ngx_msec_t                      sweep, delay_tick, persist_interval;
+    ngx_str_t                       persist;
+    ngx_shm_zone_t                **zp;
+    ngx_int_t                       bursts[LIMIT_REQ2_MAX_TIERS];
+    ngx_uint_t                      i, index, ntiers, nbursts;
+    ngx_uint_t                      rates[LIMIT_REQ2_MAX_TIERS];
+    ngx_flag_t                      lockfree, lock_stats, replicate, cluster;
+    ngx_http_limit_req2_hash_t     *hash, *h;
+    ngx_array_t                    *variables;
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_http_limit_req2_ctx_t      *ctx;
+    ngx_http_limit_req2_variable_t *v;
+
+    value = cf->args->elts;
+
+    ctx = NULL;
+    v = NULL;
+    size = 0;
+    bans = 0;
+    arena = 0;
+    sweep = 0;
+    max_delayed = 0;
+    delay_tick = 0;
+    persist_interval = 0;
+    ngx_str_null(&persist);
+    ntiers = 0;
+    nbursts = 0;
+    nshards = 1;
+    index = LIMIT_REQ2_INDEX_RBTREE;
+    lockfree = 0;
+    lock_stats = 0;
+    replicate = 0;
+    cluster = 0;
+    hash = &ngx_http_limit_req2_hashes[0];
+    name.len = 0;
+
+    variables = ngx_array_create(cf->pool, 5,
+                                 sizeof(ngx_http_limit_req2_variable_t));
+    if (variables == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+
+            if (ntiers == LIMIT_REQ2_MAX_TIERS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "too many rates, maximum is %d",
+                                   LIMIT_REQ2_MAX_TIERS);
+                return NGX_CONF_ERROR;
+            }
+
+            len = value[i].len;
+            p = value[i].data + len - 3;
+            scale = 1;
+
+            if (ngx_strncmp(p, "r/s", 3) == 0) {
+                scale = 1;
+                len -= 3;
+
+            } else if (ngx_strncmp(p, "r/m", 3) == 0) {
+                scale = 60;
+                len -= 3;
+
+            } else if (ngx_strncmp(p, "r/h", 3) == 0) {
+                scale = 3600;
+                len -= 3;
+            }
+
+            rate = ngx_atoi(value[i].data + 5, len - 5);
+            if (rate <= 0 || rate * 1000 / scale == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            rates[ntiers++] = rate * 1000 / scale;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+
+            if (nbursts == LIMIT_REQ2_MAX_TIERS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "too many bursts, maximum is %d",
+                                   LIMIT_REQ2_MAX_TIERS);
+                return NGX_CONF_ERROR;
+            }
+
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (burst == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid burst rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            bursts[nbursts++] = burst;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "bans=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            bans = ngx_parse_size(&s);
+
+            if (bans == NGX_ERROR || bans < (ssize_t) (2 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid bans size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "arena=", 6) == 0) {
+
+            arena = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (arena <= 0 || arena > LIMIT_REQ2_ARENA_MAX_KEY_LEN) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid arena \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sweep=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            sweep = ngx_parse_time(&s, 0);
+            if (sweep == (ngx_msec_t) NGX_ERROR || sweep == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sweep \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_delayed=", 12) == 0) {
+
+            max_delayed = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (max_delayed <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_delayed \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "delay_tick=", 11) == 0) {
+
+            s.len = value[i].len - 11;
+            s.data = value[i].data + 11;
+
+            delay_tick = ngx_parse_time(&s, 0);
+            if (delay_tick == (ngx_msec_t) NGX_ERROR || delay_tick == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid delay_tick \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "persist=", 8) == 0) {
+
+            persist.len = value[i].len - 8;
+            persist.data = value[i].data + 8;
+
+            if (persist.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid persist \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &persist, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "persist_interval=", 17) == 0) {
+
+            s.len = value[i].len - 17;
+            s.data = value[i].data + 17;
+
+            persist_interval = ngx_parse_time(&s, 0);
+            if (persist_interval == (ngx_msec_t) NGX_ERROR
+                || persist_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid persist_interval \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hash=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            for (h = ngx_http_limit_req2_hashes; h->name.len; h++) {
+                if (h->name.len == s.len
+                    && ngx_strncmp(h->name.data, s.data, s.len) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (h->name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid hash \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            hash = h;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(value[i].data + 6, "rbtree") == 0) {
+                index = LIMIT_REQ2_INDEX_RBTREE;
+
+            } else if (ngx_strcmp(value[i].data + 6, "hash") == 0) {
+                index = LIMIT_REQ2_INDEX_HASH;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "lockfree") == 0) {
+
+#if (NGX_HTTP_LIMIT_REQ2_LOCKFREE)
+            lockfree = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"lockfree\" requires 64-bit atomic "
+                               "operations on this platform");
+            return NGX_CONF_ERROR;
+#endif
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "lock_stats") == 0) {
+            lock_stats = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "replicate") == 0) {
+            replicate = 1;
+            continue;
+        }
+
+        /* the bans of a zone limited across the peers are theirs too */
+
+        if (ngx_strcmp(value[i].data, "cluster") == 0) {
+            replicate = 1;
+            cluster = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            nshards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (nshards <= 0 || nshards > LIMIT_REQ2_MAX_SHARDS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (value[i].data[0] == '$') {
+
+            value[i].len--;
+            value[i].data++;
+
+            v = ngx_array_push(variables);
+            if (v == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            v->index = ngx_http_get_variable_index(cf, &value[i]);
+            if (v->index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            v->var = value[i];
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+
+    if (variables->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no variable is defined for %V \"%V\"",
+                           &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ntiers == 0) {
+        rates[ntiers++] = 1000;
+    }
+
+    if (bans == 0) {
+        bans = ngx_max(size / 8, (ssize_t) (2 * ngx_pagesize));
+    }
+
+    if (bans > size / 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "bans size of %V \"%V\" is more than "
+                           "half of the zone", &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (delay_tick && max_delayed == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" has \"delay_tick\" "
+                           "without \"max_delayed\"", &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (persist_interval && persist.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" has \"persist_interval\" "
+                           "without \"persist\"", &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (persist.len) {
+        zp = lmcf->zones.elts;
+
+        for (i = 0; i < lmcf->zones.nelts; i++) {
+            ctx = zp[i]->data;
+
+            if (ctx->persist.len == persist.len
+                && ngx_strncmp(ctx->persist.data, persist.data, persist.len)
+                   == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "%V \"%V\" persists to \"%V\" "
+                                   "as zone \"%V\" does",
+                                   &cmd->name, &name, &persist,
+                                   &zp[i]->shm.name);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    /* the name goes in one byte of a replicate datagram */
+
+    if (replicate && name.len > 255) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" is too long a name for \"%s\"",
+                           &cmd->name, &name,
+                           cluster ? "cluster" : "replicate");
+        return NGX_CONF_ERROR;
+    }
+
+    if (nbursts > ntiers) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" has more \"burst\" than \"rate\" "
+                           "parameters", &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req2_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < LIMIT_REQ2_MAX_TIERS; i++) {
+        ctx->rates[i] = (i < ntiers) ? rates[i] : 0;
+        ctx->bursts[i] = (i < nbursts) ? bursts[i] : NGX_CONF_UNSET;
+    }
+
+    ctx->ntiers = ntiers;
+    ctx->tiers_size = (ntiers - 1) * sizeof(uint32_t);
+    ctx->bans_size = ngx_align(bans, ngx_pagesize);
+    ctx->sweep = sweep;
+    ctx->max_delayed = max_delayed;
+    ctx->delay_tick = delay_tick ? delay_tick : LIMIT_REQ2_DELAY_TICK;
+    ctx->persist = persist;
+    ctx->persist_interval = persist_interval ? persist_interval
+                                             : LIMIT_REQ2_PERSIST_INTERVAL;
+
+    ctx->arena_key_len = arena;
+    ctx->cycle = cf->cycle;
+
+    ctx->ban_cache = ngx_pcalloc(cf->pool, LIMIT_REQ2_BAN_CACHE_SLOTS
+                                 * sizeof(ngx_http_limit_req2_ban_cache_t));
+    if (ctx->ban_cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (replicate) {
+        ctx->replicate = ngx_palloc(cf->pool,
+                                    sizeof(ngx_http_limit_req2_replicate_t));
+        if (ctx->replicate == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->replicate->start = ngx_palloc(cf->pool,
+                                           LIMIT_REQ2_REPLICATE_BUFFER);
+        if (ctx->replicate->start == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->replicate->last = ctx->replicate->start;
+        ctx->replicate->end = ctx->replicate->start
+                              + LIMIT_REQ2_REPLICATE_BUFFER;
+    }
+
+    if (cluster) {
+        ctx->deltas = ngx_pcalloc(cf->pool, LIMIT_REQ2_DELTA_SLOTS
+                                  * sizeof(ngx_http_limit_req2_delta_t));
+        if (ctx->deltas == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ctx->nshards = nshards;
+    ctx->index = index;
+    ctx->lockfree = lockfree;
+    ctx->lock_stats = lock_stats;
+    ctx->hash = hash;
+
+    ngx_http_limit_req2_hash_init(hash);
+
+    ctx->limit_vars = variables;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_limit_req2_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                   "limit_req2_zone \"%V\" is already bound to variable \"%V\"",
+                   &value[1], &v->var);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_limit_req2_init_zone;
+    shm_zone->data = ctx;
+
+    zp = ngx_array_push(&lmcf->zones);
+    if (zp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zp = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_limit_req2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req2_conf_t    *lrcf = conf;
+
+    ngx_int_t                      burst, lease;
+    ngx_msec_t                     lease_time;
+    ngx_str_t                     *value, s, forbid_action;
     ngx_uint_t                     i, nodelay;
     ngx_shm_zone_t                *shm_zone;
     ngx_http_limit_req2_t         *limit_req2;
+    ngx_http_limit_req2_ctx_t     *ctx;
     ngx_uint_t                     rate_seg;
     u_char                        *p1, *p2;
 
@@ -1543,6 +4112,8 @@ ngx_http_limit_req2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone = NULL;
     burst = 0;
     nodelay = 0;
+    lease = 0;
+    lease_time = 1000;
     ngx_str_null(&forbid_action);
     rate_seg = 0;
 
@@ -1574,24 +4145,51 @@ ngx_http_limit_req2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
-        if (ngx_strncmp(value[i].data, "forbid_action=", 14) == 0) {
+        if (ngx_strncmp(value[i].data, "forbid_action=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            if (s.len < 2 || (s.data[0] != '@' && s.data[0] != '/')) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid forbid_action \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            forbid_action = s;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "nodelay") == 0) {
+            nodelay = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lease=", 6) == 0) {
+
+            lease = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (lease < 2) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lease \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lease_time=", 11) == 0) {
 
-            s.len = value[i].len - 14;
-            s.data = value[i].data + 14;
+            s.len = value[i].len - 11;
+            s.data = value[i].data + 11;
 
-            if (s.len < 2 || (s.data[0] != '@' && s.data[0] != '/')) {
+            lease_time = ngx_parse_time(&s, 0);
+            if (lease_time == (ngx_msec_t) NGX_ERROR || lease_time == 0) {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "invalid forbid_action \"%V\"", &value[i]);
+                                   "invalid lease_time \"%V\"", &value[i]);
                 return NGX_CONF_ERROR;
             }
 
-            forbid_action = s;
-
-            continue;
-        }
-
-        if (ngx_strcmp(value[i].data, "nodelay") == 0) {
-            nodelay = 1;
             continue;
         }
 
@@ -1694,8 +4292,43 @@ ngx_http_limit_req2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ctx = shm_zone->data;
+
+    /* the bursts given in the zone override the burst of the rule */
+
+    for (i = 0; i < ctx->ntiers; i++) {
+        limit_req2->bursts[i] = (ctx->bursts[i] != NGX_CONF_UNSET)
+                                ? ctx->bursts[i] * 1000 : burst * 1000;
+    }
+
+    if (lease) {
+        if (!nodelay || rate_seg) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"lease\" requires \"nodelay\" and "
+                               "cannot be used with \"rate_seg\"");
+            return NGX_CONF_ERROR;
+        }
+
+        limit_req2->leases = ngx_pcalloc(cf->pool,
+                                 LIMIT_REQ2_LEASE_SLOTS
+                                 * sizeof(ngx_http_limit_req2_lease_t));
+        if (limit_req2->leases == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        limit_req2->lease = lease;
+        limit_req2->lease_time = lease_time;
+    }
+
+    if (rate_seg) {
+        ctx->seg_size = sizeof(ngx_http_limit_req2_node_seg_t);
+    }
+
+    if (limit_req2->block_stat_times) {
+        ctx->block_size = sizeof(ngx_http_limit_req2_node_block_t);
+    }
+
     limit_req2->shm_zone = shm_zone;
-    limit_req2->burst = burst * 1000;
     limit_req2->rate_seg = rate_seg;
     limit_req2->nodelay = nodelay;
     limit_req2->forbid_action = forbid_action;
@@ -1722,172 +4355,523 @@ ngx_http_limit_req2_whitelist(ngx_conf_t *cf, ngx_command_t *cmd,
 
     value = cf->args->elts;
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        if (ngx_strncmp(value[i].data, "geo_var_name=", 13) == 0) {
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "geo_var_name=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            lrcf->geo_var_name = s;
+
+            lrcf->geo_var_index = ngx_http_get_variable_index(cf,
+                &lrcf->geo_var_name);
+
+            if (lrcf->geo_var_index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "geo_var_value=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            lrcf->geo_var_value = s;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req2_block(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_limit_req2_conf_t  *lrcf = conf;
+    char                         *rv;
+    ngx_str_t                    s, *value;
+    ngx_int_t                    block_action = 0;
+    ngx_int_t                    block_time = 0;
+    ngx_uint_t                   i, bulk = LIMIT_REQ2_BULK_OFF;
+    ngx_shm_zone_t              *shm_zone = NULL;
+    ngx_array_t                 *variables;
+    ngx_http_limit_req2_variable_t  *v;
+
+    variables = ngx_array_create(cf->pool, 5,
+                                 sizeof(ngx_http_limit_req2_variable_t));
+    if (variables == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        rv = ngx_conf_set_flag_slot(cf, cmd, lrcf);
+        return rv;
+    }
+
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "action=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (ngx_strncmp(s.data, "query",  5) == 0) {
+                block_action = LIMIT_REQ2_BLOCK_ACTION_QUERY; /* query */
+            } else if (ngx_strncmp(s.data, "set",  3) == 0) {
+                block_action = LIMIT_REQ2_BLOCK_ACTION_SET; /* set */
+            } else if (ngx_strncmp(s.data, "clear", 5) == 0) {
+                block_action = LIMIT_REQ2_BLOCK_ACTION_CLEAR; /* clear */
+            } else if (ngx_strncmp(s.data, "dump", 4) == 0) {
+                block_action = LIMIT_REQ2_BLOCK_ACTION_DUMP; /* dump */
+            } else  {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                     "limit_req2_block invalid action \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            shm_zone = ngx_shared_memory_add(cf, &s, 0,
+                                                &ngx_http_limit_req2_module);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "block_time=", 11) == 0) {
+            s.len = value[i].len - 11;
+            s.data = value[i].data + 11;
+
+            block_time = ngx_atoi(s.data, s.len);
+            if (block_time <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                     "limit_req2_block invalid block_time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "bulk") == 0) {
+            bulk = LIMIT_REQ2_BULK_KEYS;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "bulk=addr") == 0) {
+            bulk = LIMIT_REQ2_BULK_ADDR;
+            continue;
+        }
+
+        if (value[i].data[0] == '$') {
+
+            value[i].len--;
+            value[i].data++;
+
+            v = ngx_array_push(variables);
+            if (v == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            v->index = ngx_http_get_variable_index(cf, &value[i]);
+            if (v->index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            v->var = value[i];
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "limit_req2_block invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (variables->nelts == 0 && bulk == LIMIT_REQ2_BULK_OFF
+        && block_action != LIMIT_REQ2_BLOCK_ACTION_DUMP)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "limit_req2_block no variable is defined \"%V\"",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (bulk != LIMIT_REQ2_BULK_OFF
+        && block_action != LIMIT_REQ2_BLOCK_ACTION_SET
+        && block_action != LIMIT_REQ2_BLOCK_ACTION_CLEAR)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "limit_req2_block \"bulk\" requires "
+                           "\"action=set\" or \"action=clear\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "limit_req2_block no zone gived \"%V\"",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+
+    lrcf->block_shm_zone = shm_zone;
+    lrcf->block_action = block_action;
+    /* without block_time= the default of 1800 seconds is kept */
+
+    if (block_time) {
+        lrcf->block_time = block_time;
+    }
+
+    lrcf->block_limit_vars = variables;
+    lrcf->block_bulk = bulk;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req2_replicate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req2_main_conf_t *lmcf = conf;
+
+    ngx_int_t                     rc;
+    ngx_str_t                    *value, s, secret;
+    ngx_uint_t                    i;
+    ngx_addr_t                   *addr, *peer;
+    ngx_http_limit_req2_peers_t  *peers;
+
+    if (lmcf->peers) {
+        return "is duplicate";
+    }
+
+    peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req2_peers_t));
+    if (peers == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&peers->peers, cf->pool, 4, sizeof(ngx_addr_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    ngx_str_null(&secret);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "secret=", 7) == 0) {
+
+            secret.len = value[i].len - 7;
+            secret.data = value[i].data + 7;
+
+            if (secret.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid secret \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            peers->interval = ngx_parse_time(&s, 0);
+            if (peers->interval == (ngx_msec_t) NGX_ERROR
+                || peers->interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "listen=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+            addr = &peers->listen;
+
+        } else if (ngx_strncmp(value[i].data, "peer=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            addr = ngx_array_push(&peers->peers);
+            if (addr == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        rc = ngx_parse_addr_port(cf->pool, addr, s.data, s.len);
+
+        if (rc == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (rc == NGX_DECLINED || ngx_inet_get_port(addr->sockaddr) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid address \"%V\", an address and "
+                               "a port are expected", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        addr->name = s;
+    }
 
-            s.len = value[i].len - 13;
-            s.data = value[i].data + 13;
+    if (peers->peers.nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"peer\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
 
-            lrcf->geo_var_name = s;
+    /* the peers apply bans and counts they receive, so they must be sure */
 
-            lrcf->geo_var_index = ngx_http_get_variable_index(cf,
-                &lrcf->geo_var_name);
+    if (secret.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"secret\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
 
-            if (lrcf->geo_var_index == NGX_ERROR) {
-                return NGX_CONF_ERROR;
-            }
+    ngx_http_limit_req2_replicate_secret(peers, &secret);
 
-            continue;
-        }
+    /*
+     * one socket sends to all of the peers; a peer that is the listen
+     * address is left out, so that every node can list all of them
+     */
 
-        if (ngx_strncmp(value[i].data, "geo_var_value=", 14) == 0) {
+    peer = peers->peers.elts;
+    addr = peers->listen.sockaddr ? &peers->listen : &peer[0];
 
-            s.len = value[i].len - 14;
-            s.data = value[i].data + 14;
+    for (i = 0; i < peers->peers.nelts; /* void */ ) {
 
-            lrcf->geo_var_value = s;
+        if (peer[i].sockaddr->sa_family != addr->sockaddr->sa_family) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "peer \"%V\" is not of the address family "
+                               "of \"%V\"", &peer[i].name, &addr->name);
+            return NGX_CONF_ERROR;
+        }
 
+        if (peers->listen.sockaddr
+            && ngx_cmp_sockaddr(peer[i].sockaddr, peer[i].socklen,
+                                peers->listen.sockaddr,
+                                peers->listen.socklen, 1)
+               == NGX_OK)
+        {
+            peer[i] = peer[--peers->peers.nelts];
             continue;
         }
 
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[i]);
-        return NGX_CONF_ERROR;
+        i++;
+    }
+
+    if (peers->interval == 0) {
+        peers->interval = LIMIT_REQ2_REPLICATE_INTERVAL;
     }
 
+    peers->fd = (ngx_socket_t) -1;
+
+    lmcf->peers = peers;
+
     return NGX_CONF_OK;
 }
 
+/*
+ * On a reload nginx reuses a zone of the same name and size, and calls the
+ * init of any other zone with no previous data.  A zone that cannot be
+ * taken over as is, as its size or layout changed, is made not reusable
+ * and its entries are moved from the previous zone by init_zone, unless
+ * its key is made of other variables.
+ */
 
-static char *
-ngx_http_limit_req2_block(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
+static void
+ngx_http_limit_req2_old_zones(ngx_conf_t *cf)
 {
-    ngx_http_limit_req2_conf_t  *lrcf = conf;
-    char                         *rv;
-    ngx_str_t                    s, *value;
-    ngx_int_t                    block_action = 0;
-    ngx_int_t                    block_time = 0;
-    ngx_uint_t                   i;
-    ngx_shm_zone_t              *shm_zone = NULL;
-    ngx_array_t                 *variables;
-    ngx_http_limit_req2_variable_t  *v;
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, n;
+    ngx_cycle_t                      *old;
+    ngx_list_part_t                  *part;
+    ngx_shm_zone_t                  **zones, *oshm_zone;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
 
-    variables = ngx_array_create(cf->pool, 5,
-                                 sizeof(ngx_http_limit_req2_variable_t));
-    if (variables == NULL) {
-        return NGX_CONF_ERROR;
+    old = cf->cycle->old_cycle;
+
+    if (ngx_is_init_cycle(old)) {
+        return;
     }
 
-    value = cf->args->elts;
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_limit_req2_module);
 
-    if (cf->args->nelts == 2) {
-        rv = ngx_conf_set_flag_slot(cf, cmd, lrcf);
-        return rv;
-    }
+    zones = lmcf->zones.elts;
 
+    for (i = 0; i < lmcf->zones.nelts; i++) {
 
-    for (i = 1; i < cf->args->nelts; i++) {
+        part = &old->shared_memory.part;
+        oshm_zone = part->elts;
 
-        if (ngx_strncmp(value[i].data, "action=", 7) == 0) {
-            s.len = value[i].len - 7;
-            s.data = value[i].data + 7;
+        for (n = 0; /* void */ ; n++) {
 
-            if (ngx_strncmp(s.data, "query",  5) == 0) {
-                block_action = LIMIT_REQ2_BLOCK_ACTION_QUERY; /* query */
-            } else if (ngx_strncmp(s.data, "set",  3) == 0) {
-                block_action = LIMIT_REQ2_BLOCK_ACTION_SET; /* set */
-            } else if (ngx_strncmp(s.data, "clear", 5) == 0) {
-                block_action = LIMIT_REQ2_BLOCK_ACTION_CLEAR; /* clear */
-            } else  {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                     "limit_req2_block invalid action \"%V\"", &value[i]);
-                return NGX_CONF_ERROR;
+            if (n >= part->nelts) {
+                if (part->next == NULL) {
+                    oshm_zone = NULL;
+                    break;
+                }
+
+                part = part->next;
+                oshm_zone = part->elts;
+                n = 0;
+            }
+
+            if (oshm_zone[n].tag == &ngx_http_limit_req2_module
+                && oshm_zone[n].shm.name.len == zones[i]->shm.name.len
+                && ngx_strncmp(oshm_zone[n].shm.name.data,
+                               zones[i]->shm.name.data,
+                               zones[i]->shm.name.len)
+                   == 0)
+            {
+                oshm_zone = &oshm_zone[n];
+                break;
             }
+        }
 
+        if (oshm_zone == NULL) {
             continue;
         }
 
-        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
-            s.len = value[i].len - 5;
-            s.data = value[i].data + 5;
+        ctx = zones[i]->data;
 
-            shm_zone = ngx_shared_memory_add(cf, &s, 0,
-                                                &ngx_http_limit_req2_module);
-            if (shm_zone == NULL) {
-                return NGX_CONF_ERROR;
-            }
+        rc = ngx_http_limit_req2_reusable(ctx, oshm_zone->data);
 
+        if (rc == NGX_OK && oshm_zone->shm.size == zones[i]->shm.size) {
             continue;
         }
 
-        if (ngx_strncmp(value[i].data, "block_time=", 11) == 0) {
-            s.len = value[i].len - 11;
-            s.data = value[i].data + 11;
+        zones[i]->noreuse = 1;
 
-            block_time = ngx_atoi(s.data, s.len);
-            if (block_time <= 0) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                     "limit_req2_block invalid block_time \"%V\"", &value[i]);
-            }
+        ctx->old_zone = oshm_zone;
+        ctx->migrate = (rc != NGX_ABORT);
 
-            continue;
+        if (rc == NGX_ABORT) {
+            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                               "limit_req2 zone \"%V\" uses other "
+                               "variables, its entries are not kept",
+                               &zones[i]->shm.name);
         }
+    }
+}
 
-        if (value[i].data[0] == '$') {
 
-            value[i].len--;
-            value[i].data++;
+/*
+ * The previous zones that were not reused are freed by nginx only if they
+ * are not reusable themselves.  This is set once the new cycle can no
+ * longer fail, as the previous cycle stays if it does.
+ */
 
-            v = ngx_array_push(variables);
-            if (v == NULL) {
-                return NGX_CONF_ERROR;
-            }
+static ngx_int_t
+ngx_http_limit_req2_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_shm_zone_t                  **zones;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_req2_module);
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
 
-            v->index = ngx_http_get_variable_index(cf, &value[i]);
-            if (v->index == NGX_ERROR) {
-                return NGX_CONF_ERROR;
-            }
+    zones = lmcf->zones.elts;
 
-            v->var = value[i];
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
 
-            continue;
+        if (ctx->old_zone) {
+            ctx->old_zone->noreuse = 1;
+            ctx->old_zone = NULL;
+            ctx->migrate = 0;
         }
-
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                    "limit_req2_block invalid parameter \"%V\"", &value[i]);
-        return NGX_CONF_ERROR;
     }
 
-    if (variables->nelts == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "limit_req2_block no variable is defined \"%V\"",
-                           &cmd->name);
-        return NGX_CONF_ERROR;
-    }
+    return NGX_OK;
+}
 
-    if (shm_zone == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "limit_req2_block no zone gived \"%V\"",
-                           &cmd->name);
-        return NGX_CONF_ERROR;
+
+static ngx_int_t
+ngx_http_limit_req2_check_replicate(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_shm_zone_t                  **zones;
+    ngx_http_limit_req2_ctx_t        *ctx;
+    ngx_http_limit_req2_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_limit_req2_module);
+
+    if (lmcf->peers) {
+        return NGX_OK;
     }
 
+    zones = lmcf->zones.elts;
 
-    lrcf->block_shm_zone = shm_zone;
-    lrcf->block_action = block_action;
-    lrcf->block_time = block_time;
-    lrcf->block_limit_vars = variables;
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
 
-    return NGX_CONF_OK;
+        if (ctx->replicate) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "limit_req2_zone \"%V\" has \"%s\" "
+                          "without \"limit_req2_replicate\"",
+                          &zones[i]->shm.name,
+                          ctx->deltas ? "cluster" : "replicate");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
 }
 
+
 static ngx_int_t
 ngx_http_limit_req2_init(ngx_conf_t *cf)
 {
     ngx_http_handler_pt        *h;
     ngx_http_core_main_conf_t  *cmcf;
 
+    if (ngx_http_limit_req2_check_replicate(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_limit_req2_old_zones(cf);
+
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
@@ -1904,6 +4888,13 @@ ngx_http_limit_req2_init(ngx_conf_t *cf)
 
     *h = ngx_http_limit_req2_block_handler;
 
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_limit_req2_stats_handler;
+
     return NGX_OK;
 }
 
@@ -1911,65 +4902,142 @@ static ngx_int_t
 ngx_http_limit_req2_rate_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_http_limit_req2_ctx_t      *ctx;
-    ngx_http_limit_req2_conf_t     *lrcf;
-    ngx_http_limit_req2_t          *limit_req2;
-    ngx_uint_t                      i, rate;
-    ngx_buf_t                      *b;
+    u_char                         *p;
+    ngx_uint_t                      rate;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
-    lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_req2_module);
-    if (lrcf->rules == NULL) {
+    rctx = ngx_http_limit_req2_get_ctx(r);
+
+    if (rctx == NULL || rctx->rate_span == 0) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    if (!lrcf->enable) {
+    p = ngx_pnalloc(r->pool, sizeof("COUNT=;SEG=;QPS=.000") - 1
+                             + 3 * NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    rate = rctx->rate_count * 1000 * 1000 / rctx->rate_span;
+
+    v->len = ngx_sprintf(p, "COUNT=%ui;SEG=%ui;QPS=%ui.%03ui",
+                         rctx->rate_count, rctx->rate_span,
+                         rate / 1000, rate % 1000)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_status_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_limit_req2_req_ctx_t  *rctx;
+
+    rctx = ngx_http_limit_req2_get_ctx(r);
+
+    if (rctx == NULL || rctx->status == 0) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    b = ngx_create_temp_buf(r->pool, 1024);
-    if (b == NULL) {
+    v->len = ngx_http_limit_req2_statuses[rctx->status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_http_limit_req2_statuses[rctx->status].data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req2_excess_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                         *p;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
+
+    rctx = ngx_http_limit_req2_get_ctx(r);
+
+    if (rctx == NULL || rctx->status == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN + sizeof(".000") - 1);
+    if (p == NULL) {
         return NGX_ERROR;
     }
 
-    limit_req2 = lrcf->rules->elts;
-    for (i = 0; i < lrcf->rules->nelts; i++) {
-        ctx = limit_req2[i].shm_zone->data;
+    v->len = ngx_sprintf(p, "%ui.%03ui",
+                         rctx->excess / 1000, rctx->excess % 1000)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
-        if (ctx == NULL) {
-            return NGX_ERROR;
-        }
+    return NGX_OK;
+}
 
-        if (ctx->rate_seg > 0) {
 
-            rate = (ctx->last_seg + ctx->curr_seg) * 1000 * 1000 /
-                        (ctx->rate_seg + ctx->curr_seg_time_diff);
+/* the zone that delayed, rejected or blocked the request */
 
-            b->last = ngx_sprintf(b->last, "COUNT=%ui;SEG=%ui;QPS=%ui.%03ui",
-                        ctx->last_seg + ctx->curr_seg,
-                        ctx->rate_seg + ctx->curr_seg_time_diff,
-                        rate / 1000, rate % 1000);
+static ngx_int_t
+ngx_http_limit_req2_zone_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_limit_req2_req_ctx_t  *rctx;
 
+    rctx = ngx_http_limit_req2_get_ctx(r);
 
-            v->len = b->last - b->pos;
+    if (rctx == NULL || rctx->zone == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-            v->data = ngx_pnalloc(r->pool, v->len);
-            if (v->data == NULL) {
-                return NGX_ERROR;
-            }
+    v->len = rctx->zone->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = rctx->zone->data;
 
-            v->valid = 1;
-            v->no_cacheable = 0;
-            v->not_found = 0;
+    return NGX_OK;
+}
 
-            ngx_memcpy(v->data, b->pos, v->len);
 
-            return NGX_OK;
-        }
+static ngx_int_t
+ngx_http_limit_req2_lock_wait_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                         *p;
+    ngx_http_limit_req2_req_ctx_t  *rctx;
+
+    rctx = ngx_http_limit_req2_get_ctx(r);
+
+    if (rctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    v->not_found = 1;
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", rctx->lock_wait) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
     return NGX_OK;
 }
 
@@ -1979,13 +5047,46 @@ ngx_http_limit_req2_add_variables(ngx_conf_t *cf)
 {
     ngx_http_variable_t  *var;
 
-    var = ngx_http_add_variable(cf, &ngx_http_limit_req2_rate, 0);
+    var = ngx_http_add_variable(cf, &ngx_http_limit_req2_rate,
+                                NGX_HTTP_VAR_NOCACHEABLE);
     if (var == NULL) {
         return NGX_ERROR;
     }
 
     var->get_handler = ngx_http_limit_req2_rate_variable;
 
+    var = ngx_http_add_variable(cf, &ngx_http_limit_req2_status,
+                                NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_limit_req2_status_variable;
+
+    var = ngx_http_add_variable(cf, &ngx_http_limit_req2_excess,
+                                NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_limit_req2_excess_variable;
+
+    var = ngx_http_add_variable(cf, &ngx_http_limit_req2_zone_name,
+                                NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_limit_req2_zone_variable;
+
+    var = ngx_http_add_variable(cf, &ngx_http_limit_req2_lock_wait,
+                                NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_limit_req2_lock_wait_variable;
+
     return NGX_OK;
 }
 